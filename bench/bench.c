@@ -0,0 +1,115 @@
+#include <stdio.h>
+
+#include "bench.h"
+#include "../src/alloc.h"
+#include "../src/utils.h"
+#include "../src/platform.h"
+
+typedef struct {
+	char name[64];
+	uint32_t ops;
+	uint32_t samples;
+	double min;
+	double median;
+	double p99;
+	double mean;
+} bench_result_t;
+
+static bench_result_t results[BENCH_RESULTS_MAX];
+static uint32_t results_len = 0;
+
+static bench_result_t *current = NULL;
+static double samples[BENCH_SAMPLES];
+static uint32_t samples_len = 0;
+static uint32_t warmup_left = 0;
+
+
+double bench_now(void) {
+	return platform_real_now();
+}
+
+void bench_begin(const char *name, uint32_t ops) {
+	error_if(current, "bench_begin() called before bench_end()");
+	error_if(results_len >= BENCH_RESULTS_MAX, "BENCH_RESULTS_MAX reached");
+
+	current = &results[results_len];
+	snprintf(current->name, sizeof(current->name), "%s", name);
+	current->ops = max(ops, 1);
+	samples_len = 0;
+	warmup_left = BENCH_WARMUP;
+}
+
+bool bench_sample(double seconds) {
+	error_if(!current, "bench_sample() called without bench_begin()");
+	if (warmup_left > 0) {
+		warmup_left--;
+	}
+	else if (samples_len < BENCH_SAMPLES) {
+		samples[samples_len++] = seconds;
+	}
+	return samples_len == BENCH_SAMPLES;
+}
+
+#define bench_sample_compare(a, b) ((a) > (b))
+
+void bench_end(void) {
+	error_if(!current, "bench_end() called without bench_begin()");
+	error_if(samples_len == 0, "No samples for benchmark %s", current->name);
+
+	sort(samples, samples_len, bench_sample_compare);
+
+	double sum = 0;
+	for (uint32_t i = 0; i < samples_len; i++) {
+		sum += samples[i];
+	}
+
+	// Nearest rank percentiles
+	current->samples = samples_len;
+	current->min = samples[0];
+	current->median = samples[(samples_len - 1) / 2];
+	current->p99 = samples[(uint32_t)ceil(samples_len * 0.99) - 1];
+	current->mean = sum / samples_len;
+
+	printf(
+		"%-32s median %10.3fus  (%.1fns/op)\n",
+		current->name, current->median * 1000000.0,
+		current->median * 1000000000.0 / current->ops
+	);
+
+	results_len++;
+	current = NULL;
+}
+
+void bench_report(void) {
+	printf("\nname,ops,samples,min_us,median_us,p99_us,mean_us,median_ns_per_op\n");
+	for (uint32_t i = 0; i < results_len; i++) {
+		bench_result_t *r = &results[i];
+		printf(
+			"%s,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+			r->name, r->ops, r->samples,
+			r->min * 1000000.0, r->median * 1000000.0, r->p99 * 1000000.0,
+			r->mean * 1000000.0, r->median * 1000000000.0 / r->ops
+		);
+	}
+
+	uint32_t json_size = 64 + results_len * 256;
+	char *json = temp_alloc(json_size);
+	uint32_t len = snprintf(json, json_size, "{\"results\":[");
+	for (uint32_t i = 0; i < results_len; i++) {
+		bench_result_t *r = &results[i];
+		len += snprintf(
+			json + len, json_size - len,
+			"%s\n\t{\"name\":\"%s\",\"ops\":%u,\"samples\":%u,\"min_us\":%.3f,"
+			"\"median_us\":%.3f,\"p99_us\":%.3f,\"mean_us\":%.3f}",
+			(i > 0 ? "," : ""), r->name, r->ops, r->samples,
+			r->min * 1000000.0, r->median * 1000000.0, r->p99 * 1000000.0,
+			r->mean * 1000000.0
+		);
+	}
+	len += snprintf(json + len, json_size - len, "\n]}\n");
+
+	if (platform_store_userdata(BENCH_RESULTS_FILE, json, len)) {
+		printf("\nWrote %s\n", BENCH_RESULTS_FILE);
+	}
+	temp_free(json);
+}
@@ -0,0 +1,68 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// A minimal benchmark harness. Each benchmark collects a number of samples;
+// each sample is the real (wall clock) time for a fixed number of operations.
+// The results are reported as min, median and 99th percentile per sample.
+
+// Benchmarks are either timed with bench_run():
+//   bench_run("trace/1000", 1000) {
+//       for (int i = 0; i < 1000; i++) { trace(...); }
+//   }
+// or, e.g. for benchmarks that span multiple frames, with bench_begin(),
+// bench_sample() and bench_end().
+
+#include "../src/types.h"
+
+// The number of samples for each benchmark
+#if !defined(BENCH_SAMPLES)
+	#define BENCH_SAMPLES 101
+#endif
+
+// The number of samples to discard at the start of each benchmark
+#if !defined(BENCH_WARMUP)
+	#define BENCH_WARMUP 5
+#endif
+
+// The maximum number of benchmark results
+#if !defined(BENCH_RESULTS_MAX)
+	#define BENCH_RESULTS_MAX 64
+#endif
+
+// The file (in the userdata directory) that the JSON results are written to
+#if !defined(BENCH_RESULTS_FILE)
+	#define BENCH_RESULTS_FILE "bench.json"
+#endif
+
+// The current real time in seconds; see platform_real_now()
+double bench_now(void);
+
+// Begin a benchmark with the given name, where each sample performs ops
+// operations.
+void bench_begin(const char *name, uint32_t ops);
+
+// Add a sample to the current benchmark. Returns true when all samples (after
+// the warmup) have been collected.
+bool bench_sample(double seconds);
+
+// End the current benchmark and compute its results
+void bench_end(void);
+
+// Print all results as CSV to stdout and store them as JSON in the
+// BENCH_RESULTS_FILE
+void bench_report(void);
+
+// Run the following block BENCH_WARMUP + BENCH_SAMPLES times and time each
+// run as one sample.
+#define bench_run(NAME, OPS) \
+	for ( \
+		bool _bench_done = (bench_begin(NAME, OPS), false); \
+		!_bench_done || (bench_end(), false); \
+	) \
+	for ( \
+		double _bench_start = bench_now(); \
+		_bench_start >= 0; \
+		_bench_done = bench_sample(bench_now() - _bench_start), _bench_start = -1 \
+	)
+
+#endif
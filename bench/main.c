@@ -0,0 +1,707 @@
+#include "main.h"
+#include "bench.h"
+
+#include "../src/engine.h"
+#include "../src/alloc.h"
+#include "../src/utils.h"
+#include "../src/platform.h"
+#include "../src/render.h"
+#include "../src/sound.h"
+#include "../src/trace.h"
+#include "../src/map.h"
+#include "../src/nav.h"
+
+#include "../libs/qoi.h"
+#include "../libs/qoa.h"
+
+// The benchmarks run in these scenes:
+// scene_micro runs all micro benchmarks in its first (and only) frame; the
+// data for these is set up in its init().
+// scene_entities runs entities_update() for each of the entity_scenes[] in
+// turn, one sample per frame.
+// scene_rollback simulates one frame, then rolls back BENCH_ROLLBACK_FRAMES 
+// with entity_world_load() and simulates them again, saving each one. The
+// result must be identical. Only the time for loading and saving is sampled.
+// scene_nav simulates BENCH_NAV_AGENTS agents that all request a new path at
+// once every BENCH_NAV_REPATH_FRAMES, with and without flow fields that are
+// computed at the same time. Only nav_update() is sampled, once per simulated
+// frame; it should not take much longer than NAV_BUDGET.
+
+#define BENCH_TRACE_MAP_SIZE 256
+#define BENCH_TRACE_RAYS 1000
+#define BENCH_TRACE_VERIFY_RAYS 100000
+#define BENCH_QUADS 1000
+#define BENCH_QUAD_TEXTURE_SIZE 64
+#define BENCH_SOUND_CHUNKS 16
+#define BENCH_SOUND_CHUNK_LEN 1024
+#define BENCH_QOI_SIZE 512
+#define BENCH_QOA_SECONDS 5
+#define BENCH_JSON_MAP_SIZE vec2i(512, 256)
+#define BENCH_JSON_ENTITIES 10000
+#define BENCH_ROLLBACK_ENTITIES 1000
+#define BENCH_ROLLBACK_FRAMES 8
+#define BENCH_ROLLBACK_TICK (1.0/60.0)
+#define BENCH_NAV_MAP_SIZE 128
+#define BENCH_NAV_AGENTS 200
+#define BENCH_NAV_REPATH_FRAMES 30
+
+static struct {
+	map_t *map;
+	map_t *slope_map;
+	vec2_t *from;
+	vec2_t *vel;
+	vec2_t *size;
+	trace_t *out;
+} trace_data;
+
+static struct {
+	texture_t texture;
+	quadverts_t *quads;
+} quad_data;
+
+static struct {
+	sound_t nodes[SOUND_MAX_NODES];
+	uint32_t nodes_len;
+	float *buffer;
+} sound_data;
+
+static struct {
+	uint8_t *data;
+	int len;
+} qoi_data;
+
+static struct {
+	uint8_t *data;
+	uint32_t len;
+	int16_t *samples;
+} qoa_data;
+
+static struct {
+	char *text;
+	uint32_t len;
+} json_data;
+
+static struct {
+	uint32_t count;
+	entity_broadphase_t broadphase;
+} entity_scenes[] = {
+	{1000,  ENTITY_BROADPHASE_SWEEP},
+	{10000, ENTITY_BROADPHASE_SWEEP},
+	{50000, ENTITY_BROADPHASE_SWEEP},
+	{1000,  ENTITY_BROADPHASE_GRID},
+	{10000, ENTITY_BROADPHASE_GRID},
+	{50000, ENTITY_BROADPHASE_GRID},
+};
+static uint32_t entity_scene_index = 0;
+static bool entity_scene_started = false;
+
+static struct {
+	entity_world_t *worlds[BENCH_ROLLBACK_FRAMES + 1];
+	uint32_t frame;
+	bool started;
+} rollback_data;
+
+static struct {
+	vec2_t agents[BENCH_NAV_AGENTS];
+	nav_ref_t paths[BENCH_NAV_AGENTS];
+} nav_data;
+
+static scene_t scene_micro;
+static scene_t scene_entities;
+static scene_t scene_rollback;
+static scene_t scene_nav;
+
+
+static void bench_touch(entity_t *self, entity_t *other) {
+	self->touches++;
+}
+
+entity_vtab_t entity_vtab_blob = {
+	.touch = bench_touch,
+};
+
+entity_vtab_t entity_vtab_bullet = {
+	.touch = bench_touch,
+};
+
+
+// Fill a map with random solid (1) and sloped (2..55) tiles, with a solid
+// border.
+static map_t *bench_collision_map(vec2i_t size, uint32_t solid_percent, uint32_t slope_percent) {
+	map_t *map = map_with_data(8, size, NULL);
+	for (int y = 0; y < size.y; y++) {
+		for (int x = 0; x < size.x; x++) {
+			uint16_t tile = 0;
+			uint32_t r = rand_int(0, 99);
+			if (x == 0 || y == 0 || x == size.x - 1 || y == size.y - 1 || r < solid_percent) {
+				tile = 1;
+			}
+			else if (r < solid_percent + slope_percent) {
+				tile = rand_int(2, 55);
+			}
+			map->data[y * size.x + x] = tile;
+		}
+	}
+	map_update_solid(map);
+	return map;
+}
+
+static void bench_trace_init(void) {
+	trace_data.map = bench_collision_map(vec2i(BENCH_TRACE_MAP_SIZE, BENCH_TRACE_MAP_SIZE), 10, 10);
+	trace_data.slope_map = bench_collision_map(vec2i(BENCH_TRACE_MAP_SIZE, BENCH_TRACE_MAP_SIZE), 2, 40);
+	trace_data.from = bump_alloc(sizeof(vec2_t) * BENCH_TRACE_RAYS);
+	trace_data.vel = bump_alloc(sizeof(vec2_t) * BENCH_TRACE_RAYS);
+	trace_data.size = bump_alloc(sizeof(vec2_t) * BENCH_TRACE_RAYS);
+	trace_data.out = bump_alloc(sizeof(trace_t) * BENCH_TRACE_RAYS);
+
+	float world_size = BENCH_TRACE_MAP_SIZE * 8;
+	for (int i = 0; i < BENCH_TRACE_RAYS; i++) {
+		trace_data.from[i] = vec2(rand_float(8, world_size - 16), rand_float(8, world_size - 16));
+		trace_data.vel[i] = vec2(rand_float(-64, 64), rand_float(-64, 64));
+		trace_data.size[i] = vec2(6, 6);
+	}
+}
+
+// Compare trace_batch() and trace() against trace() on a copy of the map 
+// without solid bitmaps, i.e. the plain per-tile walk, for random queries. 
+// This includes ones that start outside the map, don't move or have a velocity
+// of 0 on one axis. The results must be exactly the same.
+static void bench_trace_verify(void) {
+	uint32_t n = BENCH_TRACE_VERIFY_RAYS;
+	vec2_t *from = temp_alloc(sizeof(vec2_t) * n);
+	vec2_t *vel = temp_alloc(sizeof(vec2_t) * n);
+	vec2_t *size = temp_alloc(sizeof(vec2_t) * n);
+	trace_t *out = temp_alloc(sizeof(trace_t) * n);
+
+	float world_size = BENCH_TRACE_MAP_SIZE * 8;
+	for (uint32_t i = 0; i < n; i++) {
+		from[i] = vec2(rand_float(-64, world_size + 64), rand_float(-64, world_size + 64));
+		size[i] = vec2(rand_float(1, 32), rand_float(1, 32));
+		float speed = rand_int(0, 3) == 0 ? 256 : 16;
+		vel[i] = vec2(rand_float(-speed, speed), rand_float(-speed, speed));
+		switch (rand_int(0, 9)) {
+			case 0: vel[i].x = 0; break;
+			case 1: vel[i].y = 0; break;
+			case 2: vel[i] = vec2(0, 0); break;
+			case 3: from[i] = vec2(round(from[i].x), round(from[i].y)); break;
+		}
+	}
+
+	map_t plain_map = *trace_data.map;
+	plain_map.solid_rows = NULL;
+	plain_map.solid_cols = NULL;
+
+	uint32_t hits = 0;
+	trace_batch(trace_data.map, from, vel, size, out, n);
+	for (uint32_t i = 0; i < n; i++) {
+		trace_t plain = trace(&plain_map, from[i], vel[i], size[i]);
+		trace_t t = trace(trace_data.map, from[i], vel[i], size[i]);
+		error_if(memcmp(&t, &plain, sizeof(trace_t)) != 0, 
+			"trace() differs from the per-tile trace() for query %d: from %f %f, vel %f %f, size %f %f",
+			i, from[i].x, from[i].y, vel[i].x, vel[i].y, size[i].x, size[i].y
+		);
+		error_if(memcmp(&t, &out[i], sizeof(trace_t)) != 0, 
+			"trace_batch() differs from trace() for query %d: from %f %f, vel %f %f, size %f %f",
+			i, from[i].x, from[i].y, vel[i].x, vel[i].y, size[i].x, size[i].y
+		);
+		hits += t.tile != 0;
+	}
+	error_if(hits == 0, "No trace hit anything; are the solid bitmaps built?");
+
+	temp_free(out);
+	temp_free(size);
+	temp_free(vel);
+	temp_free(from);
+}
+
+static void bench_trace(void) {
+	float sum = 0;
+	bench_run("trace", BENCH_TRACE_RAYS) {
+		for (int i = 0; i < BENCH_TRACE_RAYS; i++) {
+			trace_t t = trace(trace_data.map, trace_data.from[i], trace_data.vel[i], vec2(6, 6));
+			sum += t.length;
+		}
+	}
+	error_if(sum < 0, "Invalid trace result");
+
+	bench_run("trace/slopes", BENCH_TRACE_RAYS) {
+		for (int i = 0; i < BENCH_TRACE_RAYS; i++) {
+			trace_t t = trace(trace_data.slope_map, trace_data.from[i], trace_data.vel[i], vec2(6, 6));
+			sum += t.length;
+		}
+	}
+
+	bench_trace_verify();
+	bench_run("trace_batch", BENCH_TRACE_RAYS) {
+		trace_batch(trace_data.map, trace_data.from, trace_data.vel, trace_data.size, trace_data.out, BENCH_TRACE_RAYS);
+	}
+
+	bench_run("trace_ray", BENCH_TRACE_RAYS) {
+		for (int i = 0; i < BENCH_TRACE_RAYS; i++) {
+			trace_data.out[i] = trace_ray(trace_data.map, trace_data.from[i], trace_data.vel[i]);
+		}
+	}
+
+	// A full circle of rays from one point, like a vision cone or a light
+	vec2_t origin = trace_data.from[0];
+	for (int i = 0; i < BENCH_TRACE_RAYS; i++) {
+		float angle = i * (2 * M_PI / BENCH_TRACE_RAYS);
+		trace_data.vel[i] = vec2(cosf(angle) * 256, sinf(angle) * 256);
+	}
+	bench_run("trace_rays", BENCH_TRACE_RAYS) {
+		trace_rays(trace_data.map, origin, trace_data.vel, trace_data.out, BENCH_TRACE_RAYS);
+	}
+}
+
+static void bench_render_init(void) {
+	uint32_t size = BENCH_QUAD_TEXTURE_SIZE;
+	rgba_t *pixels = temp_alloc(sizeof(rgba_t) * size * size);
+	for (uint32_t i = 0; i < size * size; i++) {
+		pixels[i] = rgba(i & 0xff, (i >> 8) & 0xff, 0x80, (i % 7) ? 0xff : 0x80);
+	}
+	quad_data.texture = texture_create(vec2i(size, size), pixels);
+	temp_free(pixels);
+
+	vec2i_t screen = platform_screen_size();
+	quad_data.quads = bump_alloc(sizeof(quadverts_t) * BENCH_QUADS);
+	for (int i = 0; i < BENCH_QUADS; i++) {
+		vec2_t pos = vec2(rand_float(-16, screen.x), rand_float(-16, screen.y));
+		vec2_t uv = vec2(rand_int(0, size - 16), rand_int(0, size - 16));
+		rgba_t color = (i % 2) ? rgba(255, 255, 255, 255) : rgba(255, 128, 64, 192);
+		quad_data.quads[i] = (quadverts_t){
+			.vertices = {
+				{.pos = {pos.x,      pos.y     }, .uv = {uv.x,      uv.y     }, .color = color},
+				{.pos = {pos.x + 16, pos.y     }, .uv = {uv.x + 16, uv.y     }, .color = color},
+				{.pos = {pos.x + 16, pos.y + 16}, .uv = {uv.x + 16, uv.y + 16}, .color = color},
+				{.pos = {pos.x,      pos.y + 16}, .uv = {uv.x,      uv.y + 16}, .color = color},
+			}
+		};
+	}
+}
+
+static void bench_render(void) {
+	bench_run("render_draw_quad", BENCH_QUADS) {
+		for (int i = 0; i < BENCH_QUADS; i++) {
+			render_draw_quad(&quad_data.quads[i], quad_data.texture);
+		}
+	}
+}
+
+static int16_t *bench_samples(uint32_t len, uint32_t channels) {
+	int16_t *samples = bump_alloc(sizeof(int16_t) * len * channels);
+	for (uint32_t i = 0; i < len; i++) {
+		for (uint32_t c = 0; c < channels; c++) {
+			float s = sin(i * (0.03 + c * 0.01)) * 0.5 + rand_float(-0.1, 0.1);
+			samples[i * channels + c] = s * 32767;
+		}
+	}
+	return samples;
+}
+
+static void bench_qoa_init(void) {
+	uint32_t samplerate = platform_samplerate();
+	uint32_t len = samplerate * BENCH_QOA_SECONDS;
+	qoa_data.samples = bench_samples(len, 2);
+
+	qoa_desc desc = {.channels = 2, .samplerate = samplerate, .samples = len};
+	unsigned int encoded_len;
+	void *encoded = qoa_encode(qoa_data.samples, &desc, &encoded_len);
+	error_if(!encoded, "Failed to encode QOA");
+
+	qoa_data.data = bump_alloc(encoded_len);
+	qoa_data.len = encoded_len;
+	memcpy(qoa_data.data, encoded, encoded_len);
+	free(encoded);
+
+	// Store it, so we can load it as a (streaming) sound source
+	platform_store_userdata("bench.qoa", qoa_data.data, qoa_data.len);
+}
+
+static void bench_qoa(void) {
+	qoa_desc desc;
+	uint32_t header_len = qoa_decode_header(qoa_data.data, qoa_data.len, &desc);
+	uint32_t frames = (desc.samples + QOA_FRAME_LEN - 1) / QOA_FRAME_LEN;
+	int16_t *samples = bump_alloc(sizeof(int16_t) * QOA_FRAME_LEN * desc.channels);
+
+	bench_run("qoa_decode_frame", frames) {
+		uint32_t pos = header_len;
+		for (uint32_t i = 0; i < frames; i++) {
+			unsigned int frame_len;
+			pos += qoa_decode_frame(qoa_data.data + pos, qoa_data.len - pos, &desc, samples, &frame_len);
+		}
+	}
+}
+
+static void bench_sound_init(void) {
+	uint32_t pcm_len = 32 * 1024;
+	sound_source_t *pcm = sound_source_with_samples(bench_samples(pcm_len, 1), pcm_len, 1, platform_samplerate());
+	sound_source_t *qoa = sound_source("bench.qoa");
+	error_if(!qoa, "Failed to load bench.qoa");
+
+	// Half of the voices play the uncompressed source, the other half the
+	// streaming QOA source
+	sound_data.nodes_len = 0;
+	for (int i = 0; i < SOUND_MAX_NODES; i++) {
+		sound_t node = sound(i % 2 ? qoa : pcm);
+		if (node.id == 0) {
+			break;
+		}
+		sound_set_loop(node, true);
+		sound_set_pitch(node, 1.0 + (i % 5) * 0.1);
+		sound_set_pan(node, rand_float(-1, 1));
+		sound_set_time(node, rand_float(0, 1));
+		sound_data.nodes[sound_data.nodes_len++] = node;
+	}
+	sound_data.buffer = bump_alloc(sizeof(float) * BENCH_SOUND_CHUNK_LEN * 2);
+}
+
+static void bench_sound(void) {
+	for (uint32_t i = 0; i < sound_data.nodes_len; i++) {
+		sound_unpause(sound_data.nodes[i]);
+	}
+
+	bench_run("sound_mix_stereo", BENCH_SOUND_CHUNKS) {
+		for (int i = 0; i < BENCH_SOUND_CHUNKS; i++) {
+			sound_mix_stereo(sound_data.buffer, BENCH_SOUND_CHUNK_LEN * 2);
+		}
+	}
+
+	for (uint32_t i = 0; i < sound_data.nodes_len; i++) {
+		sound_dispose(sound_data.nodes[i]);
+	}
+	sound_data.nodes_len = 0;
+}
+
+static void bench_qoi_init(void) {
+	// A synthetic image with gradients, flat areas and noise
+	uint32_t size = BENCH_QOI_SIZE;
+	rgba_t *pixels = temp_alloc(sizeof(rgba_t) * size * size);
+	for (uint32_t y = 0; y < size; y++) {
+		for (uint32_t x = 0; x < size; x++) {
+			rgba_t *px = &pixels[y * size + x];
+			if ((x / 32 + y / 32) % 3 == 0) {
+				*px = rgba(40, 40, 60, 255);
+			}
+			else if ((x / 32 + y / 32) % 3 == 1) {
+				*px = rgba(x, y, (x + y) / 2, 255);
+			}
+			else {
+				*px = rgba(rand_int(0, 255), rand_int(0, 255), rand_int(0, 255), rand_int(0, 1) * 255);
+			}
+		}
+	}
+
+	int len;
+	qoi_desc desc = {.width = size, .height = size, .channels = 4, .colorspace = QOI_SRGB};
+	void *encoded = qoi_encode(pixels, &desc, &len);
+	error_if(!encoded, "Failed to encode QOI");
+
+	qoi_data.data = bump_alloc(len);
+	qoi_data.len = len;
+	memcpy(qoi_data.data, encoded, len);
+	temp_free(encoded);
+	temp_free(pixels);
+}
+
+static void bench_qoi(void) {
+	bench_run("qoi_decode", 1) {
+		qoi_desc desc;
+		void *pixels = qoi_decode(qoi_data.data, qoi_data.len, &desc, 4);
+		error_if(!pixels, "Failed to decode QOI");
+		temp_free(pixels);
+	}
+}
+
+static void bench_json_init(void) {
+	// A level with two large maps and many entities with settings
+	vec2i_t map_size = BENCH_JSON_MAP_SIZE;
+	uint32_t capacity = map_size.x * map_size.y * 2 * 4 + BENCH_JSON_ENTITIES * 128 + 1024;
+	char *text = bump_alloc(capacity);
+	uint32_t len = 0;
+
+	len += snprintf(text + len, capacity - len, "{\"maps\":[");
+	for (int m = 0; m < 2; m++) {
+		len += snprintf(
+			text + len, capacity - len,
+			"%s{\"name\":\"%s\",\"width\":%d,\"height\":%d,\"tilesize\":8,\"distance\":1,\"data\":[",
+			(m > 0 ? "," : ""), (m == 0 ? "collision" : "background"), map_size.x, map_size.y
+		);
+		for (int y = 0; y < map_size.y; y++) {
+			len += snprintf(text + len, capacity - len, "%s[", (y > 0 ? "," : ""));
+			for (int x = 0; x < map_size.x; x++) {
+				len += snprintf(text + len, capacity - len, "%s%d", (x > 0 ? "," : ""), rand_int(0, 9) == 0 ? rand_int(1, 55) : 0);
+			}
+			len += snprintf(text + len, capacity - len, "]");
+		}
+		len += snprintf(text + len, capacity - len, "]}");
+	}
+
+	len += snprintf(text + len, capacity - len, "],\"entities\":[");
+	for (int i = 0; i < BENCH_JSON_ENTITIES; i++) {
+		len += snprintf(
+			text + len, capacity - len,
+			"%s{\"type\":\"blob\",\"x\":%d,\"y\":%d,\"settings\":{\"name\":\"blob%d\",\"health\":%.2f}}",
+			(i > 0 ? "," : ""), rand_int(0, 4096), rand_int(0, 2048), i, rand_float(1, 100)
+		);
+	}
+	len += snprintf(text + len, capacity - len, "]}");
+	error_if(len >= capacity, "JSON buffer too small");
+
+	json_data.text = text;
+	json_data.len = len;
+}
+
+static void bench_json(void) {
+	bench_run("json_parse", 1) {
+		json_t *json = json_parse((uint8_t *)json_data.text, json_data.len);
+		error_if(!json, "Failed to parse JSON");
+		temp_free(json);
+	}
+}
+
+
+static void scene_micro_init(void) {
+	rand_seed(1);
+	bench_trace_init();
+	bench_render_init();
+	bench_qoa_init();
+	bench_sound_init();
+	bench_qoi_init();
+	bench_json_init();
+}
+
+static void scene_micro_update(void) {
+	bench_trace();
+	bench_sound();
+	bench_qoa();
+	bench_qoi();
+	bench_json();
+}
+
+static void scene_micro_draw(void) {
+	// render_draw_quad() needs the screenbuffer that is only set up for draw
+	bench_render();
+	engine_set_scene(&scene_entities);
+}
+
+
+static void bench_spawn_entities(uint32_t count) {
+	// Scale the world with the number of entities, so that the density stays
+	// the same
+	int32_t map_size = sqrt(count) * 4;
+	engine_set_collision_map(bench_collision_map(vec2i(map_size, map_size), 2, 2));
+	float world_size = map_size * 8;
+
+	for (uint32_t i = 0; i < count; i++) {
+		vec2_t pos = vec2(rand_float(16, world_size - 32), rand_float(16, world_size - 32));
+		entity_t *ent = entity_spawn(i % 4 == 0 ? ENTITY_TYPE_BULLET : ENTITY_TYPE_BLOB, pos);
+		error_if(!ent, "Failed to spawn entity %d", i);
+
+		ent->size = vec2(rand_float(4, 12), rand_float(4, 12));
+		ent->vel = vec2(rand_float(-64, 64), rand_float(-64, 64));
+		if (ent->type == ENTITY_TYPE_BULLET) {
+			ent->physics = ENTITY_PHYSICS_WORLD;
+			ent->gravity = 0;
+			ent->check_against = ENTITY_GROUP_ENEMY;
+		}
+		else {
+			ent->physics = i % 3 ? ENTITY_PHYSICS_ACTIVE : ENTITY_PHYSICS_PASSIVE;
+			ent->group = ENTITY_GROUP_ENEMY;
+			ent->friction = vec2(2, 0);
+			ent->restitution = 0.5;
+		}
+	}
+}
+
+static void scene_entities_init(void) {
+	rand_seed(1);
+	entities_set_broadphase(entity_scenes[entity_scene_index].broadphase);
+	bench_spawn_entities(entity_scenes[entity_scene_index].count);
+	entity_scene_started = false;
+}
+
+static void scene_entities_update(void) {
+	char name[64];
+	snprintf(
+		name, sizeof(name), "entities_update/%s/%u",
+		entity_scenes[entity_scene_index].broadphase == ENTITY_BROADPHASE_GRID ? "grid" : "sweep",
+		entity_scenes[entity_scene_index].count
+	);
+
+	if (!entity_scene_started) {
+		bench_begin(name, entity_scenes[entity_scene_index].count);
+		entity_scene_started = true;
+	}
+
+	double start = bench_now();
+	entities_update();
+	if (!bench_sample(bench_now() - start)) {
+		return;
+	}
+
+	bench_end();
+	entity_scene_index++;
+	if (entity_scene_index < len(entity_scenes)) {
+		engine_set_scene(&scene_entities);
+	}
+	else {
+		engine_set_scene(&scene_rollback);
+	}
+}
+
+
+static void scene_rollback_init(void) {
+	rand_seed(1);
+	entities_set_broadphase(ENTITY_BROADPHASE_SWEEP);
+	bench_spawn_entities(BENCH_ROLLBACK_ENTITIES);
+	for (uint32_t i = 0; i < len(rollback_data.worlds); i++) {
+		rollback_data.worlds[i] = entity_world_create();
+	}
+	rollback_data.frame = 0;
+	rollback_data.started = false;
+	entity_world_save(rollback_data.worlds[0]);
+}
+
+static double bench_rollback_checksum(void) {
+	double sum = 0;
+	for (entity_type_t type = ENTITY_TYPE_NONE + 1; type < ENTITY_TYPES_COUNT; type++) {
+		for (entity_t *ent = entities_first_by_type(type); ent; ent = entities_next_by_type(ent)) {
+			sum += ent->pos.x * 3 + ent->pos.y * 7 + ent->vel.x * 11 + ent->vel.y * 13 + ent->touches;
+		}
+	}
+	return sum;
+}
+
+static void scene_rollback_update(void) {
+	if (!rollback_data.started) {
+		bench_begin("entity_world_save_load/1000", BENCH_ROLLBACK_FRAMES);
+		rollback_data.started = true;
+	}
+
+	// Simulation with a fixed tick, so that it can be repeated exactly
+	uint32_t worlds_len = len(rollback_data.worlds);
+	engine.tick = BENCH_ROLLBACK_TICK;
+	entities_update();
+	rollback_data.frame++;
+	entity_world_save(rollback_data.worlds[rollback_data.frame % worlds_len]);
+	if (rollback_data.frame < BENCH_ROLLBACK_FRAMES) {
+		return;
+	}
+
+	double checksum = bench_rollback_checksum();
+	double time = 0;
+
+	double start = bench_now();
+	uint32_t frame = rollback_data.frame - BENCH_ROLLBACK_FRAMES;
+	entity_world_load(rollback_data.worlds[frame % worlds_len]);
+	time += bench_now() - start;
+
+	for (uint32_t i = 0; i < BENCH_ROLLBACK_FRAMES; i++) {
+		entities_update();
+		frame++;
+
+		start = bench_now();
+		entity_world_save(rollback_data.worlds[frame % worlds_len]);
+		time += bench_now() - start;
+	}
+	error_if(checksum != bench_rollback_checksum(), "Rollback is not deterministic");
+
+	if (!bench_sample(time)) {
+		return;
+	}
+
+	bench_end();
+	engine_set_scene(&scene_nav);
+}
+
+
+static vec2_t bench_nav_walkable_pos(void) {
+	while (true) {
+		vec2i_t tile = vec2i(rand_int(1, BENCH_NAV_MAP_SIZE - 2), rand_int(1, BENCH_NAV_MAP_SIZE - 2));
+		if (nav_is_walkable(tile)) {
+			return vec2(tile.x * 8 + 4, tile.y * 8 + 4);
+		}
+	}
+}
+
+static void scene_nav_init(void) {
+	rand_seed(1);
+	engine_set_collision_map(bench_collision_map(vec2i(BENCH_NAV_MAP_SIZE, BENCH_NAV_MAP_SIZE), 5, 2));
+	nav_init();
+	for (uint32_t i = 0; i < BENCH_NAV_AGENTS; i++) {
+		nav_data.agents[i] = bench_nav_walkable_pos();
+	}
+}
+
+static void bench_nav(const char *name, uint32_t flow_fields) {
+	uint32_t found = 0;
+	bench_begin(name, BENCH_NAV_AGENTS);
+	for (uint32_t frame = 0; true; frame++) {
+		// All agents chase the same target, which jumps to a new place every
+		// BENCH_NAV_REPATH_FRAMES
+		if (frame % BENCH_NAV_REPATH_FRAMES == 0) {
+			vec2_t target = bench_nav_walkable_pos();
+			for (uint32_t i = 0; i < BENCH_NAV_AGENTS; i++) {
+				nav_data.paths[i] = nav_path_request(nav_data.agents[i], target);
+			}
+			for (uint32_t i = 0; i < flow_fields; i++) {
+				vec2_t targets[] = {target, bench_nav_walkable_pos()};
+				nav_flow_set_targets(i, targets, len(targets));
+			}
+		}
+
+		double start = bench_now();
+		nav_update();
+		bool done = bench_sample(bench_now() - start);
+
+		for (uint32_t i = 0; i < BENCH_NAV_AGENTS; i++) {
+			found += nav_path(nav_data.paths[i]).status == NAV_PATH_FOUND;
+		}
+		if (done) {
+			break;
+		}
+	}
+	bench_end();
+	error_if(found == 0, "No path found for %s", name);
+}
+
+static void scene_nav_update(void) {
+	bench_nav("nav_update/paths/200", 0);
+	bench_nav("nav_update/paths+flows/200", NAV_FLOW_FIELDS_MAX);
+
+	bench_report();
+	platform_exit();
+}
+
+
+static scene_t scene_micro = {
+	.init = scene_micro_init,
+	.update = scene_micro_update,
+	.draw = scene_micro_draw,
+};
+
+static scene_t scene_entities = {
+	.init = scene_entities_init,
+	.update = scene_entities_update,
+	.draw = scene_base_draw,
+};
+
+static scene_t scene_rollback = {
+	.init = scene_rollback_init,
+	.update = scene_rollback_update,
+	.draw = scene_base_draw,
+};
+
+static scene_t scene_nav = {
+	.init = scene_nav_init,
+	.update = scene_nav_update,
+	.draw = scene_base_draw,
+};
+
+void main_init(void) {
+	engine_set_scene(&scene_micro);
+}
+
+void main_cleanup(void) {
+
+}
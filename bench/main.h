@@ -0,0 +1,26 @@
+#ifndef BENCH_MAIN_H
+#define BENCH_MAIN_H
+
+// The game definitions for the benchmark runner. This is force-included into
+// all engine sources by the Makefile, just like a game would do.
+
+#include "../src/types.h"
+#include "../src/animation.h"
+
+typedef enum {
+	BENCH_MSG_NONE,
+} entity_message_t;
+
+#define ENTITY_TYPES(TYPE) \
+	TYPE(ENTITY_TYPE_BLOB, blob) \
+	TYPE(ENTITY_TYPE_BULLET, bullet)
+
+#include "../src/entity_def.h"
+
+ENTITY_DEFINE(
+	uint32_t touches;
+);
+
+#include "../src/entity.h"
+
+#endif
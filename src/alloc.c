@@ -1,73 +1,826 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "alloc.h"
 #include "utils.h"
 
-static uint8_t hunk[ALLOC_SIZE];
-static uint32_t bump_len = 0;
-static uint32_t temp_len = 0;
+#if ALLOC_VIRTUAL
+	#if defined(_WIN32)
+		#include <windows.h>
+	#elif defined(__EMSCRIPTEN__)
+		#error "ALLOC_VIRTUAL is not supported with emscripten"
+	#else
+		#include <sys/mman.h>
+	#endif
 
-static uint32_t temp_objects[ALLOC_TEMP_OBJECTS_MAX] = {};
-static uint32_t temp_objects_len;
+	_Static_assert(ALLOC_SIZE % ALLOC_VIRTUAL_COMMIT_SIZE == 0, "ALLOC_SIZE must be a multiple of ALLOC_VIRTUAL_COMMIT_SIZE");
+
+	static uint8_t *hunk = NULL;
+
+	// The number of committed bytes at the front (bump) and the back (temp) 
+	// of the hunk
+	static _Atomic uint32_t bump_committed = 0;
+	static uint32_t temp_committed = 0;
+	static atomic_flag commit_lock = ATOMIC_FLAG_INIT;
+
+	static void bump_commit(uint32_t len);
+	static void temp_commit(uint32_t len);
+#else
+	static uint8_t hunk[ALLOC_SIZE];
+	#define bump_commit(LEN)
+	#define temp_commit(LEN)
+#endif
+
+// The length of the bump region (low 32 bits) and the temp region (high 32 
+// bits). Both are kept in one atomic, so that a bump_alloc_atomic() on another
+// thread and a temp_alloc() on the main thread can't both take the same free
+// space in the middle of the hunk.
+static _Atomic uint64_t hunk_lens = 0;
+static uint32_t bump_high = 0;
+
+#define hunk_lens_bump(LENS) ((uint32_t)(LENS))
+#define hunk_lens_temp(LENS) ((uint32_t)((LENS) >> 32))
+
+static inline uint32_t bump_len(void) {
+	return hunk_lens_bump(atomic_load_explicit(&hunk_lens, memory_order_relaxed));
+}
+
+static inline uint32_t temp_len(void) {
+	return hunk_lens_temp(atomic_load_explicit(&hunk_lens, memory_order_relaxed));
+}
+
+// The address of this thread local variable is unique for each thread and
+// used to identify the owner of an arena.
+static _Thread_local uint8_t thread_tag;
+static _Thread_local arena_t *thread_arena = NULL;
+
+#if defined(ALLOC_DEBUG)
+	static void *main_thread = NULL;
+	#define assert_main_thread() do { \
+			if (!main_thread) { main_thread = &thread_tag; } \
+			error_if(main_thread != &thread_tag, "bump memory used from a thread other than the main thread"); \
+		} while (0)
+	#define assert_arena_owner(ARENA) \
+		error_if((ARENA)->owner != &thread_tag, "Arena used from a thread other than the one it is bound to")
+#else
+	#define assert_main_thread()
+	#define assert_arena_owner(ARENA)
+#endif
+
+// Each temp object is a block with a header in front and a footer behind the
+// data. The temp region grows down from the end of the hunk; the lowest block
+// is at ALLOC_SIZE - temp_len(). Freed blocks are merged with free neighbours 
+// and kept in a list of holes, unless they are the lowest block, in which 
+// case the temp region shrinks. So there are never two adjacent holes and the 
+// lowest block is never a hole.
+typedef struct {
+	uint32_t size; // including header and footer
+	uint32_t state;
+
+	// The offsets of the previous and next hole in the list; only valid for 
+	// holes
+	uint32_t prev;
+	uint32_t next;
+} temp_header_t;
+
+typedef struct {
+	uint32_t size;
+	uint32_t unused;
+} temp_footer_t;
+
+#define TEMP_BLOCK_USED 0x7e3b0001
+#define TEMP_BLOCK_FREE 0x7e3b0000
+#define TEMP_BLOCK_NONE 0xFFFFFFFF
+#define TEMP_BLOCK_OVERHEAD (sizeof(temp_header_t) + sizeof(temp_footer_t))
+
+static uint32_t temp_holes_first = TEMP_BLOCK_NONE;
+static uint32_t temp_objects_len = 0;
+
+#if ALLOC_INSTRUMENT
+	static void alloc_record(const char *site, uint32_t size, uint32_t bump_pos, bool is_temp);
+
+	// Print the report before we die, so we know who used up the hunk
+	#define alloc_report_if_full(LENS, SIZE) \
+		if (hunk_lens_bump(LENS) + hunk_lens_temp(LENS) + (SIZE) >= ALLOC_SIZE) { alloc_report(); }
+#else
+	#define alloc_record(SITE, SIZE, BUMP_POS, IS_TEMP)
+	#define alloc_report_if_full(LENS, SIZE)
+#endif
 
 bump_mark_t bump_mark(void) {
-	return (bump_mark_t){.index = bump_len};
+	return (bump_mark_t){.index = bump_len()};
 }
 
-void *bump_alloc(uint32_t size) {
-	error_if(bump_len + temp_len + size >= ALLOC_SIZE, "Failed to allocate %d bytes in hunk mem", size);
-	void *p = &hunk[bump_len];
-	bump_len += size;
-	memset(p, 0, size);
-	return p;
+// Grow the bump region by size bytes and return the index of the new space
+static uint32_t bump_reserve(uint32_t size) {
+	uint64_t lens = atomic_load_explicit(&hunk_lens, memory_order_relaxed);
+	do {
+		alloc_report_if_full(lens, size);
+		error_if(
+			hunk_lens_bump(lens) + hunk_lens_temp(lens) + size >= ALLOC_SIZE, 
+			"Failed to allocate %d bytes in hunk mem", size
+		);
+	} while (!atomic_compare_exchange_weak_explicit(
+		&hunk_lens, &lens, lens + size, memory_order_relaxed, memory_order_relaxed
+	));
+	uint32_t len = hunk_lens_bump(lens);
+	bump_commit(len + size);
+	return len;
+}
+
+static uint32_t bump_alloc_index(uint32_t size) {
+	uint32_t len = bump_reserve(size);
+	memset(&hunk[len], 0, size);
+	return len;
+}
+
+void *bump_alloc_at(uint32_t size, const char *site) {
+	assert_main_thread();
+	uint32_t index = bump_alloc_index(size);
+	alloc_record(site, size, index + size, false);
+	return &hunk[index];
+}
+
+void *bump_alloc_atomic_at(uint32_t size, const char *site) {
+	uint32_t index = bump_alloc_index(size);
+	alloc_record(site, size, index + size, false);
+	return &hunk[index];
+}
+
+void *(bump_alloc)(uint32_t size) {
+	return bump_alloc_at(size, NULL);
+}
+
+void *(bump_alloc_atomic)(uint32_t size) {
+	return bump_alloc_atomic_at(size, NULL);
 }
 
 void bump_reset(bump_mark_t mark) {
+	assert_main_thread();
 	error_if(mark.index > ALLOC_SIZE, "Invalid mem reset");
-	bump_len = mark.index;
+
+	// The bump position only grows until it is reset, so we only need to
+	// update the high water mark here.
+	uint64_t lens = atomic_load_explicit(&hunk_lens, memory_order_relaxed);
+	bump_high = max(bump_high, hunk_lens_bump(lens));
+	while (!atomic_compare_exchange_weak_explicit(
+		&hunk_lens, &lens, (lens & ~0xffffffffull) | mark.index, 
+		memory_order_relaxed, memory_order_relaxed
+	)) {}
 }
 
-void *bump_from_temp(void *temp, uint32_t offset, uint32_t size) {
+void *bump_mark_ptr(bump_mark_t mark) {
+	error_if(mark.index > ALLOC_SIZE, "Invalid mem mark");
+	return &hunk[mark.index];
+}
+
+uint32_t bump_high_water(void) {
+	return max(bump_high, bump_len());
+}
+
+void bump_high_water_reset(void) {
+	bump_high = bump_len();
+}
+
+void *bump_from_temp_at(void *temp, uint32_t offset, uint32_t size, const char *site) {
+	assert_main_thread();
 	temp_free(temp);
-	error_if(bump_len + temp_len + size >= ALLOC_SIZE, "Failed to allocate %d bytes in hunk mem", size);
-	void *p = &hunk[bump_len];
-	bump_len += size;
+	uint32_t index = bump_reserve(size);
+	void *p = &hunk[index];
 	memmove(p, (uint8_t *)temp + offset, size);
+	alloc_record(site, size, index + size, false);
 	return p;
 }
 
-void *temp_alloc(uint32_t size) {
+void *(bump_from_temp)(void *temp, uint32_t offset, uint32_t size) {
+	return bump_from_temp_at(temp, offset, size, NULL);
+}
+
+arena_t *arena_create(uint32_t size) {
+	arena_t *arena = bump_alloc(sizeof(arena_t));
+	arena->data = bump_alloc(size);
+	arena->size = size;
+	arena->len = 0;
+	arena->owner = &thread_tag;
+	return arena;
+}
+
+void arena_bind(arena_t *arena) {
+	arena->owner = &thread_tag;
+}
+
+void *arena_alloc(arena_t *arena, uint32_t size) {
+	assert_arena_owner(arena);
 	size = ((size + 7) >> 3) << 3; // align to 8 bytes
 
-	error_if(bump_len + temp_len + size >= ALLOC_SIZE, "Failed to allocate %d bytes in temp mem", size);
-	error_if(temp_objects_len >= ALLOC_TEMP_OBJECTS_MAX, "ALLOC_TEMP_OBJECTS_MAX reached");
+	error_if(arena->len + size > arena->size, "Failed to allocate %d bytes in arena mem", size);
+	void *p = &arena->data[arena->len];
+	arena->len += size;
+	memset(p, 0, size);
+	return p;
+}
 
-	temp_len += size;
-	void *p = &hunk[ALLOC_SIZE - temp_len];
-	temp_objects[temp_objects_len++] = temp_len;
+bump_mark_t arena_mark(arena_t *arena) {
+	assert_arena_owner(arena);
+	return (bump_mark_t){.index = arena->len};
+}
+
+void arena_reset(arena_t *arena, bump_mark_t mark) {
+	assert_arena_owner(arena);
+	error_if(mark.index > arena->size, "Invalid arena reset");
+	arena->len = mark.index;
+}
+
+arena_t *arena_set_current(arena_t *arena) {
+	arena_t *prev = thread_arena;
+	thread_arena = arena;
+	return prev;
+}
+
+arena_t *arena_current(void) {
+	return thread_arena;
+}
+
+void *scratch_alloc(uint32_t size) {
+	return thread_arena 
+		? arena_alloc(thread_arena, size)
+		: bump_alloc(size);
+}
+
+#define POOL_CACHE_LINE 64
+#define POOL_FREE_NONE 0xFFFFFFFF
+
+pool_t *pool_create_sized(uint32_t size, uint32_t capacity) {
+	error_if(size == 0 || capacity == 0, "Invalid pool size");
+
+	// Round small slots up to the next power of 2, so that they never straddle
+	// a cache line, and large slots up to a multiple of the cache line.
+	uint32_t slot_size = max(size, sizeof(uint32_t));
+	if (slot_size <= POOL_CACHE_LINE) {
+		slot_size--;
+		slot_size |= slot_size >> 1;
+		slot_size |= slot_size >> 2;
+		slot_size |= slot_size >> 4;
+		slot_size |= slot_size >> 8;
+		slot_size |= slot_size >> 16;
+		slot_size++;
+	}
+	else {
+		slot_size = (slot_size + POOL_CACHE_LINE - 1) & ~(POOL_CACHE_LINE - 1);
+	}
+
+	pool_t *pool = bump_alloc(sizeof(pool_t));
+	uint8_t *data = bump_alloc(slot_size * capacity + POOL_CACHE_LINE - 1);
+	pool->data = (uint8_t *)(((uintptr_t)data + POOL_CACHE_LINE - 1) & ~(uintptr_t)(POOL_CACHE_LINE - 1));
+	pool->live = bump_alloc(((capacity + 63) / 64) * sizeof(uint64_t));
+	pool->slot_size = slot_size;
+	pool->capacity = capacity;
+	pool_clear(pool);
+	return pool;
+}
+
+void *pool_alloc(pool_t *pool) {
+	uint32_t index;
+	if (pool->free_first != POOL_FREE_NONE) {
+		index = pool->free_first;
+		pool->free_first = *(uint32_t *)(pool->data + index * pool->slot_size);
+	}
+	else if (pool->used < pool->capacity) {
+		index = pool->used++;
+	}
+	else {
+		return NULL;
+	}
+
+	pool->live[index >> 6] |= 1ull << (index & 63);
+	pool->len++;
+	pool->high_water = max(pool->high_water, pool->len);
+
+	void *p = pool->data + index * pool->slot_size;
+	memset(p, 0, pool->slot_size);
 	return p;
 }
 
-void temp_free(void *p) {
-	uint32_t offset = (uint8_t *)&hunk[ALLOC_SIZE] - (uint8_t *)p;
-	error_if(offset > ALLOC_SIZE, "Object 0x%p not in temp hunk", p);
-
-	bool found = false;
-	uint32_t remaining_max = 0;
-	for (uint32_t i = 0; i < temp_objects_len; i++) {
-		if (temp_objects[i] == offset) {
-			temp_objects[i--] = temp_objects[--temp_objects_len];
-			found = true;
+void pool_free(pool_t *pool, void *p) {
+	uint32_t offset = (uint8_t *)p - pool->data;
+	uint32_t index = offset / pool->slot_size;
+	error_if(
+		(uint8_t *)p < pool->data || index >= pool->used || offset % pool->slot_size != 0, 
+		"Object 0x%p not in pool", p
+	);
+	error_if(!(pool->live[index >> 6] & (1ull << (index & 63))), "Object 0x%p already freed", p);
+
+	pool->live[index >> 6] &= ~(1ull << (index & 63));
+	pool->len--;
+
+	// The free list is threaded through the free slots
+	*(uint32_t *)p = pool->free_first;
+	pool->free_first = index;
+}
+
+void pool_clear(pool_t *pool) {
+	memset(pool->live, 0, ((pool->capacity + 63) / 64) * sizeof(uint64_t));
+	pool->used = 0;
+	pool->free_first = POOL_FREE_NONE;
+	pool->len = 0;
+}
+
+void *pool_next(pool_t *pool, void *prev) {
+	uint32_t index = prev
+		? ((uint8_t *)prev - pool->data) / pool->slot_size + 1
+		: 0;
+
+	while (index < pool->used) {
+		uint64_t bits = pool->live[index >> 6] >> (index & 63);
+		if (bits) {
+			index += __builtin_ctzll(bits);
+			return index < pool->used
+				? pool->data + index * pool->slot_size
+				: NULL;
+		}
+		index = (index | 63) + 1;
+	}
+	return NULL;
+}
+
+static inline temp_header_t *temp_header(uint32_t offset) {
+	return (temp_header_t *)&hunk[offset];
+}
+
+static inline temp_footer_t *temp_footer(uint32_t offset, uint32_t size) {
+	return (temp_footer_t *)&hunk[offset + size - sizeof(temp_footer_t)];
+}
+
+static void temp_block_write(uint32_t offset, uint32_t size, uint32_t state) {
+	temp_header(offset)->size = size;
+	temp_header(offset)->state = state;
+	temp_footer(offset, size)->size = size;
+}
+
+static void temp_hole_insert(uint32_t offset) {
+	temp_header_t *h = temp_header(offset);
+	h->prev = TEMP_BLOCK_NONE;
+	h->next = temp_holes_first;
+	if (temp_holes_first != TEMP_BLOCK_NONE) {
+		temp_header(temp_holes_first)->prev = offset;
+	}
+	temp_holes_first = offset;
+}
+
+static void temp_hole_remove(uint32_t offset) {
+	temp_header_t *h = temp_header(offset);
+	if (h->prev != TEMP_BLOCK_NONE) {
+		temp_header(h->prev)->next = h->next;
+	}
+	else {
+		temp_holes_first = h->next;
+	}
+	if (h->next != TEMP_BLOCK_NONE) {
+		temp_header(h->next)->prev = h->prev;
+	}
+}
+
+void *temp_alloc_at(uint32_t size, const char *site) {
+	assert_main_thread();
+	size = ((size + 7) >> 3) << 3; // align to 8 bytes
+	uint32_t block_size = size + TEMP_BLOCK_OVERHEAD;
+
+	// Take the first hole that is large enough. If the rest of the hole is 
+	// large enough for another block, split it and keep the lower part as the
+	// hole.
+	uint32_t offset = TEMP_BLOCK_NONE;
+	for (uint32_t h = temp_holes_first; h != TEMP_BLOCK_NONE; h = temp_header(h)->next) {
+		uint32_t hole_size = temp_header(h)->size;
+		if (hole_size >= block_size) {
+			if (hole_size - block_size >= TEMP_BLOCK_OVERHEAD + 8) {
+				temp_block_write(h, hole_size - block_size, TEMP_BLOCK_FREE);
+				offset = h + hole_size - block_size;
+			}
+			else {
+				temp_hole_remove(h);
+				block_size = hole_size;
+				offset = h;
+			}
+			break;
 		}
-		else if (temp_objects[i] > remaining_max) {
-			remaining_max = temp_objects[i];
+	}
+
+	// No hole found; grow the temp region
+	if (offset == TEMP_BLOCK_NONE) {
+		uint64_t lens = atomic_load_explicit(&hunk_lens, memory_order_relaxed);
+		do {
+			alloc_report_if_full(lens, block_size);
+			error_if(
+				hunk_lens_bump(lens) + hunk_lens_temp(lens) + block_size >= ALLOC_SIZE, 
+				"Failed to allocate %d bytes in temp mem", size
+			);
+		} while (!atomic_compare_exchange_weak_explicit(
+			&hunk_lens, &lens, lens + ((uint64_t)block_size << 32), 
+			memory_order_relaxed, memory_order_relaxed
+		));
+		uint32_t len = hunk_lens_temp(lens) + block_size;
+		temp_commit(len);
+		offset = ALLOC_SIZE - len;
+	}
+
+	temp_block_write(offset, block_size, TEMP_BLOCK_USED);
+	temp_objects_len++;
+	alloc_record(site, size, bump_len(), true);
+	return &hunk[offset + sizeof(temp_header_t)];
+}
+
+void *(temp_alloc)(uint32_t size) {
+	return temp_alloc_at(size, NULL);
+}
+
+void temp_free(void *p) {
+	assert_main_thread();
+	uint32_t temp_start = ALLOC_SIZE - temp_len();
+	uint32_t offset = (uint8_t *)p - (uint8_t *)&hunk[sizeof(temp_header_t)];
+	error_if(
+		(uint8_t *)p < &hunk[sizeof(temp_header_t)] || offset < temp_start || offset >= ALLOC_SIZE ||
+		temp_header(offset)->state != TEMP_BLOCK_USED, 
+		"Object 0x%p not in temp hunk", p
+	);
+
+	// Headers that are merged into a larger hole are invalidated, so that a
+	// double free is still detected.
+	uint32_t size = temp_header(offset)->size;
+	temp_header(offset)->state = 0;
+	temp_objects_len--;
+
+	// Merge with the hole above (older)
+	uint32_t above = offset + size;
+	if (above < ALLOC_SIZE && temp_header(above)->state == TEMP_BLOCK_FREE) {
+		temp_hole_remove(above);
+		temp_header(above)->state = 0;
+		size += temp_header(above)->size;
+	}
+
+	// Merge with the hole below (newer)
+	if (offset > temp_start) {
+		uint32_t below_size = ((temp_footer_t *)&hunk[offset - sizeof(temp_footer_t)])->size;
+		uint32_t below = offset - below_size;
+		if (temp_header(below)->state == TEMP_BLOCK_FREE) {
+			temp_hole_remove(below);
+			offset = below;
+			size += below_size;
 		}
 	}
-	error_if(!found, "Object 0x%p not in temp hunk", p);
-	temp_len = remaining_max;
+
+	// Give the space back if this is the lowest block. The block above can not
+	// be a hole, since we just merged it.
+	if (offset == temp_start) {
+		temp_header(offset)->state = 0;
+		atomic_fetch_sub_explicit(&hunk_lens, (uint64_t)size << 32, memory_order_relaxed);
+	}
+	else {
+		temp_block_write(offset, size, TEMP_BLOCK_FREE);
+		temp_hole_insert(offset);
+	}
 }
 
 void temp_alloc_check(void) {
-	error_if(temp_len != 0, "Temp memory not free: %d object(s)", temp_objects_len);
+	error_if(temp_len() != 0, "Temp memory not free: %d object(s)", temp_objects_len);
+}
+
+
+#if ALLOC_VIRTUAL
+
+#define commit_align_up(N) \
+	(((N) + ALLOC_VIRTUAL_COMMIT_SIZE - 1) / ALLOC_VIRTUAL_COMMIT_SIZE * ALLOC_VIRTUAL_COMMIT_SIZE)
+#define commit_align_down(N) \
+	((N) / ALLOC_VIRTUAL_COMMIT_SIZE * ALLOC_VIRTUAL_COMMIT_SIZE)
+
+// Reserve the address space before main(), so the hunk is valid even for 
+// zero sized allocations.
+__attribute__((constructor)) static void hunk_reserve(void) {
+	#if defined(_WIN32)
+		hunk = VirtualAlloc(NULL, ALLOC_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+		error_if(!hunk, "Failed to reserve %d bytes for the hunk", ALLOC_SIZE);
+	#else
+		void *p = mmap(NULL, ALLOC_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		error_if(p == MAP_FAILED, "Failed to reserve %d bytes for the hunk", ALLOC_SIZE);
+		hunk = p;
+	#endif
+}
+
+static void hunk_commit(uint32_t offset, uint32_t size) {
+	#if defined(_WIN32)
+		error_if(!VirtualAlloc(hunk + offset, size, MEM_COMMIT, PAGE_READWRITE), "Failed to commit %d bytes in hunk mem", size);
+	#else
+		error_if(mprotect(hunk + offset, size, PROT_READ | PROT_WRITE) != 0, "Failed to commit %d bytes in hunk mem", size);
+	#endif
+}
+
+static void hunk_decommit(uint32_t offset, uint32_t size) {
+	if (size == 0) {
+		return;
+	}
+	#if defined(_WIN32)
+		VirtualFree(hunk + offset, size, MEM_DECOMMIT);
+	#else
+		madvise(hunk + offset, size, MADV_DONTNEED);
+		mprotect(hunk + offset, size, PROT_NONE);
+	#endif
+}
+
+// Ensure that the first `len` bytes of the hunk are committed. Called from 
+// any thread through bump_alloc_atomic().
+static void bump_commit(uint32_t len) {
+	if (len <= atomic_load_explicit(&bump_committed, memory_order_acquire)) {
+		return;
+	}
+
+	while (atomic_flag_test_and_set_explicit(&commit_lock, memory_order_acquire)) {}
+	uint32_t committed = atomic_load_explicit(&bump_committed, memory_order_relaxed);
+	if (len > committed) {
+		uint32_t end = commit_align_up(len);
+		hunk_commit(committed, end - committed);
+		atomic_store_explicit(&bump_committed, end, memory_order_release);
+	}
+	atomic_flag_clear_explicit(&commit_lock, memory_order_release);
+}
+
+// Ensure that the last `len` bytes of the hunk are committed
+static void temp_commit(uint32_t len) {
+	if (len <= temp_committed) {
+		return;
+	}
+
+	while (atomic_flag_test_and_set_explicit(&commit_lock, memory_order_acquire)) {}
+	uint32_t end = commit_align_up(len);
+	hunk_commit(ALLOC_SIZE - end, end - temp_committed);
+	temp_committed = end;
+	atomic_flag_clear_explicit(&commit_lock, memory_order_release);
+}
+
+void alloc_trim(void) {
+	assert_main_thread();
+
+	// The bump and temp regions may share a commit block when the hunk is 
+	// nearly full. Never decommit anything that either one still uses.
+	uint32_t bump_keep = commit_align_up(bump_len());
+	uint32_t temp_keep = commit_align_up(temp_len());
+	uint32_t free_start = bump_keep;
+	uint32_t free_end = ALLOC_SIZE - temp_keep;
+	if (free_start >= free_end) {
+		return;
+	}
+
+	uint32_t committed = atomic_load_explicit(&bump_committed, memory_order_relaxed);
+	if (committed > free_start) {
+		hunk_decommit(free_start, min(committed, free_end) - free_start);
+		atomic_store_explicit(&bump_committed, free_start, memory_order_relaxed);
+	}
+	if (temp_committed > temp_keep) {
+		uint32_t temp_start = max(ALLOC_SIZE - temp_committed, free_start);
+		hunk_decommit(temp_start, free_end - temp_start);
+		temp_committed = temp_keep;
+	}
+}
+
+uint32_t alloc_committed(void) {
+	return min(bump_committed + temp_committed, ALLOC_SIZE);
+}
+
+#else
+
+void alloc_trim(void) {}
+
+uint32_t alloc_committed(void) {
+	return ALLOC_SIZE;
+}
+
+#endif
+
+
+
+#if ALLOC_INSTRUMENT
+
+typedef enum {
+	ALLOC_REGION_INIT,
+	ALLOC_REGION_SCENE,
+	ALLOC_REGION_FRAME,
+	ALLOC_REGION_MAX,
+} alloc_region_t;
+
+static const char *region_names[] = {"init", "scene", "frame"};
+static const char *subsystem_names[] = {"user", "image", "sound", "map", "entity", "json"};
+
+typedef struct {
+	const char *site;
+	alloc_subsystem_t subsystem;
+	alloc_region_t region;
+	bool is_temp;
+	uint32_t count;
+	uint64_t bytes;
+
+	// The bytes allocated in the frame with the frame_index, and the most bytes
+	// allocated in any one frame
+	uint32_t frame_index;
+	uint32_t frame_bytes;
+	uint32_t frame_bytes_max;
+} alloc_site_t;
+
+static alloc_site_t sites[ALLOC_INSTRUMENT_SITES_MAX];
+static uint32_t sites_len = 0;
+static uint32_t sites_dropped = 0;
+
+// Records may come from other threads through bump_alloc_atomic()
+static atomic_flag sites_lock = ATOMIC_FLAG_INIT;
+
+static _Thread_local alloc_subsystem_t thread_subsystem = ALLOC_SUBSYSTEM_USER;
+
+static alloc_region_t region = ALLOC_REGION_INIT;
+static uint32_t frame_index = 0;
+static uint32_t scene_start = 0;
+static uint32_t frame_start = 0;
+static uint32_t frame_high = 0;
+static alloc_stats_t stats = {0};
+
+alloc_subsystem_t alloc_subsystem_set(alloc_subsystem_t subsystem) {
+	alloc_subsystem_t prev = thread_subsystem;
+	thread_subsystem = subsystem;
+	return prev;
 }
+
+void alloc_subsystem_restore(alloc_subsystem_t *prev) {
+	thread_subsystem = *prev;
+}
+
+static void alloc_record(const char *site, uint32_t size, uint32_t bump_pos, bool is_temp) {
+	if (!site) {
+		site = "unknown";
+	}
+	while (atomic_flag_test_and_set_explicit(&sites_lock, memory_order_acquire)) {}
+
+	// Sites are compared by pointer; the same string literal may exist more
+	// than once, but that only splits the site into multiple entries.
+	alloc_site_t *s = NULL;
+	for (uint32_t i = 0; i < sites_len; i++) {
+		if (
+			sites[i].site == site && sites[i].subsystem == thread_subsystem &&
+			sites[i].region == region && sites[i].is_temp == is_temp
+		) {
+			s = &sites[i];
+			break;
+		}
+	}
+	if (!s && sites_len < ALLOC_INSTRUMENT_SITES_MAX) {
+		s = &sites[sites_len++];
+		*s = (alloc_site_t){
+			.site = site, 
+			.subsystem = thread_subsystem, 
+			.region = region, 
+			.is_temp = is_temp
+		};
+	}
+
+	if (s) {
+		s->count++;
+		s->bytes += size;
+		if (s->frame_index != frame_index) {
+			s->frame_index = frame_index;
+			s->frame_bytes = 0;
+		}
+		s->frame_bytes += size;
+		s->frame_bytes_max = max(s->frame_bytes_max, s->frame_bytes);
+	}
+	else {
+		sites_dropped++;
+	}
+
+	if (is_temp) {
+		stats.temp_high_water = max(stats.temp_high_water, temp_len());
+	}
+	else if (region == ALLOC_REGION_FRAME) {
+		frame_high = max(frame_high, bump_pos);
+	}
+	stats.total_high_water = max(stats.total_high_water, bump_pos + temp_len());
+
+	atomic_flag_clear_explicit(&sites_lock, memory_order_release);
+}
+
+void alloc_begin_scene(void) {
+	if (region == ALLOC_REGION_INIT) {
+		stats.init = bump_len();
+	}
+	region = ALLOC_REGION_SCENE;
+	scene_start = bump_len();
+	stats.scene = 0;
+	stats.scene_high_water = 0;
+	stats.frame_high_water = 0;
+}
+
+void alloc_begin_frame(void) {
+	if (region == ALLOC_REGION_INIT) {
+		return;
+	}
+
+	// Everything the scene allocated since the last frame belongs to the scene
+	stats.scene = bump_len() - scene_start;
+	stats.scene_high_water = max(stats.scene_high_water, stats.scene);
+	stats.scene_high_water_max = max(stats.scene_high_water_max, stats.scene_high_water);
+
+	region = ALLOC_REGION_FRAME;
+	frame_index++;
+	frame_start = bump_len();
+	frame_high = bump_len();
+}
+
+void alloc_end_frame(void) {
+	if (region != ALLOC_REGION_FRAME) {
+		return;
+	}
+	stats.frame_high_water = max(stats.frame_high_water, frame_high - frame_start);
+	stats.frame_high_water_max = max(stats.frame_high_water_max, stats.frame_high_water);
+	stats.scene_high_water = max(stats.scene_high_water, frame_high - scene_start);
+	stats.scene_high_water_max = max(stats.scene_high_water_max, stats.scene_high_water);
+	region = ALLOC_REGION_SCENE;
+}
+
+alloc_stats_t alloc_stats(void) {
+	alloc_stats_t s = stats;
+	if (region == ALLOC_REGION_INIT) {
+		s.init = bump_len();
+	}
+	s.total_high_water = max(s.total_high_water, bump_len() + temp_len());
+	return s;
+}
+
+static int alloc_site_compare(const void *a, const void *b) {
+	const alloc_site_t *sa = a;
+	const alloc_site_t *sb = b;
+	if (sa->region != sb->region) {
+		return sa->region - sb->region;
+	}
+	return sb->bytes > sa->bytes ? 1 : (sb->bytes < sa->bytes ? -1 : 0);
+}
+
+void alloc_report(void) {
+	alloc_stats_t s = alloc_stats();
+	printf("Hunk memory (ALLOC_SIZE %u)\n", ALLOC_SIZE);
+	printf("  init:                 %10u\n", s.init);
+	printf("  scene high water:     %10u (current scene %u)\n", s.scene_high_water_max, s.scene_high_water);
+	printf("  frame high water:     %10u (current scene %u)\n", s.frame_high_water_max, s.frame_high_water);
+	printf("  temp high water:      %10u\n", s.temp_high_water);
+	printf("  total high water:     %10u\n", s.total_high_water);
+
+	// Leave some room for growth and round up to the next MB
+	uint32_t suggested = ((uint64_t)s.total_high_water * 5 / 4 + (1 << 20) - 1) & ~((1 << 20) - 1);
+	printf("  suggested ALLOC_SIZE: %10u (%u MB)\n\n", suggested, suggested >> 20);
+
+	while (atomic_flag_test_and_set_explicit(&sites_lock, memory_order_acquire)) {}
+
+	uint64_t subsystem_bytes[ALLOC_SUBSYSTEM_MAX][ALLOC_REGION_MAX] = {0};
+	for (uint32_t i = 0; i < sites_len; i++) {
+		if (!sites[i].is_temp) {
+			subsystem_bytes[sites[i].subsystem][sites[i].region] += sites[i].bytes;
+		}
+	}
+	printf("%-8s %12s %12s %12s\n", "bump", "init", "scene", "frames");
+	for (uint32_t i = 0; i < ALLOC_SUBSYSTEM_MAX; i++) {
+		uint64_t *b = subsystem_bytes[i];
+		printf("%-8s %12llu %12llu %12llu\n", subsystem_names[i],
+			(unsigned long long)b[ALLOC_REGION_INIT], 
+			(unsigned long long)b[ALLOC_REGION_SCENE], 
+			(unsigned long long)b[ALLOC_REGION_FRAME]
+		);
+	}
+
+	qsort(sites, sites_len, sizeof(alloc_site_t), alloc_site_compare);
+	printf("\n%-6s %-5s %-7s %10s %14s %12s  %s\n", "region", "kind", "system", "count", "bytes", "frame max", "site");
+	for (uint32_t i = 0; i < sites_len; i++) {
+		alloc_site_t *site = &sites[i];
+		char frame_max[16] = "-";
+		if (site->region == ALLOC_REGION_FRAME) {
+			snprintf(frame_max, sizeof(frame_max), "%u", site->frame_bytes_max);
+		}
+		printf("%-6s %-5s %-7s %10u %14llu %12s  %s\n", 
+			region_names[site->region], (site->is_temp ? "temp" : "bump"),
+			subsystem_names[site->subsystem], site->count, 
+			(unsigned long long)site->bytes, frame_max, site->site
+		);
+	}
+	if (sites_dropped) {
+		printf("%u allocations not recorded; ALLOC_INSTRUMENT_SITES_MAX reached\n", sites_dropped);
+	}
+
+	atomic_flag_clear_explicit(&sites_lock, memory_order_release);
+}
+
+#else
+
+alloc_stats_t alloc_stats(void) {
+	return (alloc_stats_t){0};
+}
+
+void alloc_report(void) {}
+void alloc_begin_scene(void) {}
+void alloc_begin_frame(void) {}
+void alloc_end_frame(void) {}
+
+#endif
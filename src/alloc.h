@@ -23,7 +23,9 @@
 
 //   2. A temp allocator. This allocates bytes from the end of the hunk. Temp
 // allocated bytes must be explicitly temp_freed() again. As opposed to the bump
-// allocator, the temp allocator can be freed() out of order.
+// allocator, the temp allocator can be freed() out of order. Space that is 
+// freed out of order is merged with free neighbours and reused by later temp 
+// allocations, or given back once everything below it is freed as well.
 
 // The temp allocator is meant for very short lived objects, to assist data
 // loading. E.g. pixel data from an image file might be temp allocated, handed
@@ -33,21 +35,71 @@
 // Temp allocations are not allowed to persist. At the end of each frame, the
 // engine checks if the temp allocator is empty - and if not: kills the program.
 
+//   3. Arenas. An arena is a separate bump allocator with a fixed size region
+// of memory that is itself bump allocated from the hunk. Each arena belongs to
+// one thread. This is meant for scratch memory of threads other than the main
+// thread (e.g. for the job system), since neither bump_alloc() nor 
+// temp_alloc() are thread safe. For the rare case that a thread needs memory
+// that outlives its arena, there's bump_alloc_atomic().
+
+//   4. Pools. A pool hands out fixed size slots from a block that is itself 
+// bump allocated. Slots can be freed in any order and are reused. This is 
+// meant for objects that are created and destroyed all the time, like
+// particles or projectiles. Since the block lives in bump memory, a pool
+// created in a scene can only be used in that scene.
+
 // There's no way to handle an allocation failure. We just kill the program
 // with an error. This is fine if you know all your game data (i.e. levels) in
 // advance. Games that allow loading user defined levels may need a separate 
 // allocation strategy...
 
+// ...or ALLOC_VIRTUAL. With ALLOC_VIRTUAL defined as 1, the hunk is not a 
+// static array, but a range of address space that is reserved at program 
+// start. Pages are only committed once the bump or temp allocator reaches 
+// them, so ALLOC_SIZE can be much larger than what the game typically needs.
+// Pointers stay valid, since the hunk never moves. When a scene ends, the 
+// engine calls alloc_trim() to return the pages the previous scene used to
+// the OS.
+
 #include "types.h"
 
-// The total size of the hunk
+#if !defined(ALLOC_VIRTUAL)
+	#define ALLOC_VIRTUAL 0
+#endif
+
+// The total size of the hunk. With ALLOC_VIRTUAL this is only the size of the
+// reserved address space.
 #if !defined(ALLOC_SIZE)
-	#define ALLOC_SIZE (32 * 1024 * 1024)
+	#if ALLOC_VIRTUAL
+		#define ALLOC_SIZE (1024 * 1024 * 1024)
+	#else
+		#define ALLOC_SIZE (32 * 1024 * 1024)
+	#endif
 #endif
 
-// The max number of temp objects to be allocated at a time
-#if !defined(ALLOC_TEMP_OBJECTS_MAX)
-	#define ALLOC_TEMP_OBJECTS_MAX 8
+// The granularity in which pages are committed and returned with 
+// ALLOC_VIRTUAL. ALLOC_SIZE must be a multiple of this.
+#if !defined(ALLOC_VIRTUAL_COMMIT_SIZE)
+	#define ALLOC_VIRTUAL_COMMIT_SIZE (256 * 1024)
+#endif
+
+// If ALLOC_DEBUG is defined, using bump_alloc() or temp_alloc() from a thread
+// other than the main thread, or an arena from a thread other than the one it
+// is bound to, will kill the program.
+
+// If ALLOC_INSTRUMENT is 1, each bump and temp allocation records its call 
+// site (file:line) and the current subsystem (see alloc_subsystem()). The 
+// engine marks the init, scene and frame regions and alloc_report() prints a
+// breakdown of the hunk usage per region, subsystem and call site. Use this 
+// to find out how large ALLOC_SIZE needs to be. Allocations are a lot slower
+// with this enabled.
+#if !defined(ALLOC_INSTRUMENT)
+	#define ALLOC_INSTRUMENT 0
+#endif
+
+// The max number of distinct call sites recorded with ALLOC_INSTRUMENT
+#if !defined(ALLOC_INSTRUMENT_SITES_MAX)
+	#define ALLOC_INSTRUMENT_SITES_MAX 1024
 #endif
 
 
@@ -62,6 +114,16 @@ void *bump_alloc(uint32_t size);
 // Reset the bump allocator to the given position
 void bump_reset(bump_mark_t mark);
 
+// Return the address of bump memory at the given position
+void *bump_mark_ptr(bump_mark_t mark);
+
+// Return the highest position the bump allocator reached since the last call
+// to bump_high_water_reset(), in bytes.
+uint32_t bump_high_water(void);
+
+// Reset the high water mark to the current position
+void bump_high_water_reset(void);
+
 // Move bytes from temp to bump memory. This is essentially a shorthand for
 // `bump_alloc(); memcpy(); temp_free();` without the requirement to fit both 
 // (temp and bump) into the hunk at the same time.
@@ -84,6 +146,94 @@ void *bump_from_temp(void *temp, uint32_t offset, uint32_t size);
 	)
 
 
+// Allocate `size` bytes in bump memory from any thread. The main thread must 
+// not call bump_reset() while other threads may allocate.
+void *bump_alloc_atomic(uint32_t size);
+
+
+typedef struct {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t len;
+	void *owner;
+} arena_t;
+
+// Bump allocate an arena with a capacity of `size` bytes. The arena is bound
+// to the calling thread.
+arena_t *arena_create(uint32_t size);
+
+// Bind the arena to the calling thread. Only the bound thread may use it.
+void arena_bind(arena_t *arena);
+
+// Allocate `size` bytes in the arena
+void *arena_alloc(arena_t *arena, uint32_t size);
+
+// Return the current position of the arena
+bump_mark_t arena_mark(arena_t *arena);
+
+// Reset the arena to the given position
+void arena_reset(arena_t *arena, bump_mark_t mark);
+
+// Set the scratch arena of the calling thread; may be NULL. Returns the 
+// previous one.
+arena_t *arena_set_current(arena_t *arena);
+
+// Get the scratch arena of the calling thread. NULL if none was set.
+arena_t *arena_current(void);
+
+// Allocate `size` bytes in the scratch arena of the calling thread, or in
+// bump memory if the thread has no scratch arena.
+void *scratch_alloc(uint32_t size);
+
+
+typedef struct {
+	uint8_t *data;
+	uint64_t *live; // one bit per slot
+	uint32_t slot_size;
+	uint32_t capacity;
+
+	// The number of slots that were ever handed out. Slots above this are 
+	// not in the free list yet.
+	uint32_t used;
+	uint32_t free_first;
+
+	// The number of live objects and the most live objects at any time
+	uint32_t len;
+	uint32_t high_water;
+} pool_t;
+
+// Bump allocate a pool with `capacity` slots for objects of the TYPE. E.g.:
+// pool_t *particles = pool_create(particle_t, 1024);
+#define pool_create(TYPE, CAPACITY) pool_create_sized(sizeof(TYPE), CAPACITY)
+
+// Bump allocate a pool with `capacity` slots of at least `size` bytes. Slots 
+// never straddle a cache line if `size` is 64 bytes or less, and are cache 
+// line aligned otherwise.
+pool_t *pool_create_sized(uint32_t size, uint32_t capacity);
+
+// Return a zeroed slot from the pool, or NULL if the pool is full
+void *pool_alloc(pool_t *pool);
+
+// Return the slot to the pool. The pointer must have been returned by 
+// pool_alloc() on the same pool.
+void pool_free(pool_t *pool, void *p);
+
+// Free all slots
+void pool_clear(pool_t *pool);
+
+// Return the live object after `prev`, or the first one if `prev` is NULL. 
+// Returns NULL when there are no more objects. Objects may be freed while 
+// iterating, but objects that are allocated may or may not be visited.
+void *pool_next(pool_t *pool, void *prev);
+
+// Iterate over all live objects of the pool. E.g.:
+// pool_foreach(particles, particle_t, p) {
+//     p->pos = vec2_add(p->pos, p->vel);
+// }
+#define pool_foreach(POOL, TYPE, VAR) \
+	for (TYPE *VAR = pool_next(POOL, NULL); VAR; VAR = pool_next(POOL, VAR))
+
+
 // Allocate `size` bytes in temp memory
 void *temp_alloc(uint32_t size);
 
@@ -93,4 +243,96 @@ void temp_free(void *p);
 // Check if temp is empty, or die()
 void temp_alloc_check(void);
 
+
+// Return the committed pages above the bump position and below the temp 
+// allocations to the OS. Only the main thread may call this, while no other 
+// thread allocates. Does nothing without ALLOC_VIRTUAL.
+void alloc_trim(void);
+
+// Return the number of bytes of the hunk that are backed by memory. This is
+// always ALLOC_SIZE without ALLOC_VIRTUAL.
+uint32_t alloc_committed(void);
+
+
+// The subsystems that allocations are attributed to with ALLOC_INSTRUMENT
+typedef enum {
+	ALLOC_SUBSYSTEM_USER,
+	ALLOC_SUBSYSTEM_IMAGE,
+	ALLOC_SUBSYSTEM_SOUND,
+	ALLOC_SUBSYSTEM_MAP,
+	ALLOC_SUBSYSTEM_ENTITY,
+	ALLOC_SUBSYSTEM_JSON,
+	ALLOC_SUBSYSTEM_MAX,
+} alloc_subsystem_t;
+
+typedef struct {
+	// Bump bytes allocated before the first scene. These are never freed.
+	uint32_t init;
+
+	// Bump bytes allocated by the current scene outside of frames, i.e. 
+	// mostly during scene init.
+	uint32_t scene;
+
+	// The highest bump position, relative to the start of the scene, in the
+	// current scene and in all scenes so far
+	uint32_t scene_high_water;
+	uint32_t scene_high_water_max;
+
+	// The most bump bytes allocated during one frame in the current scene and
+	// in all scenes so far
+	uint32_t frame_high_water;
+	uint32_t frame_high_water_max;
+
+	// The most temp bytes in use at once
+	uint32_t temp_high_water;
+
+	// The most bytes of the hunk (bump + temp) in use at once. ALLOC_SIZE must
+	// be larger than this.
+	uint32_t total_high_water;
+} alloc_stats_t;
+
+// Return the current stats. All zero without ALLOC_INSTRUMENT.
+alloc_stats_t alloc_stats(void);
+
+// Print the stats and the bytes allocated per region, subsystem and call
+// site to stdout. Does nothing without ALLOC_INSTRUMENT.
+void alloc_report(void);
+
+// Called by the engine to mark the scene and frame regions
+void alloc_begin_scene(void);
+void alloc_begin_frame(void);
+void alloc_end_frame(void);
+
+// The allocation functions with an explicit call site; used by the
+// ALLOC_INSTRUMENT macros below.
+void *bump_alloc_at(uint32_t size, const char *site);
+void *bump_alloc_atomic_at(uint32_t size, const char *site);
+void *bump_from_temp_at(void *temp, uint32_t offset, uint32_t size, const char *site);
+void *temp_alloc_at(uint32_t size, const char *site);
+
+#if ALLOC_INSTRUMENT
+	#define ALLOC_SITE_STR2(X) #X
+	#define ALLOC_SITE_STR(X) ALLOC_SITE_STR2(X)
+	#define ALLOC_SITE __FILE__ ":" ALLOC_SITE_STR(__LINE__)
+
+	#define bump_alloc(SIZE) bump_alloc_at(SIZE, ALLOC_SITE)
+	#define bump_alloc_atomic(SIZE) bump_alloc_atomic_at(SIZE, ALLOC_SITE)
+	#define bump_from_temp(TEMP, OFFSET, SIZE) bump_from_temp_at(TEMP, OFFSET, SIZE, ALLOC_SITE)
+	#define temp_alloc(SIZE) temp_alloc_at(SIZE, ALLOC_SITE)
+
+	// Attribute all allocations on this thread to the SUBSYSTEM until the end
+	// of the enclosing scope
+	#define alloc_subsystem(SUBSYSTEM) \
+		__attribute__((cleanup(alloc_subsystem_restore), unused)) \
+		alloc_subsystem_t _ALLOC_SUBSYSTEM_VAR(__COUNTER__) = alloc_subsystem_set(SUBSYSTEM)
+
+	#define _ALLOC_SUBSYSTEM_VAR(N) _ALLOC_SUBSYSTEM_VAR2(N)
+	#define _ALLOC_SUBSYSTEM_VAR2(N) _alloc_subsystem_##N
+
+	alloc_subsystem_t alloc_subsystem_set(alloc_subsystem_t subsystem);
+	void alloc_subsystem_restore(alloc_subsystem_t *prev);
+#else
+	#define alloc_subsystem(SUBSYSTEM)
+#endif
+
 #endif
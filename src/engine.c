@@ -7,6 +7,8 @@
 #include "utils.h"
 #include "image.h"
 #include "sound.h"
+#include "jobs.h"
+#include "profiler.h"
 
 engine_t engine = {
 	.time_real = 0,
@@ -16,12 +18,37 @@ engine_t engine = {
 	.frame = 0,
 	.collision_map = NULL,
 	.gravity = 1.0,
+	.fixed_tick = ENGINE_FIXED_TICK,
+	.perf_hitch_threshold = ENGINE_PERF_HITCH_THRESHOLD,
 };
 
 
 static scene_t *scene = NULL;
 static scene_t *scene_next = NULL;
 
+// The bump memory that the scene allocated, from init_bump_mark to bump_end,
+// is saved right behind the snapshot itself, followed by the entities. The 
+// snapshot is restored by copying both back and resetting the bump allocator
+// to the end of the snapshot.
+struct engine_snapshot_t {
+	bump_mark_t bump_end;
+	bump_mark_t snapshot_end;
+	texture_mark_t textures;
+	image_mark_t images;
+	sound_mark_t sounds;
+	engine_t engine;
+	rand_state_t rand;
+	uint8_t *entities;
+	uint8_t bump[];
+};
+
+static engine_snapshot_t *snapshot_next = NULL;
+
+// The game time that has not been simulated yet and the viewport before the
+// last step, for engine.fixed_tick
+static double fixed_time_pending = 0;
+static vec2_t fixed_viewport_prev;
+
 static texture_mark_t init_textures_mark;
 static image_mark_t init_images_mark;
 static bump_mark_t init_bump_mark;
@@ -29,11 +56,30 @@ static sound_mark_t init_sounds_mark;
 
 static bool is_running = false;
 
+static engine_hooks_t *hooks[ENGINE_MAX_HOOKS];
+static uint32_t hooks_len = 0;
+
+static engine_perf_sample_t perf_history[ENGINE_PERF_HISTORY];
+static uint32_t perf_history_len = 0;
+static uint32_t perf_history_index = 0;
+static font_t *perf_overlay_font = NULL;
+
+// The update, draw and total times of the history, each kept in sorted order
+// to compute the percentiles.
+static float perf_sorted_update[ENGINE_PERF_HISTORY];
+static float perf_sorted_draw[ENGINE_PERF_HISTORY];
+static float perf_sorted_total[ENGINE_PERF_HISTORY];
+
+static void engine_perf_record(void);
+static void engine_perf_draw_overlay(void);
+static void engine_hooks_reset(void);
+
 extern void main_init(void);
 extern void main_cleanup(void);
 
 void engine_init(void) {
 	engine.time_real = platform_now();
+	jobs_init();
 	render_init(platform_screen_size());
 	sound_init(platform_samplerate());
 	platform_set_audio_mix_cb(sound_mix_stereo);
@@ -48,11 +94,17 @@ void engine_init(void) {
 }
 
 void engine_cleanup(void) {
+	engine_hooks_reset();
 	entities_cleanup();
 	main_cleanup();
 	input_cleanup();
 	sound_cleanup();
 	render_cleanup();
+	jobs_cleanup();
+
+	#if ALLOC_INSTRUMENT
+		alloc_report();
+	#endif
 }
 
 void engine_load_level(char *json_path) {
@@ -60,6 +112,7 @@ void engine_load_level(char *json_path) {
 	error_if(!json, "Could not load level json at %s", json_path);
 
 	entities_reset();
+	engine_hooks_reset();
 	engine.background_maps_len = 0;
 	engine.collision_map = NULL;
 
@@ -107,8 +160,9 @@ void engine_load_level(char *json_path) {
 			// Copy name, if we have one
 			json_t *name = json_value_for_key(settings, "name");
 			if (name && name->type == JSON_STRING) {
-				ent->name = bump_alloc(name->len + 1);
-				strcpy(ent->name, name->string);
+				char *name_copy = bump_alloc(name->len + 1);
+				strcpy(name_copy, name->string);
+				entity_set_name(ent, name_copy);
 			}
 
 			entity_settings[entity_settings_len].entity = ent;
@@ -130,16 +184,133 @@ void engine_add_background_map(map_t *map) {
 
 void engine_set_collision_map(map_t *map) {
 	engine.collision_map = map;
+	if (map) {
+		map_update_solid(map);
+	}
+}
+
+void engine_add_hooks(engine_hooks_t *h) {
+	for (uint32_t i = 0; i < hooks_len; i++) {
+		if (hooks[i] == h) {
+			return;
+		}
+	}
+	error_if(hooks_len >= ENGINE_MAX_HOOKS, "ENGINE_MAX_HOOKS reached");
+	hooks[hooks_len++] = h;
+}
+
+static void engine_hooks_reset(void) {
+	for (uint32_t i = 0; i < hooks_len; i++) {
+		if (hooks[i]->reset) {
+			hooks[i]->reset();
+		}
+	}
+	hooks_len = 0;
 }
 
 void engine_set_scene(scene_t *scene) {
 	scene_next = scene;
 }
 
+engine_snapshot_t *engine_snapshot(void) {
+	error_if(is_running, "engine_snapshot() must be called from scene init");
+
+	bump_mark_t bump_end = bump_mark();
+	uint32_t bump_size = bump_end.index - init_bump_mark.index;
+	engine_snapshot_t *snapshot = bump_alloc(
+		sizeof(engine_snapshot_t) + bump_size + entities_snapshot_size()
+	);
+	snapshot->bump_end = bump_end;
+	snapshot->textures = textures_mark();
+	snapshot->images = images_mark();
+	snapshot->sounds = sound_mark();
+	snapshot->engine = engine;
+	snapshot->rand = rand_state();
+	snapshot->entities = snapshot->bump + bump_size;
+	snapshot->snapshot_end = bump_mark();
+
+	memcpy(snapshot->bump, bump_mark_ptr(init_bump_mark), bump_size);
+	entities_snapshot_save(snapshot->entities);
+	return snapshot;
+}
+
+void engine_restore_snapshot(engine_snapshot_t *snapshot) {
+	snapshot_next = snapshot;
+}
+
+static void engine_snapshot_apply(engine_snapshot_t *snapshot) {
+	textures_reset(snapshot->textures);
+	images_reset(snapshot->images);
+	sound_reset(snapshot->sounds);
+	bump_reset(snapshot->snapshot_end);
+
+	memcpy(
+		bump_mark_ptr(init_bump_mark), snapshot->bump, 
+		snapshot->bump_end.index - init_bump_mark.index
+	);
+	entities_snapshot_restore(snapshot->entities);
+	rand_set_state(snapshot->rand);
+
+	engine.time = snapshot->engine.time;
+	engine.time_scale = snapshot->engine.time_scale;
+	engine.frame = snapshot->engine.frame;
+	engine.collision_map = snapshot->engine.collision_map;
+	memcpy(engine.background_maps, snapshot->engine.background_maps, sizeof(engine.background_maps));
+	engine.background_maps_len = snapshot->engine.background_maps_len;
+	engine.gravity = snapshot->engine.gravity;
+	engine.viewport = snapshot->engine.viewport;
+	for (uint32_t i = 0; i < hooks_len; i++) {
+		if (hooks[i]->snapshot_restore) {
+			hooks[i]->snapshot_restore();
+		}
+	}
+}
+
+static void engine_scene_update(void) {
+	if (scene->update) {
+		scene->update();
+	}
+	else {
+		scene_base_update();
+	}
+}
+
+static void engine_update_fixed(double real_delta) {
+	fixed_time_pending += min(real_delta * engine.time_scale, ENGINE_MAX_TICK);
+	engine.tick = engine.fixed_tick;
+
+	uint32_t steps = 0;
+	while (fixed_time_pending >= engine.fixed_tick && !scene_next && !snapshot_next) {
+		if (steps == ENGINE_FIXED_STEPS_MAX) {
+			fixed_time_pending = fmod(fixed_time_pending, engine.fixed_tick);
+			break;
+		}
+
+		entities_store_positions();
+		fixed_viewport_prev = engine.viewport;
+
+		engine.time += engine.tick;
+		engine.frame++;
+		engine_scene_update();
+		fixed_time_pending -= engine.fixed_tick;
+		steps++;
+
+		// Pressed and released actions are only seen by one step. If no step
+		// runs in this frame, they are kept for the next one.
+		input_clear();
+	}
+
+	engine.perf.steps = steps;
+	engine.tick_alpha = clamp(fixed_time_pending / engine.fixed_tick, 0, 1);
+}
+
 void engine_update(void) {
-	double time_frame_start = platform_now();
+	profiler_mark_t profiler_frame_start = profiler_mark();
+	profiler_begin("engine_update");
+	double time_frame_start = platform_real_now();
 
 	// Do we want to switch scenes?
+	bool is_scene_switch = scene_next != NULL;
 	if (scene_next) {
 		is_running = false;
 		if (scene && scene->cleanup) {
@@ -150,7 +321,10 @@ void engine_update(void) {
 		images_reset(init_images_mark);
 		sound_reset(init_sounds_mark);
 		bump_reset(init_bump_mark);
+		alloc_trim();
+		alloc_begin_scene();
 		entities_reset();
+		engine_hooks_reset();
 
 		engine.background_maps_len = 0;
 		engine.collision_map = NULL;
@@ -158,11 +332,23 @@ void engine_update(void) {
 		engine.frame = 0;
 		engine.viewport = vec2(0, 0);
 
+		fixed_time_pending = 0;
+		fixed_viewport_prev = vec2(0, 0);
+
 		scene = scene_next;
+		snapshot_next = NULL;
 		if (scene->init) {
 			scene->init();
 		}
 		scene_next = NULL;
+		fixed_viewport_prev = engine.viewport;
+	}
+	else if (snapshot_next) {
+		is_scene_switch = true;
+		engine_snapshot_apply(snapshot_next);
+		snapshot_next = NULL;
+		entities_store_positions();
+		fixed_viewport_prev = engine.viewport;
 	}
 	is_running = true;
 
@@ -171,38 +357,220 @@ void engine_update(void) {
 	double time_real_now = platform_now();
 	double real_delta = time_real_now - engine.time_real;
 	engine.time_real = time_real_now;
-	engine.tick = min(real_delta * engine.time_scale, ENGINE_MAX_TICK);
-	engine.time += engine.tick;
-	engine.frame++;
+	double time_update_start = platform_real_now();
+	bool is_fixed = engine.fixed_tick > 0;
+	if (!is_fixed) {
+		engine.tick = min(real_delta * engine.time_scale, ENGINE_MAX_TICK);
+		engine.time += engine.tick;
+		engine.frame++;
+	}
 
+	bump_high_water_reset();
+	alloc_begin_frame();
 	alloc_pool() {
-		if (scene->update) {
-			scene->update();
+		profiler_begin("scene_update");
+		if (is_fixed) {
+			engine_update_fixed(real_delta);
 		}
 		else {
-			scene_base_update();
+			engine_scene_update();
+			engine.perf.steps = 1;
+		}
+		for (uint32_t i = 0; i < hooks_len; i++) {
+			if (hooks[i]->update) {
+				hooks[i]->update();
+			}
 		}
+		profiler_end();
 
-		engine.perf.update = platform_now() - time_real_now;
+		engine.perf.update = platform_real_now() - time_update_start;
 		
+		profiler_begin("scene_draw");
 		render_frame_prepare();
 
+		// Move entities and the viewport to their interpolated positions 
+		// while drawing
+		vec2_t viewport = engine.viewport;
+		if (is_fixed) {
+			entities_interpolate(engine.tick_alpha);
+			engine.viewport = vec2_add(
+				fixed_viewport_prev, 
+				vec2_mulf(vec2_sub(viewport, fixed_viewport_prev), engine.tick_alpha)
+			);
+		}
+
 		if (scene->draw) {
 			scene->draw();
 		}
 		else {
 			scene_base_draw();
 		}
+
+		if (is_fixed) {
+			entities_interpolate_end();
+			engine.viewport = viewport;
+		}
+
+		if (perf_overlay_font) {
+			engine_perf_draw_overlay();
+		}
 		
 		render_frame_end();
-		engine.perf.draw = (platform_now() - time_real_now) - engine.perf.update;
+		profiler_end();
+		engine.perf.draw = (platform_real_now() - time_update_start) - engine.perf.update;
 	}
 
-	input_clear();
+	alloc_end_frame();
+	if (!is_fixed) {
+		input_clear();
+	}
 	temp_alloc_check();
 
 	engine.perf.draw_calls = render_draw_calls();
-	engine.perf.total =  platform_now() - time_frame_start;
+	engine.perf.bump_high_water = bump_high_water();
+	engine.perf.total =  platform_real_now() - time_frame_start;
+	profiler_end();
+
+	// Frames that load a new scene or restore a snapshot are not counted as
+	// hitches
+	engine_perf_record();
+	if (engine.perf.total > engine.perf_hitch_threshold && !is_scene_switch) {
+		if (engine.perf.hitches < ENGINE_PERF_HITCH_SNAPSHOTS_MAX) {
+			char name[32];
+			snprintf(name, sizeof(name), "hitch_%d.json", engine.perf.hitches);
+			profiler_dump_since(name, profiler_frame_start);
+		}
+		engine.perf.hitches++;
+	}
+}
+
+// Replace the value old with value in the sorted list. If the list is not
+// full yet, the value is just inserted.
+static void engine_perf_sorted_replace(float *sorted, uint32_t len, bool is_full, float old, float value) {
+	if (is_full) {
+		uint32_t i = 0;
+		while (i < len - 1 && sorted[i] < old) {
+			i++;
+		}
+		memmove(sorted + i, sorted + i + 1, (len - i - 1) * sizeof(float));
+		len--;
+	}
+
+	uint32_t i = len;
+	while (i > 0 && sorted[i - 1] > value) {
+		sorted[i] = sorted[i - 1];
+		i--;
+	}
+	sorted[i] = value;
+}
+
+static engine_perf_stats_t engine_perf_stats(float *sorted, uint32_t len) {
+	// Nearest rank percentiles
+	return (engine_perf_stats_t){
+		.p50 = sorted[(uint32_t)ceilf(len * 0.50) - 1],
+		.p95 = sorted[(uint32_t)ceilf(len * 0.95) - 1],
+		.p99 = sorted[(uint32_t)ceilf(len * 0.99) - 1],
+		.max = sorted[len - 1]
+	};
+}
+
+static void engine_perf_record(void) {
+	engine_perf_sample_t sample = {
+		.update = engine.perf.update,
+		.draw = engine.perf.draw,
+		.total = engine.perf.total,
+		.draw_calls = engine.perf.draw_calls,
+		.checks = engine.perf.checks,
+		.entities = engine.perf.entities,
+		.steps = engine.perf.steps,
+		.bump_high_water = engine.perf.bump_high_water,
+	};
+
+	bool is_full = perf_history_len == ENGINE_PERF_HISTORY;
+	engine_perf_sample_t *old = &perf_history[perf_history_index];
+	engine_perf_sorted_replace(perf_sorted_update, perf_history_len, is_full, old->update, sample.update);
+	engine_perf_sorted_replace(perf_sorted_draw, perf_history_len, is_full, old->draw, sample.draw);
+	engine_perf_sorted_replace(perf_sorted_total, perf_history_len, is_full, old->total, sample.total);
+
+	*old = sample;
+	perf_history_index = (perf_history_index + 1) % ENGINE_PERF_HISTORY;
+	if (!is_full) {
+		perf_history_len++;
+	}
+
+	engine.perf.update_stats = engine_perf_stats(perf_sorted_update, perf_history_len);
+	engine.perf.draw_stats = engine_perf_stats(perf_sorted_draw, perf_history_len);
+	engine.perf.total_stats = engine_perf_stats(perf_sorted_total, perf_history_len);
+}
+
+uint32_t engine_perf_history_len(void) {
+	return perf_history_len;
+}
+
+engine_perf_sample_t engine_perf_sample(uint32_t frames_ago) {
+	if (frames_ago >= perf_history_len) {
+		return (engine_perf_sample_t){};
+	}
+	uint32_t index = (perf_history_index + ENGINE_PERF_HISTORY - 1 - frames_ago) % ENGINE_PERF_HISTORY;
+	return perf_history[index];
+}
+
+void engine_set_perf_overlay(font_t *font) {
+	perf_overlay_font = font;
+}
+
+static void engine_perf_draw_overlay(void) {
+	vec2_t screen = vec2_from_vec2i(render_size());
+	float line_height = perf_overlay_font->line_height;
+
+	// The graph spans the bottom left quarter of the screen; the top of the 
+	// graph is at twice the hitch threshold.
+	vec2_t graph_size = vec2(screen.x / 2, screen.y / 4);
+	vec2_t graph_pos = vec2(0, screen.y - graph_size.y);
+	float bar_width = graph_size.x / ENGINE_PERF_HISTORY;
+	float scale = graph_size.y / (engine.perf_hitch_threshold * 2);
+
+	render_draw(graph_pos, graph_size, RENDER_NO_TEXTURE, vec2(0, 0), vec2(2, 2), rgba(0, 0, 0, 128));
+	render_draw(
+		vec2(graph_pos.x, graph_pos.y + graph_size.y / 2), vec2(graph_size.x, 1), 
+		RENDER_NO_TEXTURE, vec2(0, 0), vec2(2, 2), rgba(255, 255, 255, 128)
+	);
+
+	// Oldest frame on the left; update in green, draw in blue stacked on top,
+	// the remaining time in grey. Hitches are drawn in red.
+	for (uint32_t i = 0; i < perf_history_len; i++) {
+		engine_perf_sample_t s = engine_perf_sample(perf_history_len - 1 - i);
+		float x = graph_pos.x + i * bar_width;
+		float bottom = screen.y;
+		float h_update = min(s.update * scale, graph_size.y);
+		float h_draw = min(s.draw * scale, graph_size.y - h_update);
+		float h_rest = clamp((s.total - s.update - s.draw) * scale, 0, graph_size.y - h_update - h_draw);
+		bool is_hitch = s.total > engine.perf_hitch_threshold;
+		rgba_t update_color = is_hitch ? rgba(255, 64, 64, 255) : rgba(64, 255, 64, 255);
+		rgba_t draw_color = is_hitch ? rgba(192, 32, 32, 255) : rgba(64, 128, 255, 255);
+		rgba_t rest_color = is_hitch ? rgba(128, 16, 16, 255) : rgba(128, 128, 128, 255);
+
+		render_draw(vec2(x, bottom - h_update), vec2(bar_width, h_update), RENDER_NO_TEXTURE, vec2(0, 0), vec2(2, 2), update_color);
+		render_draw(vec2(x, bottom - h_update - h_draw), vec2(bar_width, h_draw), RENDER_NO_TEXTURE, vec2(0, 0), vec2(2, 2), draw_color);
+		render_draw(vec2(x, bottom - h_update - h_draw - h_rest), vec2(bar_width, h_rest), RENDER_NO_TEXTURE, vec2(0, 0), vec2(2, 2), rest_color);
+	}
+
+	engine_perf_stats_t t = engine.perf.total_stats;
+	char text[128];
+	vec2_t text_pos = vec2(graph_pos.x + 2, graph_pos.y - line_height * 2);
+	snprintf(
+		text, sizeof(text), "ms p50 %.2f p95 %.2f p99 %.2f max %.2f hitches %d",
+		t.p50 * 1000, t.p95 * 1000, t.p99 * 1000, t.max * 1000, engine.perf.hitches
+	);
+	font_draw(perf_overlay_font, text_pos, text, FONT_ALIGN_LEFT);
+
+	text_pos.y += line_height;
+	snprintf(
+		text, sizeof(text), "ents %d checks %d draws %d steps %d bump %dkb",
+		engine.perf.entities, engine.perf.checks, engine.perf.draw_calls, 
+		engine.perf.steps, engine.perf.bump_high_water / 1024
+	);
+	font_draw(perf_overlay_font, text_pos, text, FONT_ALIGN_LEFT);
 }
 
 bool engine_is_running(void) {
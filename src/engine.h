@@ -10,6 +10,7 @@
 
 #include "types.h"
 #include "map.h"
+#include "font.h"
 
 
 // The maximum difference in seconds from one frame to the next. If the 
@@ -19,11 +20,49 @@
 	#define ENGINE_MAX_TICK 0.1
 #endif
 
+// The default engine.fixed_tick in seconds. If this is 0, the scene is updated
+// once per frame with a variable engine.tick. Otherwise the scene is updated 
+// as often as needed to advance the game time in steps of exactly this many
+// seconds, e.g. (1.0/60.0) for 60 updates per second, regardless of the frame
+// rate. Entities and the viewport are then drawn at their positions 
+// interpolated between the last two steps.
+#if !defined(ENGINE_FIXED_TICK)
+	#define ENGINE_FIXED_TICK 0
+#endif
+
+// The maximum number of fixed steps per frame. If the game falls further 
+// behind, the remaining time is dropped and the game slows down instead.
+#if !defined(ENGINE_FIXED_STEPS_MAX)
+	#define ENGINE_FIXED_STEPS_MAX 5
+#endif
+
 // The maximum number of background maps
 #if !defined(ENGINE_MAX_BACKGROUND_MAPS)
 	#define ENGINE_MAX_BACKGROUND_MAPS 4
 #endif
 
+// The number of frames for which the perf samples are kept. The percentiles
+// in engine.perf are computed over this many frames.
+#if !defined(ENGINE_PERF_HISTORY)
+	#define ENGINE_PERF_HISTORY 240
+#endif
+
+// The default engine.perf_hitch_threshold in seconds
+#if !defined(ENGINE_PERF_HITCH_THRESHOLD)
+	#define ENGINE_PERF_HITCH_THRESHOLD (1.0 / 20.0)
+#endif
+
+// The maximum number of hitch snapshots that are written to the userdata
+// directory during one run of the program
+#if !defined(ENGINE_PERF_HITCH_SNAPSHOTS_MAX)
+	#define ENGINE_PERF_HITCH_SNAPSHOTS_MAX 16
+#endif
+
+// The maximum number of engine_hooks_t that can be added in one scene
+#if !defined(ENGINE_MAX_HOOKS)
+	#define ENGINE_MAX_HOOKS 4
+#endif
+
 
 // Every scene in your game must provide a scene_t that specifies it's entry
 // functions.
@@ -32,7 +71,8 @@ typedef struct {
 	// instantiate your initial entities
 	void (*init)(void);
 
-	// Called once per frame. Uss this to update logic specific to your game.
+	// Called once per frame, or once per step with a fixed engine.fixed_tick.
+	// Uss this to update logic specific to your game.
 	// If you use this function, you probably want to call scene_base_update()
 	// in it somewhere.
 	void (*update)(void);
@@ -46,6 +86,26 @@ typedef struct {
 	void (*cleanup)(void);
 } scene_t;
 
+// The perf sample of one frame. Times are in seconds.
+typedef struct {
+	float update;
+	float draw;
+	float total;
+	uint32_t draw_calls;
+	uint32_t checks;
+	uint32_t entities;
+	uint32_t steps;
+	uint32_t bump_high_water;
+} engine_perf_sample_t;
+
+// Percentiles of a perf time over the last ENGINE_PERF_HISTORY frames
+typedef struct {
+	float p50;
+	float p95;
+	float p99;
+	float max;
+} engine_perf_stats_t;
+
 typedef struct {
 	// The real time in seconds since program start
 	double time_real;
@@ -60,9 +120,19 @@ typedef struct {
 	// Typically 0.01666 (assuming 60hz)
 	double tick;
 
-	// The frame number in this current scene. Increases by 1 for every frame.
+	// The frame number in this current scene. Increases by 1 for every frame,
+	// or for every step with a fixed_tick.
 	uint64_t frame;
 
+	// The fixed duration of a simulation step in seconds, or 0 for a variable
+	// tick. Default: ENGINE_FIXED_TICK
+	double fixed_tick;
+
+	// With a fixed_tick, how far (0..1) the current time is between the last
+	// step and the next one. Entities and the viewport are interpolated by
+	// this for drawing.
+	float tick_alpha;
+
 	// The map to use for entity vs. world collisions. Reset for each scene.
 	// Use engine_set_collision_map() to set it.
 	map_t *collision_map;
@@ -81,14 +151,35 @@ typedef struct {
 	// drawing background_maps and entities.
 	vec2_t viewport;
 
-	// Various infos about the last frame
+	// Frames that take longer than this (in seconds) are counted as hitches.
+	// For each hitch, the zones of the profiler (if compiled with PROFILER)
+	// for this frame are written to hitch_<n>.json in the userdata directory.
+	// Default: ENGINE_PERF_HITCH_THRESHOLD
+	float perf_hitch_threshold;
+
+	// Various infos about the last frame. For the entity broad phase, checks
+	// is the number of candidate pairs tested, pairs the number of pairs that
+	// actually touched and cells the number of grid cells visited (only for
+	// ENTITY_BROADPHASE_GRID). steps is the number of times the scene was 
+	// updated in this frame. bump_high_water is the highest position of the
+	// bump allocator during the frame, in bytes.
+	// The *_stats are computed over the last ENGINE_PERF_HISTORY frames and
+	// hitches is the number of hitches since program start.
 	struct {
 		int entities;
 		int checks;
+		int pairs;
+		int cells;
 		int draw_calls;
+		uint32_t steps;
+		uint32_t bump_high_water;
 		float update;
 		float draw;
 		float total;
+		engine_perf_stats_t update_stats;
+		engine_perf_stats_t draw_stats;
+		engine_perf_stats_t total_stats;
+		uint32_t hitches;
 	} perf;
 } engine_t;
 
@@ -102,6 +193,24 @@ extern engine_t engine;
 // first scene.
 void engine_set_scene(scene_t *scene);
 
+typedef struct engine_snapshot_t engine_snapshot_t;
+
+// Save the current state of the scene: everything the scene allocated in bump
+// memory so far, all entities, the background and collision maps, the 
+// viewport, time and gravity of the engine and the state of the random number
+// generator. This must be called from within your scene's init() function, 
+// typically at the end of it. The snapshot lives in bump memory and is valid
+// until the scene ends.
+engine_snapshot_t *engine_snapshot(void);
+
+// Restore the scene to the state of the snapshot. This is much faster than
+// engine_set_scene(), since init() is not called and no level is loaded 
+// again. Like engine_set_scene(), the restore happens at the beginning of the
+// next frame. State that lives outside of bump memory and entities, like the
+// static variables of your scene or entity refs stored in them, is not part
+// of the snapshot and must be reset by yourself.
+void engine_restore_snapshot(engine_snapshot_t *snapshot);
+
 // Load a level (background maps, collision map and entities) from a json path.
 // This should only be called from within your scenes init() function.
 void engine_load_level(char *json_path);
@@ -116,12 +225,39 @@ void engine_set_collision_map(map_t *map);
 // scenes)
 bool engine_is_running(void);
 
+// The number of frames in the perf history; at most ENGINE_PERF_HISTORY
+uint32_t engine_perf_history_len(void);
+
+// Return the perf sample from the history that was recorded frames_ago frames
+// before the last one. 0 returns the sample of the last frame.
+engine_perf_sample_t engine_perf_sample(uint32_t frames_ago);
+
+// Draw an overlay with the perf history and stats using the given font at the
+// end of each frame. NULL disables the overlay.
+void engine_set_perf_overlay(font_t *font);
+
 // Update all entities
 void scene_base_update(void);
 
 // Draw all background maps and entities
 void scene_base_draw(void);
 
+// Optional modules, like nav, that need to be called by the engine add these
+// hooks when they are initialized in a scene, so that the engine doesn't 
+// depend on modules that your game doesn't use. update() is called once per
+// frame after the scene was updated and snapshot_restore() after a snapshot 
+// was restored. reset() is called when the level or scene changes; all hooks
+// are removed after that.
+typedef struct {
+	void (*update)(void);
+	void (*snapshot_restore)(void);
+	void (*reset)(void);
+} engine_hooks_t;
+
+// Add the hooks for the current scene. Adding the same hooks again does
+// nothing.
+void engine_add_hooks(engine_hooks_t *hooks);
+
 // The following functions are automatically called by the platform. No need
 // to call yourself.
 void engine_init(void);
@@ -5,7 +5,18 @@
 #include "alloc.h"
 #include "trace.h"
 #include "platform.h"
-
+#include "jobs.h"
+#include "profiler.h"
+
+#if ENTITY_BATCH_PHYSICS
+	#if defined(__SSE2__) || defined(_M_X64)
+		#include <emmintrin.h>
+		#define ENTITY_BATCH_SSE2
+	#elif defined(__ARM_NEON) && defined(__aarch64__)
+		#include <arm_neon.h>
+		#define ENTITY_BATCH_NEON
+	#endif
+#endif
 
 #define ENTITY_STRINGIFY_NAME(ENUM, NAME) [ENUM] = #NAME,
 static const char *entity_type_names[] = {
@@ -14,16 +25,182 @@ static const char *entity_type_names[] = {
 
 entity_vtab_t entity_vtab[ENTITY_TYPES_COUNT];
 
+// All active entities are kept (unsorted) in the first entities_len elements
+// of the entities array. The storage slots are handed out from the free list
+// of reclaimed slots, or from the not yet used slots above the storage_len
+// high-water mark. Each slot has a generation that is incremented whenever the
+// slot is re-used; entity refs are only valid for the generation they were 
+// created for.
 static uint32_t entities_len = 0;
-static uint16_t entity_unique_id = 0;
+static uint32_t entity_unique_id = 0;
 static entity_t *entities[ENTITIES_MAX];
 static entity_t entities_storage[ENTITIES_MAX];
+static uint32_t entities_storage_len = 0;
+static uint32_t entities_free[ENTITIES_MAX];
+static uint32_t entities_free_len = 0;
+static uint32_t entities_generation[ENTITIES_MAX];
+
+// Intrusive, doubly linked lists of all entities of each type, in spawn 
+// order, for entities_by_type() and entities_first_by_type(). Each storage 
+// slot links to the previous and next slot of the same type. Entities are
+// unlinked when their slot is reclaimed.
+#define ENTITY_TYPE_LIST_END 0xffffffff
+
+static uint32_t types_head[ENTITY_TYPES_COUNT];
+static uint32_t types_tail[ENTITY_TYPES_COUNT];
+static uint32_t types_count[ENTITY_TYPES_COUNT];
+static uint32_t types_next[ENTITIES_MAX];
+static uint32_t types_prev[ENTITIES_MAX];
+static entity_type_t types_of_slot[ENTITIES_MAX];
+
+// The hash index of entity names for entity_by_name(). Names are inserted
+// through entity_set_name(), or picked up in entities_update() if ent->name was
+// assigned directly. Entries use open addressing with linear probing and are
+// only valid if their epoch matches names_epoch, so that the whole index can be
+// cleared in O(1). Removed entries stay in the index as tombstones until it is
+// rebuilt.
+#define ENTITY_NAME_REMOVED 0xffffffff
+
+typedef struct {
+	uint32_t epoch;
+	uint32_t hash;
+	uint32_t index;
+} entity_name_entry_t;
+
+static entity_name_entry_t names[ENTITIES_MAX * 4];
+static uint32_t names_mask;
+static uint32_t names_epoch = 1;
+static uint32_t names_used = 0;
+static char *names_indexed[ENTITIES_MAX];
+
+// The spatial hash for ENTITY_BROADPHASE_GRID. Each entity covers a range of
+// cells. Small entities (up to 2x2 cells) are put into the buckets of all cells
+// they cover. Larger ones are only remembered in grid_large and tested 
+// individually. Entities that were spawned after the grid was built are 
+// remembered in grid_pending, so that entities_by_location() can still find
+// them. If the storage of an entity in the grid is re-used by such a spawn, the
+// grid_entity_t is invalidated by setting its entity to NULL.
+typedef struct {
+	entity_t *entity;
+	int32_t x0, y0, x1, y1;
+	bool is_checked;
+} grid_entity_t;
+
+typedef struct {
+	uint32_t index;
+	int32_t cx, cy;
+} grid_entry_t;
+
+static entity_broadphase_t broadphase = ENTITY_BROADPHASE;
+static bool grid_is_built = false;
+static float grid_inv_cell_size;
+static grid_entity_t grid_entities[ENTITIES_MAX];
+static uint32_t grid_entities_len = 0;
+static grid_entry_t grid_entries[ENTITIES_MAX * 4];
+static uint32_t grid_buckets[ENTITY_GRID_BUCKETS + 1];
+static uint32_t grid_large[ENTITIES_MAX];
+static uint32_t grid_large_len = 0;
+static entity_t *grid_pending[ENTITIES_MAX];
+static uint32_t grid_pending_len = 0;
+static uint32_t grid_index_for_storage[ENTITIES_MAX];
+
+#if ENTITY_BATCH_PHYSICS
+	// The structure of arrays mirror of the hot physics fields for 
+	// ENTITY_BATCH_PHYSICS. Each array is padded to a multiple of 4, so that 
+	// all of them are 16 byte aligned.
+	#define ENTITY_BATCH_CAPACITY ((ENTITIES_MAX + 3) & ~3)
+	typedef struct {
+		float pos_x[ENTITY_BATCH_CAPACITY];
+		float pos_y[ENTITY_BATCH_CAPACITY];
+		float vel_x[ENTITY_BATCH_CAPACITY];
+		float vel_y[ENTITY_BATCH_CAPACITY];
+		float accel_x[ENTITY_BATCH_CAPACITY];
+		float accel_y[ENTITY_BATCH_CAPACITY];
+		float friction_x[ENTITY_BATCH_CAPACITY];
+		float friction_y[ENTITY_BATCH_CAPACITY];
+		float gravity[ENTITY_BATCH_CAPACITY];
+	} __attribute__((aligned(16))) entity_batch_t;
+
+	static entity_batch_t batch;
+	static entity_t *batch_entities[ENTITIES_MAX];
+
+	static void entities_batch_update(void);
+#endif
+
+// The positions of all entities before the last fixed step, and their actual
+// positions while they are moved to the interpolated ones for drawing. Indexed
+// by storage slot.
+static vec2_t entities_pos_prev[ENTITIES_MAX];
+static vec2_t entities_pos_actual[ENTITIES_MAX];
+
+// Entities that were already updated in this frame by the batch physics or
+// the parallel update phase; these are skipped in the serial update loop.
+static bool entities_is_updated[ENTITIES_MAX];
+
+// The results of one job of the parallel update or broadphase phase. Events
+// and touching pairs are recorded in chunked lists (bump allocated) and
+// dispatched on the main thread afterwards, in the order of the jobs. This
+// makes the results independent of the number of threads.
+#define ENTITY_EVENTS_CHUNK_SIZE 64
+
+typedef enum {
+	ENTITY_EVENT_COLLIDE,
+	ENTITY_EVENT_KILL,
+} entity_event_type_t;
+
+typedef struct {
+	entity_event_type_t type;
+	entity_t *entity;
+	trace_t trace;
+} entity_event_t;
+
+typedef struct entity_events_chunk_t {
+	struct entity_events_chunk_t *next;
+	uint32_t len;
+	entity_event_t events[ENTITY_EVENTS_CHUNK_SIZE];
+} entity_events_chunk_t;
+
+typedef struct entity_pairs_chunk_t {
+	struct entity_pairs_chunk_t *next;
+	uint32_t len;
+	entity_t *pairs[ENTITY_EVENTS_CHUNK_SIZE][2];
+} entity_pairs_chunk_t;
+
+typedef struct {
+	entity_events_chunk_t *events_first, *events_last;
+	entity_pairs_chunk_t *pairs_first, *pairs_last;
+	uint32_t checks;
+	uint32_t cells;
+} entity_job_result_t;
+
+static bool is_parallel_phase = false;
+static _Thread_local entity_job_result_t *job_result = NULL;
+static entity_t **parallel_entities;
 
 static void entity_move(entity_t *self, vec2_t vstep);
+static void entity_move_traced(entity_t *self, vec2_t vstep, trace_t *t);
 static void entity_handle_trace_result(entity_t *self, trace_t *t);
 static void entity_resolve_collision(entity_t *a, entity_t *b);
 static void entities_separate_on_x_axis(entity_t *left, entity_t *right, float left_move, float right_move, float overlap);
 static void entities_separate_on_y_axis(entity_t *top, entity_t *bottom, float top_move, float bottom_move, float overlap);
+static void entities_sweep_sort(void);
+static void entities_sweep(uint32_t start, uint32_t end, entity_job_result_t *result);
+static void entities_sweep_job(void *data, uint32_t start, uint32_t end);
+static void entities_grid_build(void);
+static uint32_t entities_grid_sweep(uint32_t start, uint32_t end, entity_job_result_t *result);
+static void entities_grid_sweep_job(void *data, uint32_t start, uint32_t end);
+static void entities_parallel_update(void);
+static void entities_parallel_pairs(job_func_t func, uint32_t len);
+static void entities_handle_pair(entity_t *e1, entity_t *e2);
+static void entities_grid_reset(void);
+static void entities_names_reset(void);
+static void entities_names_rebuild(void);
+static void entities_world_reset(void);
+static void entities_world_forget(void);
+static void entities_restore(void *src);
+static void entity_name_remove(uint32_t index);
+static void entity_type_list_add(uint32_t index, entity_type_t type);
+static void entity_type_list_remove(uint32_t index);
 
 
 static void noop_load(void) {}
@@ -36,6 +213,7 @@ static void noop_trigger(entity_t *self, entity_t *other) {}
 static void noop_message(entity_t *self, entity_message_t message, void *data) {}
 
 void entities_init(void) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_ENTITY);
 	// Set up the vtab for all entity types and provide default implementations
 	// for functions that are not overridden. Some of the defaults are a simple
 	// no-op. This is a tiny bit faster than checking if the function pointer
@@ -59,6 +237,14 @@ void entities_init(void) {
 		if (!entity_vtab[i].message)  { entity_vtab[i].message = noop_message; }
 	}
 
+	// The name index needs a power of 2 capacity of at least twice the
+	// number of entities
+	uint32_t names_capacity = 1;
+	while (names_capacity < ENTITIES_MAX * 2) {
+		names_capacity <<= 1;
+	}
+	names_mask = names_capacity - 1;
+
 	// Call load function on all entity types
 	for (uint32_t ti = 0; ti < ENTITY_TYPES_COUNT; ti++) {
 		entity_vtab[ti].load();
@@ -72,10 +258,382 @@ void entities_cleanup(void) {
 }
 
 void entities_reset(void) {
-	for (int i = 0; i < ENTITIES_MAX; i++) {
-		entities[i] = &entities_storage[i];
-	}
+	// Slots above entities_storage_len are never resolved by entity_by_ref(),
+	// so there's no need to touch the storage itself. The generations are 
+	// kept, so that refs from before the reset stay invalid when the slot is
+	// re-used.
 	entities_len = 0;
+	entities_storage_len = 0;
+	entities_free_len = 0;
+	entities_world_reset();
+	entities_grid_reset();
+	entities_names_reset();
+
+	for (uint32_t i = 0; i < ENTITY_TYPES_COUNT; i++) {
+		types_head[i] = ENTITY_TYPE_LIST_END;
+		types_tail[i] = ENTITY_TYPE_LIST_END;
+		types_count[i] = 0;
+	}
+}
+
+// The snapshot is a header followed by the used parts of the storage, 
+// generation, type list, name, order and free list arrays. The arrays whose
+// length only changes when the storage grows come first, so that two 
+// snapshots mostly line up for entity_world_save(). The name index and the 
+// grid are rebuilt on restore.
+typedef struct {
+	uint32_t entities_len;
+	uint32_t entity_unique_id;
+	uint32_t storage_len;
+	uint32_t free_len;
+	uint32_t types_head[ENTITY_TYPES_COUNT];
+	uint32_t types_tail[ENTITY_TYPES_COUNT];
+	uint32_t types_count[ENTITY_TYPES_COUNT];
+} entity_snapshot_header_t;
+
+#define ENTITY_SNAPSHOT_ARRAYS(X) \
+	X(entities_storage, h->storage_len) \
+	X(entities_generation, h->storage_len) \
+	X(types_next, h->storage_len) \
+	X(types_prev, h->storage_len) \
+	X(types_of_slot, h->storage_len) \
+	X(names_indexed, h->storage_len) \
+	X(entities, h->entities_len) \
+	X(entities_free, h->free_len)
+
+uint32_t entities_snapshot_size(void) {
+	entity_snapshot_header_t header = {
+		.entities_len = entities_len,
+		.storage_len = entities_storage_len,
+		.free_len = entities_free_len
+	};
+	entity_snapshot_header_t *h = &header;
+	uint32_t size = sizeof(entity_snapshot_header_t);
+	#define ENTITY_SNAPSHOT_ARRAY_SIZE(ARRAY, LEN) size += sizeof(ARRAY[0]) * (LEN);
+	ENTITY_SNAPSHOT_ARRAYS(ENTITY_SNAPSHOT_ARRAY_SIZE)
+	return size;
+}
+
+void entities_snapshot_save(void *dest) {
+	entity_snapshot_header_t *h = dest;
+	h->entities_len = entities_len;
+	h->entity_unique_id = entity_unique_id;
+	h->storage_len = entities_storage_len;
+	h->free_len = entities_free_len;
+	memcpy(h->types_head, types_head, sizeof(types_head));
+	memcpy(h->types_tail, types_tail, sizeof(types_tail));
+	memcpy(h->types_count, types_count, sizeof(types_count));
+
+	uint8_t *p = (uint8_t *)(h + 1);
+	#define ENTITY_SNAPSHOT_ARRAY_SAVE(ARRAY, LEN) \
+		memcpy(p, ARRAY, sizeof(ARRAY[0]) * (LEN)); \
+		p += sizeof(ARRAY[0]) * (LEN);
+	ENTITY_SNAPSHOT_ARRAYS(ENTITY_SNAPSHOT_ARRAY_SAVE)
+}
+
+void entities_snapshot_restore(void *src) {
+	entities_restore(src);
+	entities_world_forget();
+}
+
+static void entities_restore(void *src) {
+	entity_snapshot_header_t *h = src;
+	entities_len = h->entities_len;
+	entity_unique_id = h->entity_unique_id;
+	entities_storage_len = h->storage_len;
+	entities_free_len = h->free_len;
+	memcpy(types_head, h->types_head, sizeof(types_head));
+	memcpy(types_tail, h->types_tail, sizeof(types_tail));
+	memcpy(types_count, h->types_count, sizeof(types_count));
+
+	uint8_t *p = (uint8_t *)(h + 1);
+	#define ENTITY_SNAPSHOT_ARRAY_RESTORE(ARRAY, LEN) \
+		memcpy(ARRAY, p, sizeof(ARRAY[0]) * (LEN)); \
+		p += sizeof(ARRAY[0]) * (LEN);
+	ENTITY_SNAPSHOT_ARRAYS(ENTITY_SNAPSHOT_ARRAY_RESTORE)
+
+	memset(entities_is_updated, 0, sizeof(entities_is_updated));
+	entities_grid_reset();
+	entities_names_rebuild();
+}
+
+
+// The world state for entity_world_save() is gathered into a flat buffer: a
+// header, the tiles of the collision and background maps and the entity 
+// snapshot. Only the last saved state is kept in full (world_raw); each saved
+// entity_world_t holds the XOR of its state with the state saved before it, 
+// run length encoded. Loading an older state undoes the deltas of all newer
+// ones on world_raw, newest first. Bytes beyond the length of a state are 
+// always zero in both raw buffers, so states of different lengths can be 
+// XORed.
+struct entity_world_t {
+	entity_world_t *prev;
+	uint32_t prev_seq;
+	uint32_t seq;
+	uint32_t len;
+	uint8_t data[];
+};
+
+typedef struct {
+	uint32_t len;
+	uint32_t maps_size;
+	double time;
+	uint64_t frame;
+	rand_state_t rand;
+} entity_world_header_t;
+
+static uint8_t *world_raw = NULL;
+static uint8_t *world_scratch = NULL;
+static uint32_t world_raw_len = 0;
+static uint32_t world_scratch_len = 0;
+static uint32_t world_capacity = 0;
+static entity_world_t *world_latest = NULL;
+static uint32_t world_seq = 0;
+
+static void entities_world_reset(void) {
+	// The buffers were bump allocated by the previous scene
+	world_raw = NULL;
+	world_scratch = NULL;
+	world_latest = NULL;
+}
+
+static void entities_world_forget(void) {
+	if (!world_raw) {
+		return;
+	}
+
+	// An engine snapshot restore reverted the bump memory of the raw buffers
+	// and the saved worlds, but not the history that refers to them. If the 
+	// buffers were created after the snapshot, they are gone. Otherwise they
+	// are kept, but all saved states are discarded.
+	uint8_t *bump_end = bump_mark_ptr(bump_mark());
+	if (world_raw >= bump_end || world_scratch >= bump_end) {
+		entities_world_reset();
+		return;
+	}
+	memset(world_raw, 0, world_capacity);
+	memset(world_scratch, 0, world_capacity);
+	world_raw_len = 0;
+	world_scratch_len = 0;
+	world_latest = NULL;
+}
+
+static uint32_t entity_world_maps_size(void) {
+	uint32_t size = 0;
+	if (engine.collision_map) {
+		size += engine.collision_map->size.x * engine.collision_map->size.y * sizeof(uint16_t);
+	}
+	for (uint32_t i = 0; i < engine.background_maps_len; i++) {
+		size += engine.background_maps[i]->size.x * engine.background_maps[i]->size.y * sizeof(uint16_t);
+	}
+	return size;
+}
+
+// Copy the tiles of all maps to or from p
+static uint8_t *entity_world_maps_copy(uint8_t *p, bool save) {
+	map_t *maps[ENGINE_MAX_BACKGROUND_MAPS + 1];
+	uint32_t maps_len = 0;
+	if (engine.collision_map) {
+		maps[maps_len++] = engine.collision_map;
+	}
+	for (uint32_t i = 0; i < engine.background_maps_len; i++) {
+		maps[maps_len++] = engine.background_maps[i];
+	}
+
+	for (uint32_t i = 0; i < maps_len; i++) {
+		uint32_t size = maps[i]->size.x * maps[i]->size.y * sizeof(uint16_t);
+		if (save) {
+			memcpy(p, maps[i]->data, size);
+		}
+		else if (memcmp(maps[i]->data, p, size) != 0) {
+			memcpy(maps[i]->data, p, size);
+			map_update_solid(maps[i]);
+		}
+		p += size;
+	}
+	return p;
+}
+
+static uint32_t entity_world_gather(uint8_t *dest) {
+	entity_world_header_t *h = (entity_world_header_t *)dest;
+	uint32_t maps_size = entity_world_maps_size();
+	uint32_t len = sizeof(entity_world_header_t) + maps_size + entities_snapshot_size();
+	error_if(len > world_capacity, "World state exceeds the capacity of entity_world_create()");
+
+	h->len = len;
+	h->maps_size = maps_size;
+	h->time = engine.time;
+	h->frame = engine.frame;
+	h->rand = rand_state();
+	uint8_t *p = entity_world_maps_copy(dest + sizeof(entity_world_header_t), true);
+	entities_snapshot_save(p);
+	return len;
+}
+
+static void entity_world_scatter(uint8_t *src) {
+	entity_world_header_t *h = (entity_world_header_t *)src;
+	error_if(h->maps_size != entity_world_maps_size(), "Maps changed since the world state was saved");
+
+	engine.time = h->time;
+	engine.frame = h->frame;
+	rand_set_state(h->rand);
+	uint8_t *p = entity_world_maps_copy(src + sizeof(entity_world_header_t), false);
+	entities_restore(p);
+
+	// Don't interpolate from the positions before the load
+	entities_store_positions();
+}
+
+static inline uint8_t *entity_world_write_varint(uint8_t *p, uint32_t v) {
+	while (v >= 0x80) {
+		*(p++) = v | 0x80;
+		v >>= 7;
+	}
+	*(p++) = v;
+	return p;
+}
+
+static inline uint8_t *entity_world_read_varint(uint8_t *p, uint32_t *v) {
+	*v = 0;
+	for (uint32_t shift = 0; ; shift += 7) {
+		*v |= (*p & 0x7f) << shift;
+		if (!(*(p++) & 0x80)) {
+			return p;
+		}
+	}
+}
+
+static inline uint64_t entity_world_load8(uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Encode a XOR b in 8 byte words, as pairs of (equal words, differing words)
+// runs, followed by the XORed differing words. A run of differing words only
+// ends at an equal word, so the encoding is never more than a few bytes 
+// larger than the input. The buffers must be zero padded to a multiple of 8.
+static uint32_t entity_world_encode(uint8_t *a, uint8_t *b, uint32_t len, uint8_t *dest) {
+	uint8_t *p = dest;
+	uint32_t words = (len + 7) / 8;
+	uint32_t i = 0;
+	while (i < words) {
+		uint32_t equal_start = i;
+		while (i < words && entity_world_load8(a + i * 8) == entity_world_load8(b + i * 8)) {
+			i++;
+		}
+		uint32_t diff_start = i;
+		while (i < words && entity_world_load8(a + i * 8) != entity_world_load8(b + i * 8)) {
+			i++;
+		}
+
+		p = entity_world_write_varint(p, diff_start - equal_start);
+		p = entity_world_write_varint(p, i - diff_start);
+		for (uint32_t j = diff_start; j < i; j++) {
+			uint64_t x = entity_world_load8(a + j * 8) ^ entity_world_load8(b + j * 8);
+			memcpy(p, &x, sizeof(x));
+			p += sizeof(x);
+		}
+	}
+	return p - dest;
+}
+
+// XOR the delta onto dest
+static void entity_world_decode(entity_world_t *world, uint8_t *dest) {
+	uint8_t *p = world->data;
+	uint8_t *end = world->data + world->len;
+	while (p < end) {
+		uint32_t equal_len, diff_len;
+		p = entity_world_read_varint(p, &equal_len);
+		p = entity_world_read_varint(p, &diff_len);
+		dest += equal_len * 8;
+		for (uint32_t j = 0; j < diff_len; j++) {
+			uint64_t x = entity_world_load8(dest) ^ entity_world_load8(p);
+			memcpy(dest, &x, sizeof(x));
+			dest += sizeof(x);
+			p += sizeof(x);
+		}
+	}
+}
+
+static entity_world_t *entity_world_prev(entity_world_t *world) {
+	return world->prev && world->prev->seq == world->prev_seq
+		? world->prev
+		: NULL;
+}
+
+entity_world_t *entity_world_create(void) {
+	error_if(engine_is_running(), "entity_world_create() must be called from scene init");
+
+	// The raw buffers are shared by all worlds of the scene and sized for the
+	// maps at the time of the first call and ENTITIES_MAX entities.
+	if (!world_raw) {
+		world_capacity = 
+			sizeof(entity_world_header_t) + entity_world_maps_size() + 
+			sizeof(entity_snapshot_header_t) + ENTITIES_MAX * (
+				sizeof(entities_storage[0]) + sizeof(entities_generation[0]) + 
+				sizeof(types_next[0]) + sizeof(types_prev[0]) + sizeof(types_of_slot[0]) + 
+				sizeof(names_indexed[0]) + sizeof(entities[0]) + sizeof(entities_free[0])
+			);
+		world_capacity = (world_capacity + 7) & ~7; // padded to 8 bytes
+		world_raw = bump_alloc(world_capacity);
+		world_scratch = bump_alloc(world_capacity);
+		world_raw_len = 0;
+		world_scratch_len = 0;
+		world_latest = NULL;
+	}
+
+	// Room for the varints of the first and the last run
+	entity_world_t *world = bump_alloc(sizeof(entity_world_t) + world_capacity + 32);
+	return world;
+}
+
+void entity_world_save(entity_world_t *world) {
+	error_if(!world_raw, "entity_world_save() called without entity_world_create()");
+	error_if(is_parallel_phase, "entity_world_save() called from a parallel update()");
+
+	uint32_t len = entity_world_gather(world_scratch);
+	if (len < world_scratch_len) {
+		memset(world_scratch + len, 0, world_scratch_len - len);
+	}
+	world->len = entity_world_encode(world_scratch, world_raw, max(len, world_raw_len), world->data);
+	world->prev = world_latest;
+	world->prev_seq = world_latest ? world_latest->seq : 0;
+	world->seq = ++world_seq;
+	world_latest = world;
+
+	uint8_t *tmp = world_raw;
+	world_raw = world_scratch;
+	world_scratch = tmp;
+	world_scratch_len = world_raw_len;
+	world_raw_len = len;
+}
+
+void entity_world_load(entity_world_t *world) {
+	error_if(is_parallel_phase, "entity_world_load() called from a parallel update()");
+
+	entity_world_t *w = world_latest;
+	while (w && w != world) {
+		w = entity_world_prev(w);
+	}
+	error_if(!w, "World state is not in the history of entity_world_save()");
+
+	for (w = world_latest; w != world; w = entity_world_prev(w)) {
+		entity_world_decode(w, world_raw);
+	}
+	world_raw_len = ((entity_world_header_t *)world_raw)->len;
+	world_latest = world;
+	world_seq = world->seq;
+	entity_world_scatter(world_raw);
+}
+
+void entities_set_broadphase(entity_broadphase_t bp) {
+	broadphase = bp;
+	entities_grid_reset();
+}
+
+entity_broadphase_t entities_broadphase(void) {
+	return broadphase;
 }
 
 entity_type_t entity_type_by_name(char *type_name) {
@@ -95,66 +653,416 @@ const char *entity_type_name(entity_type_t type) {
 }
 
 void entities_update(void) {
+	profiler_zone("entities_update");
+	alloc_subsystem(ALLOC_SUBSYSTEM_ENTITY);
 	double start = platform_now();
-	// Update all entities
+
+	#if ENTITY_BATCH_PHYSICS
+		entities_batch_update();
+	#endif
+
+	entities_parallel_update();
+
+	// Update all remaining entities
+	profiler_begin("entities_update_serial");
 	for (int i = 0; i < entities_len; i++) {
 		entity_t *ent = entities[i];
-		entity_update(ent);
+		if (entities_is_updated[ent - entities_storage]) {
+			entities_is_updated[ent - entities_storage] = false;
+		}
+		else {
+			entity_update(ent);
+		}
+
+		uint32_t index = ent - entities_storage;
+		if (ent->name != names_indexed[index]) {
+			entity_set_name(ent, ent->name);
+		}
 
 		if (!ent->is_alive) {
-			// If this entity is dead overwrite it with the last one and
-			// decrease count.			
+			// If this entity is dead, return its storage slot to the free 
+			// list, overwrite it with the last one and decrease count.
+			entity_name_remove(index);
+			entity_type_list_remove(index);
+			entities_free[entities_free_len++] = index;
 			entities_len--;
 			if (i < entities_len) {
-				entity_t *last = entities[entities_len];
-				entities[entities_len] = entities[i];
-				entities[i] = last;
+				entities[i] = entities[entities_len];
 				i--;
 			}
 		}
 	}
 
-	// Sort by x or y position - insertion sort
-	#define COMPARE_POS(a, b) (a->pos.ENTITY_SWEEP_AXIS > b->pos.ENTITY_SWEEP_AXIS)
-	sort(entities, entities_len, COMPARE_POS);
-		
-	// Sweep touches
+	profiler_end();
+
+	profiler_begin("entities_broadphase");
 	engine.perf.checks = 0;
-	for (int i = 0; i < entities_len; i++) {
-		entity_t *e1 = entities[i];
+	engine.perf.pairs = 0;
+	engine.perf.cells = 0;
+
+	bool parallel_pairs = ENTITY_PARALLEL_BROADPHASE && entities_len >= ENTITY_PARALLEL_BROADPHASE_MIN;
+	if (broadphase == ENTITY_BROADPHASE_GRID) {
+		entities_grid_build();
+		if (parallel_pairs) {
+			entities_parallel_pairs(entities_grid_sweep_job, grid_entities_len);
+		}
+		else {
+			engine.perf.cells += entities_grid_sweep(0, grid_entities_len, NULL);
+		}
+	}
+	else {
+		entities_sweep_sort();
+		if (parallel_pairs) {
+			entities_parallel_pairs(entities_sweep_job, entities_len);
+		}
+		else {
+			entities_sweep(0, entities_len, NULL);
+		}
+	}
+	profiler_end();
+
+	engine.perf.entities = entities_len;
+}
+
+static void *entities_job_alloc(uint32_t size) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_ENTITY);
+	// Called from any thread during the parallel phases; the memory is only
+	// needed for the current frame.
+	return bump_alloc_atomic(size);
+}
+
+static void entities_defer_event(entity_event_type_t type, entity_t *ent, trace_t *trace) {
+	entity_job_result_t *result = job_result;
+	if (!result->events_last || result->events_last->len == ENTITY_EVENTS_CHUNK_SIZE) {
+		entity_events_chunk_t *chunk = entities_job_alloc(sizeof(entity_events_chunk_t));
+		if (result->events_last) {
+			result->events_last->next = chunk;
+		}
+		else {
+			result->events_first = chunk;
+		}
+		result->events_last = chunk;
+	}
+	entity_event_t *event = &result->events_last->events[result->events_last->len++];
+	event->type = type;
+	event->entity = ent;
+	if (trace) {
+		event->trace = *trace;
+	}
+}
+
+static void entities_defer_pair(entity_job_result_t *result, entity_t *e1, entity_t *e2) {
+	if (!result->pairs_last || result->pairs_last->len == ENTITY_EVENTS_CHUNK_SIZE) {
+		entity_pairs_chunk_t *chunk = entities_job_alloc(sizeof(entity_pairs_chunk_t));
+		if (result->pairs_last) {
+			result->pairs_last->next = chunk;
+		}
+		else {
+			result->pairs_first = chunk;
+		}
+		result->pairs_last = chunk;
+	}
+	entity_pairs_chunk_t *chunk = result->pairs_last;
+	chunk->pairs[chunk->len][0] = e1;
+	chunk->pairs[chunk->len][1] = e2;
+	chunk->len++;
+}
+
+void entity_kill_callback(entity_t *self) {
+	if (job_result) {
+		entities_defer_event(ENTITY_EVENT_KILL, self, NULL);
+	}
+	else {
+		entity_vtab[self->type].kill(self);
+	}
+}
+
+static void entities_update_job(void *data, uint32_t start, uint32_t end) {
+	job_result = &((entity_job_result_t *)data)[start / ENTITY_PARALLEL_BATCH];
+	for (uint32_t i = start; i < end; i++) {
+		entity_update(parallel_entities[i]);
+	}
+	job_result = NULL;
+}
+
+static void entities_parallel_update(void) {
+	bool has_parallel_types = false;
+	for (uint32_t i = 0; i < ENTITY_TYPES_COUNT; i++) {
+		has_parallel_types |= entity_vtab[i].parallel_update;
+	}
+	if (!has_parallel_types) {
+		return;
+	}
+
+	// Collect all entities with a parallel update() that were not already 
+	// updated by the batch physics.
+	uint32_t len = 0;
+	parallel_entities = bump_alloc(sizeof(entity_t *) * entities_len);
+	for (uint32_t i = 0; i < entities_len; i++) {
+		entity_t *ent = entities[i];
+		uint32_t index = ent - entities_storage;
+		if (entity_vtab[ent->type].parallel_update && ent->is_alive && !entities_is_updated[index]) {
+			parallel_entities[len++] = ent;
+			entities_is_updated[index] = true;
+		}
+	}
+
+	if (len == 0) {
+		return;
+	}
+
+	uint32_t jobs_len = (len + ENTITY_PARALLEL_BATCH - 1) / ENTITY_PARALLEL_BATCH;
+	entity_job_result_t *results = bump_alloc(sizeof(entity_job_result_t) * jobs_len);
+
+	job_counter_t counter = {};
+	is_parallel_phase = true;
+	jobs_parallel_for(entities_update_job, results, len, ENTITY_PARALLEL_BATCH, &counter);
+	jobs_wait(&counter);
+	is_parallel_phase = false;
+
+	// Dispatch all deferred events in order
+	for (uint32_t j = 0; j < jobs_len; j++) {
+		for (entity_events_chunk_t *chunk = results[j].events_first; chunk; chunk = chunk->next) {
+			for (uint32_t i = 0; i < chunk->len; i++) {
+				entity_event_t *event = &chunk->events[i];
+				if (event->type == ENTITY_EVENT_COLLIDE) {
+					entity_collide(event->entity, event->trace.normal, &event->trace);
+				}
+				else {
+					entity_vtab[event->entity->type].kill(event->entity);
+				}
+			}
+		}
+	}
+}
+
+static void entities_parallel_pairs(job_func_t func, uint32_t len) {
+	uint32_t jobs_len = (len + ENTITY_PARALLEL_BATCH - 1) / ENTITY_PARALLEL_BATCH;
+	entity_job_result_t *results = bump_alloc(sizeof(entity_job_result_t) * jobs_len);
+
+	job_counter_t counter = {};
+	is_parallel_phase = true;
+	jobs_parallel_for(func, results, len, ENTITY_PARALLEL_BATCH, &counter);
+	jobs_wait(&counter);
+	is_parallel_phase = false;
+
+	// Dispatch all touching pairs in order. Resolving the collision of one 
+	// pair may have moved the entities of another, so we have to check again
+	// if they are still touching.
+	for (uint32_t j = 0; j < jobs_len; j++) {
+		engine.perf.checks += results[j].checks;
+		engine.perf.cells += results[j].cells;
+		for (entity_pairs_chunk_t *chunk = results[j].pairs_first; chunk; chunk = chunk->next) {
+			for (uint32_t i = 0; i < chunk->len; i++) {
+				entities_handle_pair(chunk->pairs[i][0], chunk->pairs[i][1]);
+			}
+		}
+	}
+}
+
+static inline bool entity_is_checked(entity_t *ent) {
+	return (
+		ent->check_against != ENTITY_GROUP_NONE ||
+		ent->group != ENTITY_GROUP_NONE ||
+		((int)ent->physics > ENTITY_COLLIDES_LITE)
+	);
+}
+
+static void entities_handle_pair(entity_t *e1, entity_t *e2) {
+	if (entity_is_touching(e1, e2)) {
+		engine.perf.pairs++;
+		if (e1->check_against & e2->group) {
+			entity_touch(e1, e2);
+		}
+		if (e1->group & e2->check_against) {
+			entity_touch(e2, e1);
+		}
 
 		if (
-			e1->check_against != ENTITY_GROUP_NONE ||
-			e1->group != ENTITY_GROUP_NONE ||
-			((int)e1->physics > ENTITY_COLLIDES_LITE)
+			(int)e1->physics >= ENTITY_COLLIDES_LITE && 
+			(int)e2->physics >= ENTITY_COLLIDES_LITE &&
+			(e1->physics + e2->physics) >= (ENTITY_COLLIDES_ACTIVE | ENTITY_COLLIDES_LITE) &&
+			e1->mass + e2->mass > 0
 		) {
+			entity_resolve_collision(e1, e2);
+		}
+	}
+}
+
+// Check a pair of entities from the broadphase. With a result, i.e. in the 
+// parallel broadphase, touching pairs are only recorded. Otherwise they are 
+// handled right away.
+static inline void entities_check_pair(entity_t *e1, entity_t *e2, entity_job_result_t *result) {
+	if (!result) {
+		engine.perf.checks++;
+		entities_handle_pair(e1, e2);
+	}
+	else {
+		result->checks++;
+		if (entity_is_touching(e1, e2)) {
+			entities_defer_pair(result, e1, e2);
+		}
+	}
+}
+
+static void entities_sweep_sort(void) {
+	// Sort by x or y position
+	#define SWEEP_POS(e) (e->pos.ENTITY_SWEEP_AXIS)
+	sort_by_key(entities, entities_len, SWEEP_POS);
+}
+
+static void entities_sweep(uint32_t start, uint32_t end, entity_job_result_t *result) {
+	// Sweep touches
+	for (uint32_t i = start; i < end; i++) {
+		entity_t *e1 = entities[i];
+
+		if (entity_is_checked(e1)) {
 			float max_pos = e1->pos.ENTITY_SWEEP_AXIS + e1->size.ENTITY_SWEEP_AXIS;
-			for (int j = i + 1; j < entities_len && entities[j]->pos.ENTITY_SWEEP_AXIS < max_pos; j++) {
-				entity_t *e2 = entities[j];
-				engine.perf.checks++;
+			for (uint32_t j = i + 1; j < entities_len && entities[j]->pos.ENTITY_SWEEP_AXIS < max_pos; j++) {
+				entities_check_pair(e1, entities[j], result);
+			}
+		}
+	}
+}
 
-				if (entity_is_touching(e1, e2)) {
-					if (e1->check_against & e2->group) {
-						entity_touch(e1, e2);
-					}
-					if (e1->group & e2->check_against) {
-						entity_touch(e2, e1);
+static void entities_sweep_job(void *data, uint32_t start, uint32_t end) {
+	entities_sweep(start, end, &((entity_job_result_t *)data)[start / ENTITY_PARALLEL_BATCH]);
+}
+
+static inline uint32_t entities_grid_hash(int32_t cx, int32_t cy) {
+	return ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u) & (ENTITY_GRID_BUCKETS - 1);
+}
+
+static inline int32_t entities_grid_cell(float v) {
+	return floorf(v * grid_inv_cell_size);
+}
+
+static void entities_grid_reset(void) {
+	grid_is_built = false;
+	grid_entities_len = 0;
+	grid_large_len = 0;
+	grid_pending_len = 0;
+}
+
+static void entities_grid_build(void) {
+	float cell_size = engine.collision_map 
+		? engine.collision_map->tile_size * ENTITY_GRID_CELL_TILES
+		: ENTITY_GRID_CELL_SIZE;
+	grid_inv_cell_size = 1.0 / cell_size;
+
+	grid_entities_len = 0;
+	grid_large_len = 0;
+	grid_pending_len = 0;
+	memset(grid_buckets, 0, sizeof(grid_buckets));
+
+	// Compute the cell range for each entity and count the number of entries
+	// for each bucket.
+	for (int i = 0; i < entities_len; i++) {
+		entity_t *ent = entities[i];
+		grid_entity_t *ge = &grid_entities[grid_entities_len++];
+		ge->entity = ent;
+		ge->is_checked = entity_is_checked(ent);
+		grid_index_for_storage[ent - entities_storage] = grid_entities_len - 1;
+		ge->x0 = entities_grid_cell(ent->pos.x);
+		ge->y0 = entities_grid_cell(ent->pos.y);
+		ge->x1 = entities_grid_cell(ent->pos.x + ent->size.x);
+		ge->y1 = entities_grid_cell(ent->pos.y + ent->size.y);
+
+		if (ge->x1 - ge->x0 > 1 || ge->y1 - ge->y0 > 1) {
+			grid_large[grid_large_len++] = grid_entities_len - 1;
+			continue;
+		}
+
+		for (int32_t cy = ge->y0; cy <= ge->y1; cy++) {
+			for (int32_t cx = ge->x0; cx <= ge->x1; cx++) {
+				grid_buckets[entities_grid_hash(cx, cy) + 1]++;
+			}
+		}
+	}
+
+	// Prefix sum to get the start of each bucket
+	for (int i = 0; i < ENTITY_GRID_BUCKETS; i++) {
+		grid_buckets[i + 1] += grid_buckets[i];
+	}
+
+	// Fill the buckets. This uses grid_buckets[b] as the write position for
+	// bucket b, which leaves us with grid_buckets[b] pointing to the _end_ of
+	// bucket b (or the start of b+1) when we're done. So we shift it back by
+	// one bucket afterwards.
+	for (uint32_t n = 0; n < grid_entities_len; n++) {
+		grid_entity_t *ge = &grid_entities[n];
+		if (ge->x1 - ge->x0 > 1 || ge->y1 - ge->y0 > 1) {
+			continue;
+		}
+		for (int32_t cy = ge->y0; cy <= ge->y1; cy++) {
+			for (int32_t cx = ge->x0; cx <= ge->x1; cx++) {
+				uint32_t b = entities_grid_hash(cx, cy);
+				grid_entries[grid_buckets[b]++] = (grid_entry_t){.index = n, .cx = cx, .cy = cy};
+			}
+		}
+	}
+	memmove(grid_buckets + 1, grid_buckets, sizeof(uint32_t) * ENTITY_GRID_BUCKETS);
+	grid_buckets[0] = 0;
+	grid_is_built = true;
+}
+
+static uint32_t entities_grid_sweep(uint32_t start, uint32_t end, entity_job_result_t *result) {
+	uint32_t cells = 0;
+	for (uint32_t n = start; n < end; n++) {
+		grid_entity_t *ge1 = &grid_entities[n];
+		if (!ge1->is_checked) {
+			continue;
+		}
+
+		bool is_large = (ge1->x1 - ge1->x0 > 1 || ge1->y1 - ge1->y0 > 1);
+		
+		// Check all small entities in the cells covered by this one. Each 
+		// pair of entities may share more than one cell, so we only check the
+		// pair in the cell where their overlap starts (top left).
+		// Small vs. small pairs are checked only once, from the entity that 
+		// comes first. Small vs. large pairs are always checked from the large
+		// entity.
+		for (int32_t cy = ge1->y0; cy <= ge1->y1; cy++) {
+			for (int32_t cx = ge1->x0; cx <= ge1->x1; cx++) {
+				cells++;
+				uint32_t b = entities_grid_hash(cx, cy);
+				for (uint32_t i = grid_buckets[b]; i < grid_buckets[b + 1]; i++) {
+					grid_entry_t *entry = &grid_entries[i];
+					if (
+						entry->cx != cx || entry->cy != cy ||
+						(!is_large && entry->index <= n)
+					) {
+						continue;
 					}
 
+					grid_entity_t *ge2 = &grid_entities[entry->index];
 					if (
-						(int)e1->physics >= ENTITY_COLLIDES_LITE && 
-						(int)e2->physics >= ENTITY_COLLIDES_LITE &&
-						(e1->physics + e2->physics) >= (ENTITY_COLLIDES_ACTIVE | ENTITY_COLLIDES_LITE) &&
-						e1->mass + e2->mass > 0
+						!ge2->is_checked ||
+						max(ge1->x0, ge2->x0) != cx ||
+						max(ge1->y0, ge2->y0) != cy
 					) {
-						entity_resolve_collision(e1, e2);
+						continue;
 					}
+					entities_check_pair(ge1->entity, ge2->entity, result);
+				}
+			}
+		}
+
+		// Large vs. large
+		if (is_large) {
+			for (uint32_t i = 0; i < grid_large_len; i++) {
+				if (grid_large[i] > n && grid_entities[grid_large[i]].is_checked) {
+					entities_check_pair(ge1->entity, grid_entities[grid_large[i]].entity, result);
 				}
 			}
 		}
 	}
+	return cells;
+}
 
-	engine.perf.entities = entities_len;
+static void entities_grid_sweep_job(void *data, uint32_t start, uint32_t end) {
+	entity_job_result_t *result = &((entity_job_result_t *)data)[start / ENTITY_PARALLEL_BATCH];
+	result->cells = entities_grid_sweep(start, end, result);
 }
 
 bool entity_is_touching(entity_t *self, entity_t *other) {	
@@ -167,15 +1075,15 @@ bool entity_is_touching(entity_t *self, entity_t *other) {
 }
 
 void entities_draw(vec2_t viewport) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_ENTITY);
 	// Sort entities by draw_order
 	// FIXME: this copies the entity array - which is sorted by pos.x/y and
-	// sorts it again by draw_order. It's using insertion sort, which is slow
-	// for data that is not already mostly sorted.
+	// sorts it again by draw_order.
 	entity_t **draw_ents = bump_alloc(sizeof(entity_t *) * entities_len);
 	memcpy(draw_ents, entities, entities_len * sizeof(entity_t*));
 	
-	#define SORT_DRAW_ORDER(a, b) (a->draw_order > b->draw_order)
-	sort(draw_ents, entities_len, SORT_DRAW_ORDER);
+	#define DRAW_ORDER(e) (e->draw_order)
+	sort_by_key(draw_ents, entities_len, DRAW_ORDER);
 
 	for (int i = 0; i < entities_len; i++) {
 		entity_t *ent = draw_ents[i];
@@ -183,10 +1091,112 @@ void entities_draw(vec2_t viewport) {
 	}
 }
 
+void entities_store_positions(void) {
+	for (uint32_t i = 0; i < entities_len; i++) {
+		entities_pos_prev[entities[i] - entities_storage] = entities[i]->pos;
+	}
+}
+
+void entities_interpolate(float alpha) {
+	for (uint32_t i = 0; i < entities_len; i++) {
+		entity_t *ent = entities[i];
+		uint32_t index = ent - entities_storage;
+		entities_pos_actual[index] = ent->pos;
+		ent->pos = vec2_add(
+			entities_pos_prev[index], 
+			vec2_mulf(vec2_sub(ent->pos, entities_pos_prev[index]), alpha)
+		);
+	}
+}
+
+void entities_interpolate_end(void) {
+	for (uint32_t i = 0; i < entities_len; i++) {
+		entity_t *ent = entities[i];
+		ent->pos = entities_pos_actual[ent - entities_storage];
+	}
+}
+
+static inline uint32_t entity_name_hash(char *name) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (uint8_t *c = (uint8_t *)name; *c; c++) {
+		hash = (hash ^ *c) * 16777619u;
+	}
+	return hash;
+}
+
+static void entities_names_reset(void) {
+	names_epoch++;
+	if (names_epoch == 0) {
+		// Epochs wrapped around; entries from 4 billion resets ago would
+		// become valid again
+		clear(names);
+		names_epoch = 1;
+	}
+	names_used = 0;
+}
+
+static void entity_name_insert(uint32_t index, char *name) {
+	uint32_t hash = entity_name_hash(name);
+	uint32_t i = hash & names_mask;
+	while (names[i].epoch == names_epoch && names[i].index != ENTITY_NAME_REMOVED) {
+		i = (i + 1) & names_mask;
+	}
+	if (names[i].epoch != names_epoch) {
+		names_used++;
+	}
+	names[i] = (entity_name_entry_t){.epoch = names_epoch, .hash = hash, .index = index};
+	names_indexed[index] = name;
+}
+
+static void entity_name_remove(uint32_t index) {
+	char *name = names_indexed[index];
+	if (!name) {
+		return;
+	}
+
+	uint32_t hash = entity_name_hash(name);
+	for (uint32_t i = hash & names_mask; names[i].epoch == names_epoch; i = (i + 1) & names_mask) {
+		if (names[i].index == index) {
+			names[i].index = ENTITY_NAME_REMOVED;
+			break;
+		}
+	}
+	names_indexed[index] = NULL;
+}
+
+static void entities_names_rebuild(void) {
+	entities_names_reset();
+	for (uint32_t i = 0; i < entities_len; i++) {
+		uint32_t index = entities[i] - entities_storage;
+		if (names_indexed[index]) {
+			entity_name_insert(index, names_indexed[index]);
+		}
+	}
+}
+
+void entity_set_name(entity_t *self, char *name) {
+	uint32_t index = self - entities_storage;
+	entity_name_remove(index);
+	self->name = name;
+	if (!name) {
+		return;
+	}
+
+	// Too many tombstones? Rebuild the index from all named entities first
+	if (names_used >= (names_mask + 1) / 4 * 3) {
+		entities_names_rebuild();
+	}
+	entity_name_insert(index, name);
+}
+
 entity_t *entity_by_name(char *name) {
-	// FIXME:PERF: linear search
-	for (int i = 0; i < entities_len; i++) {
-		entity_t *entity = entities[i];
+	uint32_t hash = entity_name_hash(name);
+	for (uint32_t i = hash & names_mask; names[i].epoch == names_epoch; i = (i + 1) & names_mask) {
+		if (names[i].hash != hash || names[i].index == ENTITY_NAME_REMOVED) {
+			continue;
+		}
+		entity_t *entity = &entities_storage[names[i].index];
 		if (entity->is_alive && entity->name && str_equals(name, entity->name)) {
 			return entity;
 		}
@@ -201,7 +1211,80 @@ entity_list_t entities_by_proximity(entity_t *ent, float radius, entity_type_t t
 }
 
 
+static inline void entities_list_add_in_radius(
+	entity_list_t *list, entity_t *entity, vec2_t pos, float radius_squared, 
+	entity_type_t type, entity_t *exclude
+) {
+	if (
+		!entity ||
+		entity == exclude ||
+		(type != ENTITY_TYPE_NONE && entity->type != type) ||
+		!entity->is_alive
+	) {
+		return;
+	}
+
+	// Is the bounding box in the radius?
+	float xd = entity->pos.x + (entity->pos.x < pos.x ? entity->size.x : 0) - pos.x;
+	float yd = entity->pos.y + (entity->pos.y < pos.y ? entity->size.y : 0) - pos.y;
+	if ((xd * xd) + (yd * yd) <= radius_squared) {
+		bump_alloc(sizeof(entity_ref_t));
+		list->entities[list->len++] = entity_ref(entity);
+	}
+}
+
+static entity_list_t entities_by_location_grid(vec2_t pos, float radius, entity_type_t type, entity_t *exclude) {
+	entity_list_t list = {.len = 0, .entities = bump_alloc(0)};
+	float radius_squared = radius * radius;
+
+	// If the grid is not built (i.e. during scene init), or the search area 
+	// covers more cells than there are entities, just check all entities.
+	int32_t qx0 = entities_grid_cell(pos.x - radius);
+	int32_t qy0 = entities_grid_cell(pos.y - radius);
+	int32_t qx1 = entities_grid_cell(pos.x + radius);
+	int32_t qy1 = entities_grid_cell(pos.y + radius);
+	if (!grid_is_built || (uint64_t)(qx1 - qx0 + 1) * (qy1 - qy0 + 1) > entities_len) {
+		for (int i = 0; i < entities_len; i++) {
+			entities_list_add_in_radius(&list, entities[i], pos, radius_squared, type, exclude);
+		}
+		return list;
+	}
+
+	// Entities that cover more than one cell of the search area are only
+	// added in the top left cell of the overlap.
+	for (int32_t cy = qy0; cy <= qy1; cy++) {
+		for (int32_t cx = qx0; cx <= qx1; cx++) {
+			uint32_t b = entities_grid_hash(cx, cy);
+			for (uint32_t i = grid_buckets[b]; i < grid_buckets[b + 1]; i++) {
+				grid_entry_t *entry = &grid_entries[i];
+				grid_entity_t *ge = &grid_entities[entry->index];
+				if (
+					entry->cx == cx && entry->cy == cy &&
+					max(ge->x0, qx0) == cx && max(ge->y0, qy0) == cy
+				) {
+					entities_list_add_in_radius(&list, ge->entity, pos, radius_squared, type, exclude);
+				}
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < grid_large_len; i++) {
+		entities_list_add_in_radius(&list, grid_entities[grid_large[i]].entity, pos, radius_squared, type, exclude);
+	}
+
+	for (uint32_t i = 0; i < grid_pending_len; i++) {
+		entities_list_add_in_radius(&list, grid_pending[i], pos, radius_squared, type, exclude);
+	}
+		
+	return list;
+}
+
 entity_list_t entities_by_location(vec2_t pos, float radius, entity_type_t type, entity_t *exclude) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_ENTITY);
+	if (broadphase == ENTITY_BROADPHASE_GRID) {
+		return entities_by_location_grid(pos, radius, type, exclude);
+	}
+
 	entity_list_t list = {.len = 0, .entities = bump_alloc(0)};
 
 	float start_pos = pos.ENTITY_SWEEP_AXIS - radius;
@@ -238,34 +1321,77 @@ entity_list_t entities_by_location(vec2_t pos, float radius, entity_type_t type,
 			break;
 		}
 
-		// Is this entity in the search range and has the right type?
-		if (
-			entity->pos.ENTITY_SWEEP_AXIS + entity->size.ENTITY_SWEEP_AXIS >= start_pos &&
-			entity != exclude &&
-			(type == ENTITY_TYPE_NONE || entity->type == type) &&
-			entity->is_alive
-		) {
-			// Is the bounding box in the radius?
-			float xd = entity->pos.x + (entity->pos.x < pos.x ? entity->size.x : 0) - pos.x;
-			float yd = entity->pos.y + (entity->pos.y < pos.y ? entity->size.y : 0) - pos.y;
-			if ((xd * xd) + (yd * yd) <= radius_squared) {
-				bump_alloc(sizeof(entity_ref_t));
-				list.entities[list.len++] = entity_ref(entity);
-			}
+		// Is this entity in the search range?
+		if (entity->pos.ENTITY_SWEEP_AXIS + entity->size.ENTITY_SWEEP_AXIS >= start_pos) {
+			entities_list_add_in_radius(&list, entity, pos, radius_squared, type, exclude);
 		}
 	}
 		
 	return list;
 }
 
+static void entity_type_list_add(uint32_t index, entity_type_t type) {
+	types_of_slot[index] = type;
+	types_prev[index] = types_tail[type];
+	types_next[index] = ENTITY_TYPE_LIST_END;
+	if (types_tail[type] != ENTITY_TYPE_LIST_END) {
+		types_next[types_tail[type]] = index;
+	}
+	else {
+		types_head[type] = index;
+	}
+	types_tail[type] = index;
+	types_count[type]++;
+}
+
+static void entity_type_list_remove(uint32_t index) {
+	entity_type_t type = types_of_slot[index];
+	uint32_t prev = types_prev[index];
+	uint32_t next = types_next[index];
+	if (prev != ENTITY_TYPE_LIST_END) {
+		types_next[prev] = next;
+	}
+	else {
+		types_head[type] = next;
+	}
+	if (next != ENTITY_TYPE_LIST_END) {
+		types_prev[next] = prev;
+	}
+	else {
+		types_tail[type] = prev;
+	}
+	types_count[type]--;
+}
+
+static inline entity_t *entity_type_list_alive(uint32_t index) {
+	while (index != ENTITY_TYPE_LIST_END) {
+		entity_t *entity = &entities_storage[index];
+		if (entity->is_alive) {
+			return entity;
+		}
+		index = types_next[index];
+	}
+	return NULL;
+}
+
+entity_t *entities_first_by_type(entity_type_t type) {
+	return entity_type_list_alive(types_head[type]);
+}
+
+entity_t *entities_next_by_type(entity_t *ent) {
+	return entity_type_list_alive(types_next[ent - entities_storage]);
+}
+
 entity_list_t entities_by_type(entity_type_t type) {
-	entity_list_t list = {.len = 0, .entities = bump_alloc(0)};
+	alloc_subsystem(ALLOC_SUBSYSTEM_ENTITY);
+	entity_list_t list = {
+		.len = 0, 
+		.entities = bump_alloc(sizeof(entity_ref_t) * types_count[type])
+	};
 
-	// FIXME:PERF: linear search
-	for (int i = 0; i < entities_len; i++) {
-		entity_t *entity = entities[i];
-		if (entity->type == type && entity->is_alive) {
-			bump_alloc(sizeof(entity_ref_t));
+	for (uint32_t i = types_head[type]; i != ENTITY_TYPE_LIST_END; i = types_next[i]) {
+		entity_t *entity = &entities_storage[i];
+		if (entity->is_alive) {
 			list.entities[list.len++] = entity_ref(entity);
 		}
 	}
@@ -274,6 +1400,7 @@ entity_list_t entities_by_type(entity_type_t type) {
 }
 
 entity_list_t entities_from_json_names(json_t *targets) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_ENTITY);
 	entity_list_t list = {.len = 0, .entities = bump_alloc(0)};
 
 	for (int i = 0; targets && i < targets->len; i++) {
@@ -291,15 +1418,20 @@ entity_ref_t entity_ref(entity_t *self) {
 	if (!self) {
 		return entity_ref_none();
 	}
+	uint32_t index = self - entities_storage;
 	return (entity_ref_t){
-		.id = self->id,
-		.index = (uint32_t)(self - entities_storage)
+		.id = entities_generation[index],
+		.index = index
 	};
 }
 
 entity_t *entity_by_ref(entity_ref_t ref) {
+	if (ref.index >= entities_storage_len || entities_generation[ref.index] != ref.id) {
+		return NULL;
+	}
+
 	entity_t *ent = &entities_storage[ref.index];
-	if (ent->is_alive && ent->id == ref.id) {
+	if (ent->is_alive) {
 		return ent;
 	}
 
@@ -307,11 +1439,27 @@ entity_t *entity_by_ref(entity_ref_t ref) {
 }
 
 entity_t *entity_spawn(entity_type_t type, vec2_t pos) {
-	if (entities_len >= ENTITIES_MAX) {
+	error_if(is_parallel_phase, "entity_spawn() called from a parallel update()");
+
+	uint32_t index;
+	if (entities_free_len > 0) {
+		index = entities_free[--entities_free_len];
+	}
+	else if (entities_storage_len < ENTITIES_MAX) {
+		index = entities_storage_len++;
+	}
+	else {
 		return NULL;
 	}
 
-	entity_t *ent = entities[entities_len];
+	// Generation 0 is reserved for entity_ref_none()
+	entities_generation[index]++;
+	if (entities_generation[index] == 0) {
+		entities_generation[index] = 1;
+	}
+
+	entity_t *ent = &entities_storage[index];
+	entities[entities_len] = ent;
 	entities_len++;
 	entity_unique_id++;
 
@@ -326,6 +1474,22 @@ entity_t *entity_spawn(entity_type_t type, vec2_t pos) {
 	ent->mass = 1;
 	ent->size = vec2(8, 8);
 
+	names_indexed[index] = NULL;
+	entities_pos_prev[index] = pos;
+	entity_type_list_add(index, type);
+	entities_is_updated[index] = false;
+
+	if (grid_is_built && grid_pending_len < ENTITIES_MAX) {
+		uint32_t grid_index = grid_index_for_storage[index];
+		if (grid_index < grid_entities_len && grid_entities[grid_index].entity == ent) {
+			grid_entities[grid_index].entity = NULL;
+		}
+		grid_pending[grid_pending_len++] = ent;
+	}
+	else {
+		grid_is_built = false;
+	}
+
 	entity_init(ent);
 	return ent;
 }
@@ -379,31 +1543,271 @@ void entity_base_update(entity_t *self) {
 	entity_move(self, vstep);
 }
 
+// Note that any bit of ENTITY_PHYSICS_WORLD counts, so entities with only
+// ENTITY_PHYSICS_MOVE are traced against the map, too. The batched physics
+// uses the same test, so that both paths move entities the same way.
+static inline bool entity_collides_with_world(entity_t *self) {
+	return (self->physics & ENTITY_PHYSICS_WORLD) && engine.collision_map;
+}
+
 static void entity_move(entity_t *self, vec2_t vstep) {
-	if ((self->physics & ENTITY_PHYSICS_WORLD) && engine.collision_map) {
+	if (entity_collides_with_world(self)) {
 		trace_t t = trace(engine.collision_map, self->pos, vstep, self->size);
-		entity_handle_trace_result(self, &t);
-
-		// The previous trace was stopped short and we still have some velocity
-		// left? Do a second trace with the new velocity. this allows us
-		// to slide along tiles;
-		if (t.length < 1) {
-			vec2_t rotated_normal = vec2(-t.normal.y, t.normal.x);
-			float vel_along_normal = vec2_dot(vstep, rotated_normal);
-
-			if (vel_along_normal != 0) {
-				float remaining = 1 - t.length;
-				vec2_t vstep2 = vec2_mulf(rotated_normal, vel_along_normal * remaining);	
-				trace_t t2 = trace(engine.collision_map, self->pos, vstep2, self->size);
-				entity_handle_trace_result(self, &t2);
-			}
-		}
+		entity_move_traced(self, vstep, &t);
 	}
 	else {
 		self->pos = vec2_add(self->pos, vstep);
 	}
 }
 
+static void entity_move_traced(entity_t *self, vec2_t vstep, trace_t *t) {
+	entity_handle_trace_result(self, t);
+
+	// The previous trace was stopped short and we still have some velocity
+	// left? Do a second trace with the new velocity. this allows us
+	// to slide along tiles;
+	if (t->length < 1) {
+		vec2_t rotated_normal = vec2(-t->normal.y, t->normal.x);
+		float vel_along_normal = vec2_dot(vstep, rotated_normal);
+
+		if (vel_along_normal != 0) {
+			float remaining = 1 - t->length;
+			vec2_t vstep2 = vec2_mulf(rotated_normal, vel_along_normal * remaining);	
+			trace_t t2 = trace(engine.collision_map, self->pos, vstep2, self->size);
+			entity_handle_trace_result(self, &t2);
+		}
+	}
+}
+
+
+#if ENTITY_BATCH_PHYSICS
+
+// Integrate the velocity and position of the first len entities in the batch,
+// the same way entity_base_update() does. The gravity and friction terms are
+// calculated in double precision, because engine.tick is a double, so that 
+// batched and unbatched entities end up with the exact same results.
+static void entities_batch_integrate(uint32_t len) {
+	float tick = engine.tick;
+	float half_tick = engine.tick * 0.5;
+
+	#if defined(ENTITY_BATCH_SSE2)
+		__m128 tick4 = _mm_set1_ps(tick);
+		__m128 half_tick4 = _mm_set1_ps(half_tick);
+		__m128 gravity4 = _mm_set1_ps(engine.gravity);
+		__m128d tick2 = _mm_set1_pd(engine.tick);
+		__m128d one2 = _mm_set1_pd(1.0);
+
+		#define LO_PD(V) _mm_cvtps_pd(V)
+		#define HI_PD(V) _mm_cvtps_pd(_mm_movehl_ps(V, V))
+		#define TO_PS(LO, HI) _mm_movelh_ps(_mm_cvtpd_ps(LO), _mm_cvtpd_ps(HI))
+
+		for (uint32_t i = 0; i < len; i += 4) {
+			__m128 vx = _mm_load_ps(&batch.vel_x[i]);
+			__m128 vy = _mm_load_ps(&batch.vel_y[i]);
+
+			// vy1 = vy + engine.gravity * gravity * engine.tick
+			__m128 g = _mm_mul_ps(gravity4, _mm_load_ps(&batch.gravity[i]));
+			__m128 vy1 = TO_PS(
+				_mm_add_pd(LO_PD(vy), _mm_mul_pd(LO_PD(g), tick2)),
+				_mm_add_pd(HI_PD(vy), _mm_mul_pd(HI_PD(g), tick2))
+			);
+
+			// f = min(friction * engine.tick, 1)
+			__m128 frx = _mm_load_ps(&batch.friction_x[i]);
+			__m128 fry = _mm_load_ps(&batch.friction_y[i]);
+			__m128 fx = TO_PS(
+				_mm_min_pd(_mm_mul_pd(LO_PD(frx), tick2), one2),
+				_mm_min_pd(_mm_mul_pd(HI_PD(frx), tick2), one2)
+			);
+			__m128 fy = TO_PS(
+				_mm_min_pd(_mm_mul_pd(LO_PD(fry), tick2), one2),
+				_mm_min_pd(_mm_mul_pd(HI_PD(fry), tick2), one2)
+			);
+
+			// v1 = v + (accel * tick - v * f)
+			__m128 vx1 = _mm_add_ps(vx, _mm_sub_ps(
+				_mm_mul_ps(_mm_load_ps(&batch.accel_x[i]), tick4), 
+				_mm_mul_ps(vx, fx)
+			));
+			vy1 = _mm_add_ps(vy1, _mm_sub_ps(
+				_mm_mul_ps(_mm_load_ps(&batch.accel_y[i]), tick4), 
+				_mm_mul_ps(vy1, fy)
+			));
+
+			// pos += (v + v1) * tick/2
+			__m128 px = _mm_add_ps(_mm_load_ps(&batch.pos_x[i]), _mm_mul_ps(_mm_add_ps(vx, vx1), half_tick4));
+			__m128 py = _mm_add_ps(_mm_load_ps(&batch.pos_y[i]), _mm_mul_ps(_mm_add_ps(vy, vy1), half_tick4));
+
+			_mm_store_ps(&batch.vel_x[i], vx1);
+			_mm_store_ps(&batch.vel_y[i], vy1);
+			_mm_store_ps(&batch.pos_x[i], px);
+			_mm_store_ps(&batch.pos_y[i], py);
+		}
+
+		#undef LO_PD
+		#undef HI_PD
+		#undef TO_PS
+
+	#elif defined(ENTITY_BATCH_NEON)
+		float32x4_t tick4 = vdupq_n_f32(tick);
+		float32x4_t half_tick4 = vdupq_n_f32(half_tick);
+		float32x4_t gravity4 = vdupq_n_f32(engine.gravity);
+		float64x2_t tick2 = vdupq_n_f64(engine.tick);
+		float64x2_t one2 = vdupq_n_f64(1.0);
+
+		#define LO_PD(V) vcvt_f64_f32(vget_low_f32(V))
+		#define HI_PD(V) vcvt_high_f64_f32(V)
+		#define TO_PS(LO, HI) vcvt_high_f32_f64(vcvt_f32_f64(LO), HI)
+
+		for (uint32_t i = 0; i < len; i += 4) {
+			float32x4_t vx = vld1q_f32(&batch.vel_x[i]);
+			float32x4_t vy = vld1q_f32(&batch.vel_y[i]);
+
+			// vy1 = vy + engine.gravity * gravity * engine.tick
+			float32x4_t g = vmulq_f32(gravity4, vld1q_f32(&batch.gravity[i]));
+			float32x4_t vy1 = TO_PS(
+				vaddq_f64(LO_PD(vy), vmulq_f64(LO_PD(g), tick2)),
+				vaddq_f64(HI_PD(vy), vmulq_f64(HI_PD(g), tick2))
+			);
+
+			// f = min(friction * engine.tick, 1)
+			float32x4_t frx = vld1q_f32(&batch.friction_x[i]);
+			float32x4_t fry = vld1q_f32(&batch.friction_y[i]);
+			float32x4_t fx = TO_PS(
+				vminq_f64(vmulq_f64(LO_PD(frx), tick2), one2),
+				vminq_f64(vmulq_f64(HI_PD(frx), tick2), one2)
+			);
+			float32x4_t fy = TO_PS(
+				vminq_f64(vmulq_f64(LO_PD(fry), tick2), one2),
+				vminq_f64(vmulq_f64(HI_PD(fry), tick2), one2)
+			);
+
+			// v1 = v + (accel * tick - v * f)
+			float32x4_t vx1 = vaddq_f32(vx, vsubq_f32(
+				vmulq_f32(vld1q_f32(&batch.accel_x[i]), tick4), 
+				vmulq_f32(vx, fx)
+			));
+			vy1 = vaddq_f32(vy1, vsubq_f32(
+				vmulq_f32(vld1q_f32(&batch.accel_y[i]), tick4), 
+				vmulq_f32(vy1, fy)
+			));
+
+			// pos += (v + v1) * tick/2
+			float32x4_t px = vaddq_f32(vld1q_f32(&batch.pos_x[i]), vmulq_f32(vaddq_f32(vx, vx1), half_tick4));
+			float32x4_t py = vaddq_f32(vld1q_f32(&batch.pos_y[i]), vmulq_f32(vaddq_f32(vy, vy1), half_tick4));
+
+			vst1q_f32(&batch.vel_x[i], vx1);
+			vst1q_f32(&batch.vel_y[i], vy1);
+			vst1q_f32(&batch.pos_x[i], px);
+			vst1q_f32(&batch.pos_y[i], py);
+		}
+
+		#undef LO_PD
+		#undef HI_PD
+		#undef TO_PS
+
+	#else
+		for (uint32_t i = 0; i < len; i++) {
+			float vx = batch.vel_x[i];
+			float vy = batch.vel_y[i];
+			float vx1 = vx;
+			float vy1 = vy + engine.gravity * batch.gravity[i] * engine.tick;
+			float fx = min(batch.friction_x[i] * engine.tick, 1);
+			float fy = min(batch.friction_y[i] * engine.tick, 1);
+			vx1 = vx1 + (batch.accel_x[i] * tick - vx1 * fx);
+			vy1 = vy1 + (batch.accel_y[i] * tick - vy1 * fy);
+
+			batch.pos_x[i] += (vx + vx1) * half_tick;
+			batch.pos_y[i] += (vy + vy1) * half_tick;
+			batch.vel_x[i] = vx1;
+			batch.vel_y[i] = vy1;
+		}
+	#endif
+}
+
+static void entities_batch_update(void) {
+	// Gather all entities that can be batched
+	uint32_t len = 0;
+	for (uint32_t i = 0; i < entities_len; i++) {
+		entity_t *ent = entities[i];
+		if (
+			entity_vtab[ent->type].update != entity_base_update ||
+			!(ent->physics & ENTITY_PHYSICS_MOVE)
+		) {
+			continue;
+		}
+
+		batch_entities[len] = ent;
+		batch.pos_x[len] = ent->pos.x;
+		batch.pos_y[len] = ent->pos.y;
+		batch.vel_x[len] = ent->vel.x;
+		batch.vel_y[len] = ent->vel.y;
+		batch.accel_x[len] = ent->accel.x;
+		batch.accel_y[len] = ent->accel.y;
+		batch.friction_x[len] = ent->friction.x;
+		batch.friction_y[len] = ent->friction.y;
+		batch.gravity[len] = ent->gravity;
+		entities_is_updated[ent - entities_storage] = true;
+		len++;
+	}
+
+	if (len == 0) {
+		return;
+	}
+
+	// Clear the padding up to the next multiple of 4
+	for (uint32_t i = len; i < ((len + 3) & ~3); i++) {
+		batch.pos_x[i] = batch.pos_y[i] = 0;
+		batch.vel_x[i] = batch.vel_y[i] = 0;
+		batch.accel_x[i] = batch.accel_y[i] = 0;
+		batch.friction_x[i] = batch.friction_y[i] = 0;
+		batch.gravity[i] = 0;
+	}
+
+	entities_batch_integrate(len);
+
+	// Scatter the results back. Entities that collide with the world are not
+	// moved yet; their movement for this frame is collected for one batched
+	// trace instead. This computes the same vstep as entity_base_update().
+	uint32_t traces_len = 0;
+	vec2_t *trace_from = bump_alloc(sizeof(vec2_t) * len);
+	vec2_t *trace_vel = bump_alloc(sizeof(vec2_t) * len);
+	vec2_t *trace_size = bump_alloc(sizeof(vec2_t) * len);
+	entity_t **trace_entities = bump_alloc(sizeof(entity_t *) * len);
+	float half_tick = engine.tick * 0.5;
+
+	for (uint32_t i = 0; i < len; i++) {
+		entity_t *ent = batch_entities[i];
+		vec2_t vel = vec2(batch.vel_x[i], batch.vel_y[i]);
+		if (entity_collides_with_world(ent)) {
+			trace_entities[traces_len] = ent;
+			trace_from[traces_len] = ent->pos;
+			trace_vel[traces_len] = vec2_mulf(vec2_add(ent->vel, vel), half_tick);
+			trace_size[traces_len] = ent->size;
+			traces_len++;
+		}
+		else {
+			ent->pos = vec2(batch.pos_x[i], batch.pos_y[i]);
+		}
+		ent->vel = vel;
+		ent->on_ground = false;
+	}
+
+	if (traces_len == 0) {
+		return;
+	}
+
+	trace_t *traces = bump_alloc(sizeof(trace_t) * traces_len);
+	trace_batch(engine.collision_map, trace_from, trace_vel, trace_size, traces, traces_len);
+
+	// Handle the results in order; the second trace for sliding along a tile
+	// depends on the first one's result and is done one by one.
+	for (uint32_t i = 0; i < traces_len; i++) {
+		entity_move_traced(trace_entities[i], trace_vel[i], &traces[i]);
+	}
+}
+
+#endif
 
 static void entity_handle_trace_result(entity_t *self, trace_t *t) {
 	self->pos = t->pos;
@@ -412,7 +1816,12 @@ static void entity_handle_trace_result(entity_t *self, trace_t *t) {
 		return;
 	}
 
-	entity_collide(self, t->normal, t);
+	if (job_result) {
+		entities_defer_event(ENTITY_EVENT_COLLIDE, self, t);
+	}
+	else {
+		entity_collide(self, t->normal, t);
+	}
 
 	// If this entity is bouncy, calculate the velocity against the
 	// slope's normal (the dot product) and see if we want to bounce
@@ -38,7 +38,8 @@ struct _entity_assert_types_defined {
 #endif
 
 // The maximum size any of your entities is expected to have. This only affects
-// the accuracy of entities_by_proximity() and entities_by_location().
+// the accuracy of entities_by_proximity() and entities_by_location() when using
+// the ENTITY_BROADPHASE_SWEEP.
 // FIXME: this is bad; we should have to specify this.
 #if !defined(ENTITY_MAX_SIZE)
 	#define ENTITY_MAX_SIZE 64.0
@@ -57,6 +58,74 @@ struct _entity_assert_types_defined {
 	#define ENTITY_SWEEP_AXIS x
 #endif
 
+// The broad phase collision detection strategy.
+// ENTITY_BROADPHASE_SWEEP - sort all entities along the ENTITY_SWEEP_AXIS and
+//                           sweep & prune. Fast for mostly horizontal or
+//                           vertical games.
+// ENTITY_BROADPHASE_GRID  - sort all entities into a spatial hash of uniformly
+//                           sized cells. Better for top-down games, where many 
+//                           entities share the same x or y band.
+// The broadphase can also be changed at runtime with entities_set_broadphase()
+typedef enum {
+	ENTITY_BROADPHASE_SWEEP,
+	ENTITY_BROADPHASE_GRID,
+} entity_broadphase_t;
+
+#if !defined(ENTITY_BROADPHASE)
+	#define ENTITY_BROADPHASE ENTITY_BROADPHASE_SWEEP
+#endif
+
+// The size of one grid cell for the ENTITY_BROADPHASE_GRID, as a multiple of 
+// the collision map's tile_size. Entities that span more than 2x2 cells are
+// tested against all others individually, so this should be large enough to
+// hold most of your entities.
+#if !defined(ENTITY_GRID_CELL_TILES)
+	#define ENTITY_GRID_CELL_TILES 4
+#endif
+
+// The size of one grid cell in pixels, if there's no collision map
+#if !defined(ENTITY_GRID_CELL_SIZE)
+	#define ENTITY_GRID_CELL_SIZE 64.0
+#endif
+
+// The number of buckets for the grid's spatial hash. Must be a power of 2.
+#if !defined(ENTITY_GRID_BUCKETS)
+	#define ENTITY_GRID_BUCKETS 4096
+#endif
+
+// Whether to integrate the physics of simple entities in one vectorized batch.
+// This applies to all entities that use the default update() (i.e. 
+// entity_base_update()) and move (ENTITY_PHYSICS_MOVE). Their hot physics 
+// fields are copied into a structure of arrays and integrated 4 at a time with
+// SSE2 or NEON. Only pos, vel and on_ground are written back. Those that 
+// collide with the collision_map are then moved with one trace_batch(). This is
+// a lot faster for large numbers of projectiles or particles, but it changes 
+// the update order: all batched entities are moved (and their collide() is 
+// called) before the update() function of any other entity is called.
+#if !defined(ENTITY_BATCH_PHYSICS)
+	#define ENTITY_BATCH_PHYSICS 0
+#endif
+
+// The number of entities per job for the parallel update() and broadphase
+#if !defined(ENTITY_PARALLEL_BATCH)
+	#define ENTITY_PARALLEL_BATCH 64
+#endif
+
+// Whether to find the touching pairs of the broadphase on all threads of the
+// job system. The touch() and collide() callbacks are still dispatched in 
+// order on the main thread. Since all pairs are found before any collision is
+// resolved, the results differ slightly from the serial broadphase, but are 
+// independent of the number of threads.
+#if !defined(ENTITY_PARALLEL_BROADPHASE)
+	#define ENTITY_PARALLEL_BROADPHASE 0
+#endif
+
+// The minimum number of entities for the parallel broadphase. Below that, the
+// serial broadphase is used.
+#if !defined(ENTITY_PARALLEL_BROADPHASE_MIN)
+	#define ENTITY_PARALLEL_BROADPHASE_MIN 512
+#endif
+
 // The entity_vtab_t struct must implemented by all your entity types. It holds
 // the functions to call for each entity type. All of these are optional. In
 // the simplest case you just have a global:
@@ -80,6 +149,15 @@ typedef struct {
 	// moves the entity according to its physics
 	void (*update)(entity_t *self);
 
+	// If true, update() is called for all entities of this type on the 
+	// threads of the job system, before the update() of any other entity. 
+	// update() must then only modify the entity itself and must not call 
+	// entity_spawn() or any other function that isn't thread safe. Calls to 
+	// collide() from entity_base_update() and to kill() from entity_kill() 
+	// are deferred and dispatched in order after all parallel updates have
+	// completed.
+	bool parallel_update;
+
 	// Called once per frame for each entity. The default entity_draw_base()
 	// draws the entity->anim 
 	void (*draw)(entity_t *self, vec2_t viewport);
@@ -115,13 +193,17 @@ extern entity_vtab_t entity_vtab[ENTITY_TYPES_COUNT];
 #define entity_settings(ENTITY, DESC)         entity_vtab[ENTITY->type].settings(ENTITY, DESC)
 #define entity_update(ENTITY)                 entity_vtab[ENTITY->type].update(ENTITY)
 #define entity_draw(ENTITY, VIEWPORT)         entity_vtab[ENTITY->type].draw(ENTITY, VIEWPORT)
-#define entity_kill(ENTITY)                   (ENTITY->is_alive = false, entity_vtab[ENTITY->type].kill(ENTITY))
+#define entity_kill(ENTITY)                   (ENTITY->is_alive = false, entity_kill_callback(ENTITY))
 #define entity_touch(ENTITY, OTHER)           entity_vtab[ENTITY->type].touch(ENTITY, OTHER)
 #define entity_collide(ENTITY, NORMAL, TRACE) entity_vtab[ENTITY->type].collide(ENTITY, NORMAL, TRACE)
 #define entity_damage(ENTITY, OTHER, DAMAGE)  entity_vtab[ENTITY->type].damage(ENTITY, OTHER, DAMAGE)
 #define entity_trigger(ENTITY, OTHER)         entity_vtab[ENTITY->type].trigger(ENTITY, OTHER)
 #define entity_message(ENTITY, MESSAGE, DATA) entity_vtab[ENTITY->type].message(ENTITY, MESSAGE, DATA)
 
+// Calls kill() for the entity, or defers it when called from a parallel
+// update(). Use entity_kill() instead.
+void entity_kill_callback(entity_t *self);
+
 // Return a reference for to given entity
 entity_ref_t entity_ref(entity_t *self);
 
@@ -161,7 +243,12 @@ void entity_base_draw(entity_t *self, vec2_t viewport);
 // damage() in your vtab, you may still want to call this function.
 void entity_base_damage(entity_t *self, entity_t *other, float damage);
 
-// Get the name of an entity (usually the name is specified through "settings"
+// Set the name of an entity and add it to the name index. The name is not 
+// copied. Names that are assigned directly to ent->name are only picked up 
+// by the index after the next entities_update().
+void entity_set_name(entity_t *self, char *name);
+
+// Get an entity by its name (usually the name is specified through "settings"
 // in a level json). May be NULL.
 entity_t *entity_by_name(char *name);
 
@@ -183,6 +270,18 @@ entity_list_t entities_by_location(vec2_t pos, float radius, entity_type_t type,
 // list is only valid for the duration of the current frame.
 entity_list_t entities_by_type(entity_type_t type);
 
+// Iterate over all entities of a certain type, without allocating. Returns 
+// NULL at the end. E.g.:
+//   for (entity_t *e = entities_first_by_type(ENTITY_TYPE_ENEMY); e; e = entities_next_by_type(e)) {
+//       ...
+//   }
+// Entities that are spawned during the iteration are visited, too. Killed
+// entities are skipped, but the entity that is passed to 
+// entities_next_by_type() must not have been removed by entities_update() in
+// the meantime.
+entity_t *entities_first_by_type(entity_type_t type);
+entity_t *entities_next_by_type(entity_t *ent);
+
 // Get a list of entities by name, with json_t array or object of names.
 // If called while the game is running (as opposed to during scene init), the 
 // list is only valid for the duration of the current frame.
@@ -192,6 +291,53 @@ entity_list_t entities_from_json_names(json_t *targets);
 bool entity_is_touching(entity_t *self, entity_t *other);
 
 
+// Set the broad phase collision detection strategy
+void entities_set_broadphase(entity_broadphase_t broadphase);
+
+// Return the current broad phase collision detection strategy
+entity_broadphase_t entities_broadphase(void);
+
+
+// Return the number of bytes needed to save the state of all entities
+uint32_t entities_snapshot_size(void);
+
+// Save the state of all entities to `dest`, which must be at least 
+// entities_snapshot_size() bytes. Refs to saved entities are valid again
+// after entities_snapshot_restore().
+void entities_snapshot_save(void *dest);
+
+// Restore the state of all entities that was saved with 
+// entities_snapshot_save(). This is used for engine_restore_snapshot(), so it
+// also discards all world states saved with entity_world_save().
+void entities_snapshot_restore(void *src);
+
+
+// A saved state of the world for rollback; see entity_world_save()
+typedef struct entity_world_t entity_world_t;
+
+// Bump allocate a buffer for one world state. This must be called from within
+// your scene's init(), after the level was loaded, since the buffer is sized
+// for the current maps and ENTITIES_MAX entities.
+entity_world_t *entity_world_create(void);
+
+// Save the state of the world into the buffer: all entities, the tiles of the
+// collision and background maps, engine.time, engine.frame and the state of
+// the random number generator. The state is stored as a delta to the state of
+// the previous save, so saving a world that changed little is cheap. Memory
+// that entities point to (e.g. bump allocated in the current frame) is not
+// saved. This must not be called from a parallel update().
+void entity_world_save(entity_world_t *world);
+
+// Restore the state of the world that was saved into the buffer. Loading the
+// last saved state is the cheapest; older states are restored by undoing the
+// deltas of all newer ones. Newer states are discarded, their buffers can be
+// used for new saves. The buffer can not be loaded if it was reused for a
+// newer save in the meantime. World states do not survive
+// engine_restore_snapshot(); the buffers can be used for new saves if they
+// were created before engine_snapshot().
+void entity_world_load(entity_world_t *world);
+
+
 // These functions are called by the engine during scene init/update/cleanup
 void entities_init(void);
 void entities_cleanup(void);
@@ -199,4 +345,11 @@ void entities_reset(void);
 void entities_update(void);
 void entities_draw(vec2_t viewport);
 
+// These functions are called by the engine for engine.fixed_tick, to remember
+// the position of all entities before each step and to move them to their
+// interpolated position (and back) while drawing.
+void entities_store_positions(void);
+void entities_interpolate(float alpha);
+void entities_interpolate_end(void);
+
 #endif
\ No newline at end of file
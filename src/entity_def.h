@@ -7,9 +7,11 @@
 // NULL, if the referenced entity is no longer valid (i.e. dead). This prevents
 // errors with direct entity_t* which will always point to a valid entity 
 // storage, but may no longer be the entity that you wanted.
+// The id is the generation of the storage slot at index; it is incremented 
+// each time the slot is re-used.
 typedef struct {
-	uint16_t id;
-	uint16_t index;
+	uint32_t id;
+	uint32_t index;
 } entity_ref_t;
 
 // A list of entity refs. Usually bump allocated and thus only valid for the
@@ -104,7 +106,7 @@ typedef struct entity_t entity_t;
 	} entity_type_t; \
 	\
 	struct entity_t { \
-		uint16_t id; /* A unique id for this entity, assigned on spawn */ \
+		uint32_t id; /* A unique id for this entity, assigned on spawn */ \
 		bool is_alive; /* Determines if this entity is in use */ \
 		bool on_ground; /* True for engine.gravity > 0 and standing on something */ \
 		int32_t draw_order; /* Entities are sorted (ascending) by this before drawing */ \
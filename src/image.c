@@ -31,6 +31,7 @@ void images_reset(image_mark_t mark) {
 }
 
 image_t *image_with_pixels(vec2i_t size, rgba_t *pixels) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_IMAGE);
 	error_if(images_len >= IMAGE_MAX_SOURCES, "Max images (%d) reached", IMAGE_MAX_SOURCES);
 	error_if(engine_is_running(), "Cannot create image during gameplay");
 
@@ -45,6 +46,7 @@ image_t *image_with_pixels(vec2i_t size, rgba_t *pixels) {
 }
 
 image_t *image(char *path) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_IMAGE);
 	for (uint32_t i = 0; i < images_len; i++) {
 		if (str_equals(path, image_paths[i])) {
 			return &images[i];
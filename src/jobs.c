@@ -0,0 +1,290 @@
+#include <stdatomic.h>
+
+#include "jobs.h"
+#include "alloc.h"
+#include "utils.h"
+#include "profiler.h"
+
+#if JOBS_WORKERS_MAX > 0
+	#include <pthread.h>
+	#include <sched.h>
+	#if defined(_WIN32)
+		#include <windows.h>
+	#else
+		#include <unistd.h>
+	#endif
+#endif
+
+typedef struct {
+	job_func_t func;
+	void *data;
+	uint32_t start;
+	uint32_t end;
+	job_counter_t *counter;
+} job_t;
+
+// A Chase-Lev work stealing deque. Only the owning thread pushes and pops at
+// the bottom; all other threads steal from the top.
+typedef struct {
+	_Atomic int64_t top;
+	uint8_t pad[56];
+	_Atomic int64_t bottom;
+	job_t jobs[JOBS_QUEUE_SIZE];
+} job_queue_t;
+
+typedef struct {
+	job_queue_t queue;
+	arena_t *scratch;
+	uint32_t rand_state;
+	#if JOBS_WORKERS_MAX > 0
+		pthread_t handle;
+	#endif
+} __attribute__((aligned(64))) jobs_thread_t;
+
+static jobs_thread_t threads[JOBS_WORKERS_MAX + 1];
+static uint32_t threads_len = 1;
+static _Thread_local uint32_t thread_index = 0;
+
+#if JOBS_WORKERS_MAX > 0
+	static _Atomic uint32_t jobs_queued = 0;
+	static _Atomic uint32_t sleepers = 0;
+	static _Atomic bool is_running = false;
+	static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+	static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+
+#if JOBS_WORKERS_MAX > 0
+static bool queue_push(job_queue_t *q, job_t *job) {
+	int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+	if (b - t >= JOBS_QUEUE_SIZE) {
+		return false;
+	}
+	q->jobs[b & (JOBS_QUEUE_SIZE - 1)] = *job;
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+	return true;
+}
+
+static bool queue_pop(job_queue_t *q, job_t *job) {
+	int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+	if (t > b) {
+		// Empty
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+		return false;
+	}
+
+	*job = q->jobs[b & (JOBS_QUEUE_SIZE - 1)];
+	if (t == b) {
+		// Last job; race against stealing threads
+		bool won = atomic_compare_exchange_strong_explicit(
+			&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed
+		);
+		atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+		return won;
+	}
+	return true;
+}
+
+static bool queue_steal(job_queue_t *q, job_t *job) {
+	int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+	if (t >= b) {
+		return false;
+	}
+
+	*job = q->jobs[t & (JOBS_QUEUE_SIZE - 1)];
+	return atomic_compare_exchange_strong_explicit(
+		&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed
+	);
+}
+#endif
+
+static void jobs_execute(job_t *job) {
+	arena_t *scratch = threads[thread_index].scratch;
+	arena_t *prev_scratch = arena_set_current(scratch);
+	bump_mark_t scratch_mark = arena_mark(scratch);
+
+	profiler_begin("job");
+	job->func(job->data, job->start, job->end);
+	profiler_end();
+
+	arena_reset(scratch, scratch_mark);
+	arena_set_current(prev_scratch);
+	atomic_fetch_sub_explicit(&job->counter->pending, 1, memory_order_release);
+}
+
+static void jobs_push(job_t *job) {
+	atomic_fetch_add_explicit(&job->counter->pending, 1, memory_order_relaxed);
+
+	#if JOBS_WORKERS_MAX > 0
+		if (threads_len > 1 && queue_push(&threads[thread_index].queue, job)) {
+			atomic_fetch_add(&jobs_queued, 1);
+			return;
+		}
+	#endif
+
+	// No workers or our queue is full; execute it right here
+	jobs_execute(job);
+}
+
+static void jobs_wake(void) {
+	#if JOBS_WORKERS_MAX > 0
+		if (atomic_load(&sleepers) > 0) {
+			pthread_mutex_lock(&wake_mutex);
+			pthread_cond_broadcast(&wake_cond);
+			pthread_mutex_unlock(&wake_mutex);
+		}
+	#endif
+}
+
+static bool jobs_take(job_t *job) {
+	#if JOBS_WORKERS_MAX > 0
+		jobs_thread_t *thread = &threads[thread_index];
+		if (queue_pop(&thread->queue, job)) {
+			atomic_fetch_sub(&jobs_queued, 1);
+			return true;
+		}
+
+		// Try to steal from all other threads, starting at a random one
+		thread->rand_state ^= thread->rand_state << 13;
+		thread->rand_state ^= thread->rand_state >> 17;
+		thread->rand_state ^= thread->rand_state << 5;
+		uint32_t first = thread->rand_state % threads_len;
+		for (uint32_t i = 0; i < threads_len; i++) {
+			uint32_t victim = (first + i) % threads_len;
+			if (victim != thread_index && queue_steal(&threads[victim].queue, job)) {
+				atomic_fetch_sub(&jobs_queued, 1);
+				return true;
+			}
+		}
+	#endif
+	return false;
+}
+
+#if JOBS_WORKERS_MAX > 0
+static void *jobs_worker(void *arg) {
+	thread_index = (uint32_t)(uintptr_t)arg;
+	arena_bind(threads[thread_index].scratch);
+
+	while (atomic_load(&is_running)) {
+		job_t job;
+		if (jobs_take(&job)) {
+			jobs_execute(&job);
+			continue;
+		}
+
+		// Nothing to do; sleep until new jobs are queued
+		pthread_mutex_lock(&wake_mutex);
+		atomic_fetch_add(&sleepers, 1);
+		while (atomic_load(&jobs_queued) == 0 && atomic_load(&is_running)) {
+			pthread_cond_wait(&wake_cond, &wake_mutex);
+		}
+		atomic_fetch_sub(&sleepers, 1);
+		pthread_mutex_unlock(&wake_mutex);
+	}
+	return NULL;
+}
+
+static uint32_t jobs_cpu_count(void) {
+	#if defined(_WIN32)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwNumberOfProcessors;
+	#else
+		long count = sysconf(_SC_NPROCESSORS_ONLN);
+		return count > 0 ? count : 1;
+	#endif
+}
+#endif
+
+void jobs_init(void) {
+	threads_len = 1;
+	#if JOBS_WORKERS_MAX > 0
+		threads_len = clamp(jobs_cpu_count(), 1, JOBS_WORKERS_MAX + 1);
+	#endif
+
+	for (uint32_t i = 0; i < threads_len; i++) {
+		threads[i].scratch = arena_create(JOBS_SCRATCH_SIZE);
+		threads[i].rand_state = 0x9e3779b9 * (i + 1);
+	}
+
+	#if JOBS_WORKERS_MAX > 0
+		atomic_store(&is_running, true);
+		for (uint32_t i = 1; i < threads_len; i++) {
+			int err = pthread_create(&threads[i].handle, NULL, jobs_worker, (void *)(uintptr_t)i);
+			error_if(err != 0, "Failed to create job thread %d", i);
+		}
+	#endif
+}
+
+void jobs_cleanup(void) {
+	#if JOBS_WORKERS_MAX > 0
+		pthread_mutex_lock(&wake_mutex);
+		atomic_store(&is_running, false);
+		pthread_cond_broadcast(&wake_cond);
+		pthread_mutex_unlock(&wake_mutex);
+
+		for (uint32_t i = 1; i < threads_len; i++) {
+			pthread_join(threads[i].handle, NULL);
+		}
+	#endif
+	threads_len = 1;
+}
+
+void job_run(job_func_t func, void *data, job_counter_t *counter) {
+	error_if(!counter, "job_run() needs a counter");
+	job_t job = {.func = func, .data = data, .start = 0, .end = 1, .counter = counter};
+	jobs_push(&job);
+	jobs_wake();
+}
+
+void jobs_parallel_for(job_func_t func, void *data, uint32_t len, uint32_t batch_size, job_counter_t *counter) {
+	error_if(!counter, "jobs_parallel_for() needs a counter");
+	batch_size = max(batch_size, 1);
+
+	for (uint32_t start = 0; start < len; start += batch_size) {
+		job_t job = {
+			.func = func,
+			.data = data,
+			.start = start,
+			.end = min(start + batch_size, len),
+			.counter = counter
+		};
+		jobs_push(&job);
+	}
+	jobs_wake();
+}
+
+bool jobs_is_done(job_counter_t *counter) {
+	return atomic_load_explicit(&counter->pending, memory_order_acquire) == 0;
+}
+
+void jobs_wait(job_counter_t *counter) {
+	while (!jobs_is_done(counter)) {
+		job_t job;
+		if (jobs_take(&job)) {
+			jobs_execute(&job);
+		}
+		else {
+			// The remaining jobs are being executed by other threads
+			#if JOBS_WORKERS_MAX > 0
+				sched_yield();
+			#endif
+		}
+	}
+}
+
+uint32_t jobs_threads(void) {
+	return threads_len;
+}
+
+uint32_t jobs_thread_index(void) {
+	return thread_index;
+}
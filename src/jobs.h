@@ -0,0 +1,90 @@
+#ifndef HI_JOBS_H
+#define HI_JOBS_H
+
+// A job system with a fixed number of worker threads. Each thread (including
+// the main thread) owns a queue of jobs. Threads that run out of jobs steal
+// from the queues of other threads.
+
+// Jobs are grouped through a job_counter_t. The counter is incremented when a
+// job is queued and decremented when it completes. jobs_wait() blocks until
+// the counter reaches zero - the waiting thread helps to execute queued jobs
+// in the meantime.
+
+// Jobs may queue other jobs. Jobs must not call any of the engine functions
+// that are not explicitly marked as thread safe. In particular, bump_alloc()
+// and temp_alloc() are NOT thread safe. Each thread has a scratch arena that
+// is set as the current arena while a job executes. Use scratch_alloc() to
+// allocate from it. Memory allocated this way is only valid until the job 
+// returns.
+
+// With worker threads, this needs pthreads: link with -lpthread (on Windows
+// with MinGW's winpthreads). Define JOBS_WORKERS_MAX as 0 to build without.
+
+#include "types.h"
+
+// The maximum number of worker threads, in addition to the main thread. The
+// actual number is determined by the number of CPU cores. With 0 worker
+// threads, all jobs are executed immediately on the calling thread. This is
+// the default for Emscripten and for compilers that don't have pthread.h.
+#if !defined(JOBS_WORKERS_MAX)
+	#if defined(__EMSCRIPTEN__)
+		#define JOBS_WORKERS_MAX 0
+	#elif defined(__has_include)
+		#if __has_include(<pthread.h>)
+			#define JOBS_WORKERS_MAX 15
+		#else
+			#define JOBS_WORKERS_MAX 0
+		#endif
+	#else
+		#define JOBS_WORKERS_MAX 15
+	#endif
+#endif
+
+// The maximum number of queued jobs per thread. If a thread's queue is full,
+// the job is executed immediately on the calling thread. Must be a power of 2.
+#if !defined(JOBS_QUEUE_SIZE)
+	#define JOBS_QUEUE_SIZE 1024
+#endif
+
+// The size of the scratch memory of each thread, in bytes
+#if !defined(JOBS_SCRATCH_SIZE)
+	#define JOBS_SCRATCH_SIZE (256 * 1024)
+#endif
+
+
+// A job function. For jobs queued through job_run() start is 0 and end is 1.
+// For jobs queued through jobs_parallel_for() it's the range of elements
+// that this job should process.
+typedef void (*job_func_t)(void *data, uint32_t start, uint32_t end);
+
+// Counts the number of unfinished jobs. Must be zero initialized.
+typedef struct {
+	_Atomic uint32_t pending;
+} job_counter_t;
+
+// Queue the func to be executed on any thread
+void job_run(job_func_t func, void *data, job_counter_t *counter);
+
+// Split the range 0..len into batches of batch_size and queue a job for each
+// batch
+void jobs_parallel_for(job_func_t func, void *data, uint32_t len, uint32_t batch_size, job_counter_t *counter);
+
+// Whether all jobs of the counter have completed
+bool jobs_is_done(job_counter_t *counter);
+
+// Execute queued jobs until all jobs of the counter have completed
+void jobs_wait(job_counter_t *counter);
+
+// The number of threads that execute jobs, including the main thread
+uint32_t jobs_threads(void);
+
+// The index of the calling thread, 0 for the main thread and 1..n for the
+// worker threads. Useful to index per-thread data.
+uint32_t jobs_thread_index(void);
+
+
+// These functions are called by the engine during init/cleanup
+void jobs_init(void);
+void jobs_cleanup(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include "utils.h"
 #include "render.h"
 #include "engine.h"
+#include "profiler.h"
 
 struct map_anim_def_t {
 	float inv_frame_time;
@@ -12,6 +13,7 @@ struct map_anim_def_t {
 };
 
 map_t *map_with_data(uint16_t tile_size, vec2i_t size, uint16_t *data) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_MAP);
 	error_if(engine_is_running(), "Cannot create map during gameplay");
 
 	map_t *map = bump_alloc(sizeof(map_t));
@@ -19,10 +21,18 @@ map_t *map_with_data(uint16_t tile_size, vec2i_t size, uint16_t *data) {
 	map->tile_size = tile_size;
 	map->distance = 1;
 	map->data = data ? data : bump_alloc(size.x * size.y * sizeof(uint16_t));
+
+	// An allocated data array is still empty and filled by the caller, so
+	// the bitmaps are only built once map_update_solid() is called. Until
+	// then, trace() checks each tile.
+	if (data) {
+		map_update_solid(map);
+	}
 	return map;
 }
 
 map_t *map_from_json(json_t *def) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_MAP);
 	error_if(engine_is_running(), "Cannot create map during gameplay");
 
 	map_t *map = bump_alloc(sizeof(map_t));
@@ -62,10 +72,12 @@ map_t *map_from_json(json_t *def) {
 		}
 	}	
 
+	map_update_solid(map);
 	return map;
 }
 
 void map_set_anim_with_len(map_t *map, uint16_t tile, float frame_time, uint16_t *sequence, uint16_t sequence_len) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_MAP);
 	error_if(engine_is_running(), "Cannot set map animation during gameplay");
 	error_if(sequence_len == 0, "Map animation has empty sequence");
 
@@ -101,6 +113,55 @@ int map_tile_at_px(map_t *map, vec2_t px_pos) {
 	return map_tile_at(map, tile_pos);
 }
 
+static inline void map_set_solid_bit(map_t *map, int x, int y, bool solid) {
+	uint64_t *row = &map->solid_rows[y * map->solid_row_words + x / 64];
+	uint64_t *col = &map->solid_cols[x * map->solid_col_words + y / 64];
+	uint64_t row_bit = 1ull << (x % 64);
+	uint64_t col_bit = 1ull << (y % 64);
+	*row = solid ? (*row | row_bit) : (*row & ~row_bit);
+	*col = solid ? (*col | col_bit) : (*col & ~col_bit);
+}
+
+void map_set_tile(map_t *map, vec2i_t tile_pos, uint16_t tile) {
+	if (
+		tile_pos.x < 0 || tile_pos.x >= map->size.x ||
+		tile_pos.y < 0 || tile_pos.y >= map->size.y
+	) {
+		return;
+	}
+	map->data[tile_pos.y * map->size.x + tile_pos.x] = tile;
+	map->version++;
+	if (map->solid_rows) {
+		map_set_solid_bit(map, tile_pos.x, tile_pos.y, tile != 0);
+	}
+}
+
+void map_update_solid(map_t *map) {
+	profiler_zone("map_update_solid");
+	map->version++;
+	if (!map->solid_rows) {
+		alloc_subsystem(ALLOC_SUBSYSTEM_MAP);
+		error_if(engine_is_running(), "Cannot create map bitmaps during gameplay");
+		map->solid_row_words = (map->size.x + 63) / 64;
+		map->solid_col_words = (map->size.y + 63) / 64;
+		map->solid_rows = bump_alloc(sizeof(uint64_t) * map->solid_row_words * map->size.y);
+		map->solid_cols = bump_alloc(sizeof(uint64_t) * map->solid_col_words * map->size.x);
+	}
+	else {
+		memset(map->solid_rows, 0, sizeof(uint64_t) * map->solid_row_words * map->size.y);
+		memset(map->solid_cols, 0, sizeof(uint64_t) * map->solid_col_words * map->size.x);
+	}
+
+	for (int y = 0; y < map->size.y; y++) {
+		uint16_t *row = &map->data[y * map->size.x];
+		for (int x = 0; x < map->size.x; x++) {
+			if (row[x]) {
+				map_set_solid_bit(map, x, y, true);
+			}
+		}
+	}
+}
+
 
 static inline void map_draw_tile(map_t *map, uint16_t tile, vec2_t pos) {
 	if (map->anims && map->anims[tile]) {
@@ -113,6 +174,7 @@ static inline void map_draw_tile(map_t *map, uint16_t tile, vec2_t pos) {
 }
 
 void map_draw(map_t *map, vec2_t offset) {
+	profiler_zone("map_draw");
 	error_if(!map->tileset, "Cannot draw map without tileset");
 
 	offset = vec2_divf(offset, map->distance);
@@ -45,11 +45,29 @@ typedef struct {
 
 	// The highest tile index in that map; used internally.
 	uint16_t max_tile;
+
+	// One bit for each non-empty tile, stored row by row (solid_rows) and 
+	// column by column (solid_cols), so that trace() can skip over empty runs
+	// of tiles a word at a time. Each row is padded to solid_row_words and each
+	// column to solid_col_words. These are NULL until map_update_solid() is 
+	// called; trace() then checks every tile it sweeps over.
+	uint64_t *solid_rows;
+	uint64_t *solid_cols;
+	uint32_t solid_row_words;
+	uint32_t solid_col_words;
+
+	// Incremented each time tiles are changed through map_set_tile() or
+	// map_update_solid(), so that data derived from the map (e.g. the nav
+	// grid) knows when to rebuild.
+	uint32_t version;
 } map_t;
 
 // Create a map with the given data. If data is not NULL, it must be least 
 // size.x * size.y elements long. The data is _not_ copied. If data is NULL,
-// an array of sufficient length will be allocated.
+// an array of sufficient length will be allocated. The solid bitmaps for such
+// a map are not built until you call map_update_solid() after filling the
+// array (engine_set_collision_map() does this for you). Until then trace() 
+// still works, but can't skip empty tiles.
 map_t *map_with_data(uint16_t tile_size, vec2i_t size, uint16_t *data);
 
 // Load a map from a json_t. The json_t must have the following layout.
@@ -85,6 +103,69 @@ int map_tile_at(map_t *map, vec2i_t tile_pos);
 // Return the tile index at the pixel position. Will return 0 when out of bounds
 int map_tile_at_px(map_t *map, vec2_t px_pos);
 
+// Set the tile index at the tile position and update the solid bitmaps. Does
+// nothing when out of bounds. Use this to change the tiles of a collision map
+// during gameplay.
+void map_set_tile(map_t *map, vec2i_t tile_pos, uint16_t tile);
+
+// Rebuild the solid bitmaps from the map's data. This must be called after 
+// changing map->data directly; trace() would otherwise miss the new tiles. The
+// first call allocates the bitmaps and must happen in your scene_init().
+void map_update_solid(map_t *map);
+
+// Whether any bit from first to last (inclusive) is set in the bitmap
+static inline bool map_bits_any(uint64_t *bits, uint32_t first, uint32_t last) {
+	uint32_t first_word = first / 64;
+	uint32_t last_word = last / 64;
+	uint64_t first_mask = ~0ull << (first % 64);
+	uint64_t last_mask = ~0ull >> (63 - last % 64);
+	if (first_word == last_word) {
+		return bits[first_word] & first_mask & last_mask;
+	}
+	if (bits[first_word] & first_mask) {
+		return true;
+	}
+	for (uint32_t w = first_word + 1; w < last_word; w++) {
+		if (bits[w]) {
+			return true;
+		}
+	}
+	return bits[last_word] & last_mask;
+}
+
+// Whether any tile in row y from x0 to x1 (inclusive) is not 0. Tiles out of 
+// bounds are 0. The solid bitmaps must be built.
+static inline bool map_solid_in_row(map_t *map, int y, int x0, int x1) {
+	if (y < 0 || y >= map->size.y) {
+		return false;
+	}
+	x0 = x0 < 0 ? 0 : x0;
+	x1 = x1 >= map->size.x ? map->size.x - 1 : x1;
+	return x0 <= x1 && map_bits_any(map->solid_rows + y * map->solid_row_words, x0, x1);
+}
+
+// Whether any tile in column x from y0 to y1 (inclusive) is not 0
+static inline bool map_solid_in_column(map_t *map, int x, int y0, int y1) {
+	if (x < 0 || x >= map->size.x) {
+		return false;
+	}
+	y0 = y0 < 0 ? 0 : y0;
+	y1 = y1 >= map->size.y ? map->size.y - 1 : y1;
+	return y0 <= y1 && map_bits_any(map->solid_cols + x * map->solid_col_words, y0, y1);
+}
+
+// Whether any tile in the rectangle from x0,y0 to x1,y1 (inclusive) is not 0
+static inline bool map_solid_in_rect(map_t *map, int x0, int y0, int x1, int y1) {
+	y0 = y0 < 0 ? 0 : y0;
+	y1 = y1 >= map->size.y ? map->size.y - 1 : y1;
+	for (int y = y0; y <= y1; y++) {
+		if (map_solid_in_row(map, y, x0, x1)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 // Draw the map at the given offset. This will take the distance into account.
 void map_draw(map_t *map, vec2_t offset);
 
@@ -0,0 +1,905 @@
+#include "nav.h"
+#include "engine.h"
+#include "platform.h"
+#include "alloc.h"
+#include "utils.h"
+#include "profiler.h"
+#include "trace.h"
+
+#define NAV_NONE 0xffffffff
+#define NAV_UNREACHED 0xffffffff
+
+// The number of nodes that a path search expands and the number of tiles that
+// a flow field visits before the time budget is checked again
+#define NAV_SEARCH_CHUNK 16
+#define NAV_FLOW_CHUNK 1024
+
+typedef struct {
+	uint32_t id;
+	nav_status_t status;
+
+	// The start and target tile (y * width + x); NAV_NONE if out of bounds
+	uint32_t from;
+	uint32_t to;
+
+	// The grid version that the status and points are for
+	uint32_t version;
+	uint32_t last_used;
+	bool is_queued;
+
+	float length;
+	uint32_t points_len;
+	vec2_t points[NAV_PATH_POINTS_MAX];
+} nav_slot_t;
+
+// The search state of a tile. The g, parent and heap_pos are only valid if the
+// mark is the open or closed mark of the current search.
+typedef struct {
+	float g;
+	uint32_t parent;
+	uint32_t mark;
+	uint32_t heap_pos;
+} nav_node_t;
+
+typedef struct {
+	float f;
+	float g;
+	uint32_t tile;
+} nav_heap_entry_t;
+
+typedef struct {
+	// The steps to the nearest target for each tile; only valid once is_ready
+	uint32_t *steps;
+	bool is_ready;
+
+	// Whether the targets or the grid changed since the last computation
+	// started
+	bool is_dirty;
+
+	uint32_t targets[NAV_FLOW_TARGETS_MAX];
+	uint32_t targets_len;
+} nav_flow_t;
+
+
+// The map that the grid was built from and its version at that time. nav_map
+// is NULL if nav_init() was not called in this scene.
+static map_t *nav_map = NULL;
+static uint32_t nav_map_version;
+static int nav_width;
+static int nav_height;
+
+// Incremented each time the grid is rebuilt
+static uint32_t nav_version = 0;
+
+// One bit for each tile that is not walkable, stored row by row (nav_rows)
+// and column by column (nav_cols). Each line has 64 blocked bits in front and
+// at least 64 behind the tiles and there's one blocked line before the first
+// and after the last, so the neighbours of all tiles can be read without
+// bounds checks.
+static uint64_t *nav_rows;
+static uint64_t *nav_cols;
+static uint32_t nav_row_words;
+static uint32_t nav_col_words;
+
+// Path requests and the queue of slots to search
+static nav_slot_t nav_slots[NAV_PATHS_MAX];
+static uint64_t nav_slot_keys[NAV_PATHS_MAX];
+static uint32_t nav_slots_len = 0;
+static uint32_t nav_use_counter = 0;
+static uint32_t nav_queue[NAV_PATHS_MAX];
+static uint32_t nav_queue_first = 0;
+static uint32_t nav_queue_len = 0;
+
+// The state of the current jump point search
+static struct {
+	uint32_t slot;
+	uint32_t from;
+	uint32_t to;
+	int to_x;
+	int to_y;
+	uint32_t mark_open;
+	uint32_t mark_closed;
+	uint32_t heap_len;
+} nav_search = {.slot = NAV_NONE};
+
+static nav_node_t *nav_nodes;
+static nav_heap_entry_t *nav_heap;
+
+// Flow fields and the state of the current flow field computation. The steps
+// are computed into nav_flow_spare, which is swapped with the field's steps
+// when done.
+static nav_flow_t nav_flows[NAV_FLOW_FIELDS_MAX];
+static uint32_t *nav_flow_spare;
+static uint32_t *nav_flow_queue;
+static uint32_t nav_flow_queue_first;
+static uint32_t nav_flow_queue_len;
+static uint32_t nav_flow_current = NAV_NONE;
+static uint32_t nav_flow_last = 0;
+
+// Added to the engine by nav_init()
+static engine_hooks_t nav_hooks = {
+	.update = nav_update,
+	.snapshot_restore = nav_snapshot_restore,
+	.reset = nav_reset,
+};
+
+static void nav_build(void);
+static void nav_path_start(uint32_t index);
+
+
+static inline int nav_sign(int v) {
+	return (v > 0) - (v < 0);
+}
+
+static inline bool nav_blocked(int x, int y) {
+	uint32_t bit = x + 64;
+	return (nav_rows[(y + 1) * nav_row_words + (bit >> 6)] >> (bit & 63)) & 1;
+}
+
+static inline vec2i_t nav_tile_pos(vec2_t px_pos) {
+	return vec2i(floorf(px_pos.x / nav_map->tile_size), floorf(px_pos.y / nav_map->tile_size));
+}
+
+static inline uint32_t nav_tile_index(vec2i_t tile_pos) {
+	if (
+		tile_pos.x < 0 || tile_pos.x >= nav_width ||
+		tile_pos.y < 0 || tile_pos.y >= nav_height
+	) {
+		return NAV_NONE;
+	}
+	return tile_pos.y * nav_width + tile_pos.x;
+}
+
+static inline vec2_t nav_tile_center(int x, int y) {
+	return vec2((x + 0.5f) * nav_map->tile_size, (y + 0.5f) * nav_map->tile_size);
+}
+
+// The length of a path with dx, dy tiles, when moving diagonally as far as
+// possible
+static inline float nav_octile(int dx, int dy) {
+	dx = abs(dx);
+	dy = abs(dy);
+	return dx > dy
+		? dx + 0.41421356f * dy
+		: dy + 0.41421356f * dx;
+}
+
+
+
+void nav_init(void) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_MAP);
+	error_if(engine_is_running(), "Cannot init nav during gameplay");
+	error_if(!engine.collision_map, "Cannot init nav without a collision map");
+	error_if(
+		engine.collision_map->size.x > 0xffff || engine.collision_map->size.y > 0xffff,
+		"Collision map too large for nav"
+	);
+
+	nav_reset();
+	nav_map = engine.collision_map;
+	nav_width = nav_map->size.x;
+	nav_height = nav_map->size.y;
+
+	nav_row_words = (nav_width + 63) / 64 + 3;
+	nav_col_words = (nav_height + 63) / 64 + 3;
+	nav_rows = bump_alloc(sizeof(uint64_t) * nav_row_words * (nav_height + 2));
+	nav_cols = bump_alloc(sizeof(uint64_t) * nav_col_words * (nav_width + 2));
+
+	uint32_t tiles_len = nav_width * nav_height;
+	nav_nodes = bump_alloc(sizeof(nav_node_t) * tiles_len);
+	nav_heap = bump_alloc(sizeof(nav_heap_entry_t) * tiles_len);
+
+	nav_flow_spare = bump_alloc(sizeof(uint32_t) * tiles_len);
+	nav_flow_queue = bump_alloc(sizeof(uint32_t) * tiles_len);
+	for (int i = 0; i < NAV_FLOW_FIELDS_MAX; i++) {
+		nav_flows[i].steps = bump_alloc(sizeof(uint32_t) * tiles_len);
+	}
+
+	nav_search.mark_open = 0;
+	nav_search.mark_closed = 1;
+	nav_build();
+	engine_add_hooks(&nav_hooks);
+}
+
+void nav_reset(void) {
+	// The slot ids are kept, so that refs from before the reset stay invalid
+	// when the slot is re-used.
+	nav_map = NULL;
+	nav_slots_len = 0;
+	nav_queue_len = 0;
+	nav_search.slot = NAV_NONE;
+	nav_flow_current = NAV_NONE;
+	for (int i = 0; i < NAV_FLOW_FIELDS_MAX; i++) {
+		nav_flows[i] = (nav_flow_t){0};
+	}
+}
+
+void nav_snapshot_restore(void) {
+	if (!nav_map) {
+		return;
+	}
+
+	// If nav_init() was called after the snapshot was taken, the grid is now
+	// above the bump mark and will be overwritten; discard it.
+	uint8_t *bump_end = bump_mark_ptr(bump_mark());
+	if ((uint8_t *)nav_rows >= bump_end || (uint8_t *)nav_nodes >= bump_end) {
+		nav_reset();
+		return;
+	}
+
+	// The grid, the search nodes and the steps of all flow fields were reset
+	// to the state of the snapshot, which doesn't match the static state 
+	// anymore. Rebuild the grid and compute the fields again with their 
+	// current targets.
+	for (int i = 0; i < NAV_FLOW_FIELDS_MAX; i++) {
+		if (nav_flows[i].is_ready) {
+			nav_flows[i].is_ready = false;
+			nav_flows[i].is_dirty = true;
+		}
+	}
+	nav_build();
+}
+
+static void nav_build(void) {
+	profiler_zone("nav_build");
+	nav_map_version = nav_map->version;
+	nav_version++;
+
+	// Whether each of the tiles with a defined shape is walkable; all tiles
+	// above are empty
+	bool tile_walkable[64];
+	for (int i = 0; i < len(tile_walkable); i++) {
+		tile_walkable[i] = trace_tile_solid_area(i) <= NAV_SLOPE_SOLID_MAX;
+	}
+
+	memset(nav_rows, 0xff, sizeof(uint64_t) * nav_row_words * (nav_height + 2));
+	memset(nav_cols, 0xff, sizeof(uint64_t) * nav_col_words * (nav_width + 2));
+	for (int y = 0; y < nav_height; y++) {
+		uint16_t *data = &nav_map->data[y * nav_width];
+		uint64_t *row = &nav_rows[(y + 1) * nav_row_words];
+		for (int x = 0; x < nav_width; x++) {
+			if (data[x] >= len(tile_walkable) || tile_walkable[data[x]]) {
+				row[(x + 64) / 64] &= ~(1ull << ((x + 64) % 64));
+				nav_cols[(x + 1) * nav_col_words + (y + 64) / 64] &= ~(1ull << ((y + 64) % 64));
+			}
+		}
+	}
+
+	// Searches that were running or waiting are started again. Found paths
+	// are searched again when they are asked for.
+	nav_search.slot = NAV_NONE;
+	nav_queue_len = 0;
+	for (uint32_t i = 0; i < nav_slots_len; i++) {
+		nav_slots[i].is_queued = false;
+		if (nav_slots[i].status == NAV_PATH_PENDING) {
+			nav_path_start(i);
+		}
+	}
+
+	// Flow fields are computed again with the same targets
+	for (int i = 0; i < NAV_FLOW_FIELDS_MAX; i++) {
+		if (nav_flows[i].is_ready || nav_flow_current == i) {
+			nav_flows[i].is_dirty = true;
+		}
+	}
+	nav_flow_current = NAV_NONE;
+}
+
+static void nav_sync(void) {
+	map_t *map = engine.collision_map;
+	if (map == nav_map && map->version == nav_map_version) {
+		return;
+	}
+	error_if(
+		!map || map->size.x != nav_width || map->size.y != nav_height,
+		"Collision map changed its size; nav_init() must be called again"
+	);
+	nav_map = map;
+	nav_build();
+}
+
+bool nav_is_walkable(vec2i_t tile_pos) {
+	error_if(!nav_map, "nav_init() was not called in this scene");
+	nav_sync();
+	return nav_tile_index(tile_pos) != NAV_NONE && !nav_blocked(tile_pos.x, tile_pos.y);
+}
+
+
+
+// Jump point search, as described by Harabor & Grastien, for a grid without
+// corner cutting. The straight jumps use the blocked bitmaps to check 64 tiles
+// at a time.
+
+// Return 64 bits of the line, starting with the tile at pos
+static inline uint64_t nav_bits_at(uint64_t *line, int pos) {
+	uint32_t bit = pos + 64;
+	uint32_t offset = bit & 63;
+	uint64_t bits = line[bit >> 6] >> offset;
+	return offset ? bits | (line[(bit >> 6) + 1] << (64 - offset)) : bits;
+}
+
+// Scan the line (a row or a column) from pos in the direction d for the first
+// blocked tile or jump point. The neighbouring lines are side_a and side_b. A
+// tile is a jump point if it's the goal (-1 if the goal is not on this line)
+// or if it's walkable on either side while the tile before it is not. Returns
+// the position of the jump point or -1 if a blocked tile comes first.
+static int nav_scan(uint64_t *line, uint64_t *side_a, uint64_t *side_b, int pos, int d, int goal) {
+	if (d > 0) {
+		for (int s = pos + 1;; s += 64) {
+			uint64_t blocked = nav_bits_at(line, s);
+			uint64_t stop = blocked
+				| (~nav_bits_at(side_a, s) & nav_bits_at(side_a, s - 1))
+				| (~nav_bits_at(side_b, s) & nav_bits_at(side_b, s - 1));
+			if (goal >= s && goal - s < 64) {
+				stop |= 1ull << (goal - s);
+			}
+			if (stop) {
+				int i = __builtin_ctzll(stop);
+				return (blocked >> i) & 1 ? -1 : s + i;
+			}
+		}
+	}
+	else {
+		for (int s = pos - 64;; s -= 64) {
+			uint64_t blocked = nav_bits_at(line, s);
+			uint64_t stop = blocked
+				| (~nav_bits_at(side_a, s) & nav_bits_at(side_a, s + 1))
+				| (~nav_bits_at(side_b, s) & nav_bits_at(side_b, s + 1));
+			if (goal >= s && goal - s < 64) {
+				stop |= 1ull << (goal - s);
+			}
+			if (stop) {
+				int i = 63 - __builtin_clzll(stop);
+				return (blocked >> i) & 1 ? -1 : s + i;
+			}
+		}
+	}
+}
+
+static inline int nav_scan_x(int x, int y, int dx) {
+	uint64_t *line = &nav_rows[(y + 1) * nav_row_words];
+	int goal = y == nav_search.to_y ? nav_search.to_x : -1;
+	return nav_scan(line, line - nav_row_words, line + nav_row_words, x, dx, goal);
+}
+
+static inline int nav_scan_y(int x, int y, int dy) {
+	uint64_t *line = &nav_cols[(x + 1) * nav_col_words];
+	int goal = x == nav_search.to_x ? nav_search.to_y : -1;
+	return nav_scan(line, line - nav_col_words, line + nav_col_words, y, dy, goal);
+}
+
+// Find the next jump point from x, y in the direction. Returns false if there
+// is none.
+static bool nav_jump(int x, int y, int dx, int dy, vec2i_t *jump) {
+	if (dy == 0) {
+		*jump = vec2i(nav_scan_x(x, y, dx), y);
+		return jump->x >= 0;
+	}
+	if (dx == 0) {
+		*jump = vec2i(x, nav_scan_y(x, y, dy));
+		return jump->y >= 0;
+	}
+
+	// Diagonal moves need both orthogonal neighbours to be walkable. A tile is
+	// a jump point if a straight jump from it finds one.
+	while (true) {
+		if (nav_blocked(x + dx, y + dy) || nav_blocked(x + dx, y) || nav_blocked(x, y + dy)) {
+			return false;
+		}
+		x += dx;
+		y += dy;
+		if (
+			(x == nav_search.to_x && y == nav_search.to_y) ||
+			nav_scan_x(x, y, dx) >= 0 || nav_scan_y(x, y, dy) >= 0
+		) {
+			*jump = vec2i(x, y);
+			return true;
+		}
+	}
+}
+
+// Tiles with the lowest estimated path length (f) come first; ties are broken
+// towards the tile that is furthest from the start, i.e. closest to the goal.
+static inline bool nav_heap_less(nav_heap_entry_t a, nav_heap_entry_t b) {
+	return a.f < b.f || (a.f == b.f && a.g > b.g);
+}
+
+static inline void nav_heap_set(uint32_t pos, nav_heap_entry_t e) {
+	nav_heap[pos] = e;
+	nav_nodes[e.tile].heap_pos = pos;
+}
+
+static void nav_heap_up(uint32_t pos, nav_heap_entry_t e) {
+	while (pos > 0) {
+		uint32_t parent = (pos - 1) / 2;
+		if (!nav_heap_less(e, nav_heap[parent])) {
+			break;
+		}
+		nav_heap_set(pos, nav_heap[parent]);
+		pos = parent;
+	}
+	nav_heap_set(pos, e);
+}
+
+static uint32_t nav_heap_pop(void) {
+	uint32_t tile = nav_heap[0].tile;
+	nav_heap_entry_t e = nav_heap[--nav_search.heap_len];
+	uint32_t len = nav_search.heap_len;
+	uint32_t pos = 0;
+	while (true) {
+		uint32_t child = pos * 2 + 1;
+		if (child >= len) {
+			break;
+		}
+		if (child + 1 < len && nav_heap_less(nav_heap[child + 1], nav_heap[child])) {
+			child++;
+		}
+		if (!nav_heap_less(nav_heap[child], e)) {
+			break;
+		}
+		nav_heap_set(pos, nav_heap[child]);
+		pos = child;
+	}
+	if (len > 0) {
+		nav_heap_set(pos, e);
+	}
+	return tile;
+}
+
+static void nav_search_add(int x, int y, uint32_t parent, float g) {
+	uint32_t tile = y * nav_width + x;
+	nav_heap_entry_t e = {
+		.f = g + nav_octile(nav_search.to_x - x, nav_search.to_y - y),
+		.g = g,
+		.tile = tile
+	};
+
+	nav_node_t *node = &nav_nodes[tile];
+	if (node->mark == nav_search.mark_open) {
+		if (g >= node->g) {
+			return;
+		}
+		node->g = g;
+		node->parent = parent;
+		nav_heap_up(node->heap_pos, e);
+	}
+	else if (node->mark != nav_search.mark_closed) {
+		node->mark = nav_search.mark_open;
+		node->g = g;
+		node->parent = parent;
+		nav_heap_up(nav_search.heap_len++, e);
+	}
+}
+
+static void nav_search_expand(uint32_t tile) {
+	int x = tile % nav_width;
+	int y = tile / nav_width;
+
+	// Only the natural and possibly forced neighbours in the direction from
+	// the parent are searched; all 8 for the start tile. nav_jump() rejects
+	// the blocked ones.
+	int dirs[8][2];
+	int dirs_len = 0;
+	uint32_t parent = nav_nodes[tile].parent;
+	if (parent == NAV_NONE) {
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				if (dx || dy) {
+					dirs[dirs_len][0] = dx;
+					dirs[dirs_len][1] = dy;
+					dirs_len++;
+				}
+			}
+		}
+	}
+	else {
+		int dx = nav_sign(x - (int)(parent % nav_width));
+		int dy = nav_sign(y - (int)(parent / nav_width));
+		#define NAV_DIR(DX, DY) dirs[dirs_len][0] = DX; dirs[dirs_len][1] = DY; dirs_len++;
+		if (dx && dy) {
+			NAV_DIR(dx, dy); NAV_DIR(dx, 0); NAV_DIR(0, dy);
+		}
+		else if (dx) {
+			NAV_DIR(dx, 0); NAV_DIR(0, -1); NAV_DIR(0, 1); NAV_DIR(dx, -1); NAV_DIR(dx, 1);
+		}
+		else {
+			NAV_DIR(0, dy); NAV_DIR(-1, 0); NAV_DIR(1, 0); NAV_DIR(-1, dy); NAV_DIR(1, dy);
+		}
+		#undef NAV_DIR
+	}
+
+	float g = nav_nodes[tile].g;
+	for (int i = 0; i < dirs_len; i++) {
+		vec2i_t jump;
+		if (nav_jump(x, y, dirs[i][0], dirs[i][1], &jump)) {
+			nav_search_add(jump.x, jump.y, tile, g + nav_octile(jump.x - x, jump.y - y));
+		}
+	}
+}
+
+static void nav_search_finish(bool found) {
+	nav_slot_t *slot = &nav_slots[nav_search.slot];
+	nav_search.slot = NAV_NONE;
+	if (!found) {
+		slot->status = NAV_PATH_NOT_FOUND;
+		return;
+	}
+
+	// Walk back from the target to count the points where the direction
+	// changes, then walk back again to store the first NAV_PATH_POINTS_MAX
+	// of them.
+	uint32_t from = nav_search.from;
+	uint32_t to = nav_search.to;
+	uint32_t points_len = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		uint32_t index = points_len;
+		int next_dx = 0;
+		int next_dy = 0;
+		for (uint32_t tile = to; tile != from; tile = nav_nodes[tile].parent) {
+			uint32_t parent = nav_nodes[tile].parent;
+			int x = tile % nav_width;
+			int y = tile / nav_width;
+			int dx = nav_sign(x - (int)(parent % nav_width));
+			int dy = nav_sign(y - (int)(parent / nav_width));
+			if (tile == to || dx != next_dx || dy != next_dy) {
+				index--;
+				if (pass == 0) {
+					points_len++;
+				}
+				else if (index < NAV_PATH_POINTS_MAX) {
+					slot->points[index] = nav_tile_center(x, y);
+				}
+			}
+			next_dx = dx;
+			next_dy = dy;
+		}
+	}
+
+	slot->status = NAV_PATH_FOUND;
+	slot->points_len = min(points_len, NAV_PATH_POINTS_MAX);
+	slot->length = nav_nodes[to].g * nav_map->tile_size;
+}
+
+// Start the search for the next queued path. Returns false if there is none.
+static bool nav_search_next(void) {
+	while (nav_queue_len > 0) {
+		uint32_t index = nav_queue[nav_queue_first];
+		nav_queue_first = (nav_queue_first + 1) % NAV_PATHS_MAX;
+		nav_queue_len--;
+
+		nav_slot_t *slot = &nav_slots[index];
+		slot->is_queued = false;
+		if (slot->status != NAV_PATH_PENDING) {
+			continue;
+		}
+
+		// New marks for each search, so that the marks of all tiles don't
+		// need to be cleared
+		if (nav_search.mark_closed >= 0xfffffffe) {
+			for (int i = 0; i < nav_width * nav_height; i++) {
+				nav_nodes[i].mark = 0;
+			}
+			nav_search.mark_closed = 1;
+		}
+		nav_search.mark_open = nav_search.mark_closed + 1;
+		nav_search.mark_closed = nav_search.mark_closed + 2;
+
+		nav_search.slot = index;
+		nav_search.from = slot->from;
+		nav_search.to = slot->to;
+		nav_search.to_x = slot->to % nav_width;
+		nav_search.to_y = slot->to / nav_width;
+		nav_search.heap_len = 0;
+		nav_search_add(slot->from % nav_width, slot->from / nav_width, NAV_NONE, 0);
+		return true;
+	}
+	return false;
+}
+
+// Run the next few steps of the current path search. Returns false if there
+// are no more searches to run.
+static bool nav_search_step(void) {
+	if (nav_search.slot == NAV_NONE && !nav_search_next()) {
+		return false;
+	}
+
+	for (int i = 0; i < NAV_SEARCH_CHUNK; i++) {
+		if (nav_search.heap_len == 0) {
+			nav_search_finish(false);
+			return true;
+		}
+		uint32_t tile = nav_heap_pop();
+		nav_nodes[tile].mark = nav_search.mark_closed;
+		if (tile == nav_search.to) {
+			nav_search_finish(true);
+			return true;
+		}
+		nav_search_expand(tile);
+	}
+	return true;
+}
+
+
+
+// Set up the slot for a search with its current from and to tiles. Trivial
+// requests are resolved immediately, all others are queued.
+static void nav_path_start(uint32_t index) {
+	nav_slot_t *slot = &nav_slots[index];
+	slot->version = nav_version;
+	slot->points_len = 0;
+	slot->length = 0;
+
+	if (
+		slot->from == NAV_NONE || slot->to == NAV_NONE ||
+		nav_blocked(slot->to % nav_width, slot->to / nav_width)
+	) {
+		slot->status = NAV_PATH_NOT_FOUND;
+	}
+	else if (slot->from == slot->to) {
+		slot->status = NAV_PATH_FOUND;
+	}
+	else {
+		slot->status = NAV_PATH_PENDING;
+		if (!slot->is_queued) {
+			slot->is_queued = true;
+			nav_queue[(nav_queue_first + nav_queue_len) % NAV_PATHS_MAX] = index;
+			nav_queue_len++;
+		}
+	}
+}
+
+nav_ref_t nav_path_request(vec2_t from, vec2_t to) {
+	error_if(!nav_map, "nav_init() was not called in this scene");
+	nav_sync();
+
+	uint32_t from_tile = nav_tile_index(nav_tile_pos(from));
+	uint32_t to_tile = nav_tile_index(nav_tile_pos(to));
+	uint64_t key = ((uint64_t)from_tile << 32) | to_tile;
+
+	// Re-use the slot of the same request, if there is one
+	for (uint32_t i = 0; i < nav_slots_len; i++) {
+		if (nav_slot_keys[i] == key) {
+			nav_slot_t *slot = &nav_slots[i];
+			slot->last_used = ++nav_use_counter;
+			if (slot->version != nav_version) {
+				nav_path_start(i);
+			}
+			return (nav_ref_t){.id = slot->id, .index = i};
+		}
+	}
+
+	// Otherwise take a new slot or the one that was used least recently
+	uint32_t index = 0;
+	if (nav_slots_len < NAV_PATHS_MAX) {
+		index = nav_slots_len++;
+		nav_slots[index].is_queued = false;
+	}
+	else {
+		uint32_t oldest_age = 0;
+		for (uint32_t i = 0; i < NAV_PATHS_MAX; i++) {
+			uint32_t age = nav_use_counter - nav_slots[i].last_used;
+			if (age > oldest_age) {
+				oldest_age = age;
+				index = i;
+			}
+		}
+		if (nav_search.slot == index) {
+			nav_search.slot = NAV_NONE;
+		}
+	}
+
+	nav_slot_t *slot = &nav_slots[index];
+	slot->id++;
+	slot->from = from_tile;
+	slot->to = to_tile;
+	slot->last_used = ++nav_use_counter;
+	nav_slot_keys[index] = key;
+	nav_path_start(index);
+	return (nav_ref_t){.id = slot->id, .index = index};
+}
+
+nav_path_t nav_path(nav_ref_t ref) {
+	if (!nav_map || ref.index >= nav_slots_len || nav_slots[ref.index].id != ref.id) {
+		return (nav_path_t){.status = NAV_PATH_INVALID};
+	}
+	nav_sync();
+
+	nav_slot_t *slot = &nav_slots[ref.index];
+	slot->last_used = ++nav_use_counter;
+	if (slot->version != nav_version) {
+		nav_path_start(ref.index);
+	}
+	return (nav_path_t){
+		.status = slot->status,
+		.points = slot->points,
+		.len = slot->status == NAV_PATH_FOUND ? slot->points_len : 0,
+		.length = slot->length
+	};
+}
+
+
+
+// Flow fields are computed with a breadth first search from all targets over
+// the 4 orthogonal neighbours. nav_flow_dir() then also considers the diagonal
+// neighbours, which results in straight diagonal movement in open areas.
+
+// Start computing the next flow field that needs it. Returns false if there is
+// none.
+static bool nav_flow_next(void) {
+	for (int i = 0; i < NAV_FLOW_FIELDS_MAX; i++) {
+		uint32_t index = (nav_flow_last + 1 + i) % NAV_FLOW_FIELDS_MAX;
+		nav_flow_t *flow = &nav_flows[index];
+		if (!flow->is_dirty) {
+			continue;
+		}
+
+		flow->is_dirty = false;
+		nav_flow_current = index;
+		nav_flow_last = index;
+		nav_flow_queue_first = 0;
+		nav_flow_queue_len = 0;
+		memset(nav_flow_spare, 0xff, sizeof(uint32_t) * nav_width * nav_height);
+		for (uint32_t t = 0; t < flow->targets_len; t++) {
+			uint32_t tile = flow->targets[t];
+			int x = tile % nav_width;
+			int y = tile / nav_width;
+			if (nav_flow_spare[tile] == NAV_UNREACHED && !nav_blocked(x, y)) {
+				nav_flow_spare[tile] = 0;
+				nav_flow_queue[nav_flow_queue_len++] = (y << 16) | x;
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+// Run the next few steps of the current flow field. Returns false if there
+// are no more flow fields to compute.
+static bool nav_flow_step(void) {
+	if (nav_flow_current == NAV_NONE && !nav_flow_next()) {
+		return false;
+	}
+
+	uint32_t *steps = nav_flow_spare;
+	uint32_t end = min(nav_flow_queue_first + NAV_FLOW_CHUNK, nav_flow_queue_len);
+	for (; nav_flow_queue_first < end; nav_flow_queue_first++) {
+		// The queue holds the tile positions as (y << 16) | x
+		uint32_t queued = nav_flow_queue[nav_flow_queue_first];
+		int x = queued & 0xffff;
+		int y = queued >> 16;
+		uint32_t tile = y * nav_width + x;
+		uint32_t next = steps[tile] + 1;
+
+		#define NAV_FLOW_VISIT(X, Y, NEIGHBOUR) \
+			if (!nav_blocked(X, Y) && steps[NEIGHBOUR] == NAV_UNREACHED) { \
+				steps[NEIGHBOUR] = next; \
+				nav_flow_queue[nav_flow_queue_len++] = ((Y) << 16) | (X); \
+			}
+		NAV_FLOW_VISIT(x - 1, y, tile - 1);
+		NAV_FLOW_VISIT(x + 1, y, tile + 1);
+		NAV_FLOW_VISIT(x, y - 1, tile - nav_width);
+		NAV_FLOW_VISIT(x, y + 1, tile + nav_width);
+		#undef NAV_FLOW_VISIT
+	}
+
+	if (nav_flow_queue_first == nav_flow_queue_len) {
+		nav_flow_t *flow = &nav_flows[nav_flow_current];
+		nav_flow_spare = flow->steps;
+		flow->steps = steps;
+		flow->is_ready = true;
+		nav_flow_current = NAV_NONE;
+	}
+	return true;
+}
+
+void nav_flow_set_targets(uint32_t field, vec2_t *targets, uint32_t len) {
+	error_if(!nav_map, "nav_init() was not called in this scene");
+	error_if(field >= NAV_FLOW_FIELDS_MAX, "Invalid flow field %d", field);
+	error_if(len > NAV_FLOW_TARGETS_MAX, "Too many flow field targets: %d", len);
+	nav_sync();
+
+	uint32_t tiles[NAV_FLOW_TARGETS_MAX];
+	uint32_t tiles_len = 0;
+	for (uint32_t i = 0; i < len; i++) {
+		uint32_t tile = nav_tile_index(nav_tile_pos(targets[i]));
+		if (tile != NAV_NONE) {
+			tiles[tiles_len++] = tile;
+		}
+	}
+
+	nav_flow_t *flow = &nav_flows[field];
+	if (
+		tiles_len == flow->targets_len &&
+		memcmp(tiles, flow->targets, sizeof(uint32_t) * tiles_len) == 0 &&
+		(flow->is_ready || flow->is_dirty || nav_flow_current == field)
+	) {
+		return;
+	}
+	memcpy(flow->targets, tiles, sizeof(uint32_t) * tiles_len);
+	flow->targets_len = tiles_len;
+	flow->is_dirty = true;
+}
+
+// Return the tile of the field's steps that is the best one to move to from
+// tile_pos, or NAV_NONE if there is none
+static uint32_t nav_flow_best(nav_flow_t *flow, vec2i_t tile_pos, uint32_t *steps_out) {
+	uint32_t tile = nav_tile_index(tile_pos);
+	*steps_out = NAV_UNREACHED;
+	if (!flow->is_ready || tile == NAV_NONE) {
+		return NAV_NONE;
+	}
+
+	uint32_t *steps = flow->steps;
+	uint32_t best_steps = steps[tile];
+	uint32_t best = NAV_NONE;
+	*steps_out = best_steps;
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			int x = tile_pos.x + dx;
+			int y = tile_pos.y + dy;
+			if (
+				(dx == 0 && dy == 0) || nav_blocked(x, y) ||
+				(dx && dy && (nav_blocked(x, tile_pos.y) || nav_blocked(tile_pos.x, y)))
+			) {
+				continue;
+			}
+			uint32_t neighbour = y * nav_width + x;
+			if (steps[neighbour] < best_steps) {
+				best_steps = steps[neighbour];
+				best = neighbour;
+			}
+		}
+	}
+	return best;
+}
+
+vec2_t nav_flow_dir(uint32_t field, vec2_t pos) {
+	error_if(field >= NAV_FLOW_FIELDS_MAX, "Invalid flow field %d", field);
+	if (!nav_map) {
+		return vec2(0, 0);
+	}
+
+	uint32_t steps;
+	uint32_t best = nav_flow_best(&nav_flows[field], nav_tile_pos(pos), &steps);
+	if (best == NAV_NONE || steps == 0) {
+		return vec2(0, 0);
+	}
+
+	vec2_t dir = vec2_sub(nav_tile_center(best % nav_width, best / nav_width), pos);
+	return vec2_mulf(dir, 1.0f / vec2_len(dir));
+}
+
+int nav_flow_steps(uint32_t field, vec2_t pos) {
+	error_if(field >= NAV_FLOW_FIELDS_MAX, "Invalid flow field %d", field);
+	if (!nav_map) {
+		return -1;
+	}
+
+	nav_flow_t *flow = &nav_flows[field];
+	uint32_t tile = nav_tile_index(nav_tile_pos(pos));
+	if (!flow->is_ready || tile == NAV_NONE || flow->steps[tile] == NAV_UNREACHED) {
+		return -1;
+	}
+	return flow->steps[tile];
+}
+
+
+
+void nav_update(void) {
+	if (!nav_map) {
+		return;
+	}
+	profiler_zone("nav_update");
+	nav_sync();
+
+	// Alternate between path searches and flow fields, so that neither can
+	// starve the other
+	double deadline = platform_real_now() + NAV_BUDGET;
+	while (true) {
+		bool has_searches = nav_search_step();
+		bool has_flows = nav_flow_step();
+		if ((!has_searches && !has_flows) || platform_real_now() >= deadline) {
+			break;
+		}
+	}
+}
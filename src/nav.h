@@ -0,0 +1,147 @@
+#ifndef HI_NAV_H
+#define HI_NAV_H
+
+// Pathfinding on the engine.collision_map. The map is turned into a grid of
+// walkable tiles: empty tiles and one-way tiles are walkable, full tiles are
+// not and sloped tiles are walkable if at most NAV_SLOPE_SOLID_MAX of their
+// area is solid. Agents may move diagonally, but never cut the corner of a
+// tile that is not walkable. The grid is rebuilt when the collision map
+// changes (see map_set_tile()); all results are cached until then.
+
+// Call nav_init() in your scene_init(), after the collision map was set. Paths
+// are then requested with nav_path_request() and found with jump point search
+// in nav_update(), which is called by the engine once per frame. The searches
+// in one frame stop after NAV_BUDGET seconds; a search that did not finish
+// continues in the next frame. E.g.:
+//   self->path = nav_path_request(self->pos, player->pos);
+//   ...
+//   nav_path_t path = nav_path(self->path);
+//   if (path.status == NAV_PATH_FOUND) { move towards path.points[0] ... }
+
+// For many agents chasing the same targets, use a flow field instead. A flow
+// field holds the number of steps to the nearest target for each tile of the
+// map and is computed in nav_update() with the same time budget. Agents then
+// just call nav_flow_dir() each frame.
+
+#include "types.h"
+
+// The max number of path requests that are kept. Each request uses one slot
+// and keeps it after the search finished, as a cache for requests from and to
+// the same tiles. If all slots are used, the least recently used slot is
+// taken; its nav_ref_t becomes invalid. This should be higher than the number
+// of agents that request paths.
+#if !defined(NAV_PATHS_MAX)
+	#define NAV_PATHS_MAX 256
+#endif
+
+// The max number of points of a path. Longer paths are cut off and end before
+// the target.
+#if !defined(NAV_PATH_POINTS_MAX)
+	#define NAV_PATH_POINTS_MAX 64
+#endif
+
+// The number of flow fields
+#if !defined(NAV_FLOW_FIELDS_MAX)
+	#define NAV_FLOW_FIELDS_MAX 4
+#endif
+
+// The max number of targets of one flow field
+#if !defined(NAV_FLOW_TARGETS_MAX)
+	#define NAV_FLOW_TARGETS_MAX 16
+#endif
+
+// The time in seconds that nav_update() may spend on searches in each frame.
+// At least some work is done in each frame, even if this is 0.
+#if !defined(NAV_BUDGET)
+	#define NAV_BUDGET 0.001
+#endif
+
+// Sloped tiles are walkable if at most this fraction of their area is solid.
+// With the default of 0.5, these are all slopes whose center is not solid.
+#if !defined(NAV_SLOPE_SOLID_MAX)
+	#define NAV_SLOPE_SOLID_MAX 0.5
+#endif
+
+
+// A reference to a path request. The id is the generation of the slot at
+// index; a zeroed nav_ref_t is never valid.
+typedef struct {
+	uint32_t id;
+	uint32_t index;
+} nav_ref_t;
+
+typedef enum {
+	NAV_PATH_INVALID,
+	NAV_PATH_PENDING,
+	NAV_PATH_FOUND,
+	NAV_PATH_NOT_FOUND
+} nav_status_t;
+
+typedef struct {
+	nav_status_t status;
+
+	// The centers of the tiles (in px) to move to in order, ending with the
+	// target tile. The start tile is not included. Only points where the
+	// direction changes are listed; the path goes in straight horizontal,
+	// vertical or diagonal lines between them. This is valid until the next
+	// call to nav_update() or nav_path_request().
+	vec2_t *points;
+	uint32_t len;
+
+	// The length of the whole path in px, from the start tile's center
+	float length;
+} nav_path_t;
+
+// Allocate and build the nav grid for the engine.collision_map. You can only
+// do this in your scene_init(). This bump allocates about 32 bytes per tile of
+// the map, plus 4 bytes per tile for each flow field.
+void nav_init(void);
+
+// Discard the nav grid and all requests. Called by the engine when the scene
+// changes.
+void nav_reset(void);
+
+// Rebuild the nav grid after the engine restored a snapshot. Pending and found
+// paths are searched again and flow fields are computed again with the same
+// targets; until then nav_flow_dir() returns vec2(0, 0). If nav_init() was
+// called after engine_snapshot(), everything is discarded as in nav_reset().
+// Called by the engine.
+void nav_snapshot_restore(void);
+
+// Run the pending searches until NAV_BUDGET is spent. Called by the engine
+// once per frame; does nothing if nav_init() was not called in this scene.
+void nav_update(void);
+
+// Whether the tile at the tile position can be walked through
+bool nav_is_walkable(vec2i_t tile_pos);
+
+// Request a path from the tile at the pixel position from to the tile at to.
+// If the same path was requested before and the map didn't change, the
+// cached result is returned, otherwise the search runs in nav_update().
+nav_ref_t nav_path_request(vec2_t from, vec2_t to);
+
+// Get the state and result of a path request. NAV_PATH_INVALID if the slot of
+// the request was taken by another one in the meantime. If the map changed
+// since the path was found, it is searched again and NAV_PATH_PENDING is
+// returned until then.
+nav_path_t nav_path(nav_ref_t ref);
+
+// Set the targets of the flow field with the given index (0 to
+// NAV_FLOW_FIELDS_MAX - 1). The field is only computed again if the targets
+// are in different tiles than before. While it's computed, the previous
+// result stays in use.
+void nav_flow_set_targets(uint32_t field, vec2_t *targets, uint32_t len);
+
+// Get the normalized direction to move in from the pixel position (usually an
+// entity's center) towards the nearest target: the direction to the center
+// of the neighbouring tile with the fewest steps. This is vec2(0, 0) in the
+// target tiles, if no target can be reached or if the field was not computed
+// yet.
+vec2_t nav_flow_dir(uint32_t field, vec2_t pos);
+
+// Get the number of horizontal and vertical steps from the tile at the pixel
+// position to the nearest target; -1 if none can be reached or if the field
+// was not computed yet.
+int nav_flow_steps(uint32_t field, vec2_t pos);
+
+#endif
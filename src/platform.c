@@ -4,8 +4,10 @@
 	#include "platform_sdl.c"
 #elif defined(PLATFORM_SOKOL)
 	#include "platform_sokol.c"
+#elif defined(PLATFORM_HEADLESS)
+	#include "platform_headless.c"
 #else
-	#error "No platform specified. #define PLATFORM_SDL or PLATFORM_SOKOL"
+	#error "No platform specified. #define PLATFORM_SDL, PLATFORM_SOKOL or PLATFORM_HEADLESS"
 #endif
 
 // Dependencies for platform_get_base_path()
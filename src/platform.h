@@ -1,9 +1,20 @@
 #ifndef HI_PLATFORM_H
 #define HI_PLATFORM_H
 
-// This abstracts the underlying platform (currently SDL or Sokol). The platform
-// is responsible for setting up a window, renderer, timing and handling of input
-// events.
+// This abstracts the underlying platform (currently SDL, Sokol or Headless). The
+// platform is responsible for setting up a window, renderer, timing and 
+// handling of input events.
+
+// The Headless platform (PLATFORM_HEADLESS) opens no window and no audio 
+// device. It renders into a memory buffer (RENDER_SOFTWARE only), mixes audio
+// into a null sink and runs engine_update() for a fixed number of frames with
+// a virtual clock. This is meant for automated tests and reproducible 
+// performance runs. The defaults below can be changed on the command line:
+//   -frames <n>    number of frames to run; 0 runs until platform_exit()
+//   -tick <secs>   advance the clock by this amount each frame; 0 uses the
+//                  real time
+//   -timing <file> read the frame times (in seconds, one per line) from this
+//                  file; the list is repeated if it is shorter than -frames
 // It should be possible to add further platforms (e.g. for certain consoles) 
 // without changing any other parts of high_impact... in theory.
 
@@ -37,6 +48,17 @@
 	#define PLATFORM_VSYNC 1
 #endif
 
+// The number of frames to run with the Headless platform
+#if !defined(PLATFORM_HEADLESS_FRAMES)
+	#define PLATFORM_HEADLESS_FRAMES 600
+#endif
+
+// The virtual time in seconds that passes each frame with the Headless 
+// platform. 0 uses the real time instead.
+#if !defined(PLATFORM_HEADLESS_TICK)
+	#define PLATFORM_HEADLESS_TICK (1.0/60.0)
+#endif
+
 
 // The max path length when loading/storing files
 #if !defined(PLATFORM_MAX_PATH)
@@ -49,6 +71,12 @@ vec2i_t platform_screen_size(void);
 // Return the current time in seconds since program start
 double platform_now(void);
 
+// Return the current real time in seconds. This is the same clock as 
+// platform_now(), except on the headless platform, where platform_now() is a
+// virtual clock that doesn't move during a frame. Use this to measure how long
+// things take.
+double platform_real_now(void);
+
 // Whether the program is in fullscreen mode
 bool platform_get_fullscreen(void);
 
@@ -0,0 +1,254 @@
+#include <time.h>
+#if defined(_WIN32)
+	#include <windows.h>
+#endif
+
+#include "platform.h"
+#include "input.h"
+#include "sound.h"
+#include "engine.h"
+#include "utils.h"
+#include "alloc.h"
+
+#define QOP_IMPLEMENTATION
+#include "../libs/qop.h"
+
+#if !defined(RENDER_SOFTWARE)
+	#error "Unsupported renderer for platform HEADLESS. #define RENDER_SOFTWARE"
+#endif
+
+// The number of stereo samples mixed per call to the audio callback
+#define PLATFORM_HEADLESS_AUDIO_CHUNK 1024
+
+
+static bool wants_to_exit = false;
+static bool is_fullscreen = false;
+static void (*audio_callback)(float *buffer, uint32_t len) = NULL;
+static float audio_buffer[PLATFORM_HEADLESS_AUDIO_CHUNK * 2];
+static double audio_pending = 0;
+static char *path_assets = "";
+static char *path_userdata = "";
+static char *temp_path = NULL;
+static uint32_t platform_output_samplerate = 44100;
+static qop_desc qop = {0};
+
+static double time_start = 0;
+static double time_now = 0;
+static double tick = PLATFORM_HEADLESS_TICK;
+static double *timing = NULL;
+static uint32_t timing_len = 0;
+
+static rgba_t *screenbuffer = NULL;
+static vec2i_t screen_size = vec2i(WINDOW_WIDTH, WINDOW_HEIGHT);
+
+
+double platform_real_now(void) {
+	#if defined(_WIN32)
+		LARGE_INTEGER freq, counter;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&counter);
+		return (double)counter.QuadPart / (double)freq.QuadPart;
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+	#endif
+}
+
+void platform_exit(void) {
+	wants_to_exit = true;
+}
+
+double platform_now(void) {
+	if (tick == 0 && timing_len == 0) {
+		return platform_real_now() - time_start;
+	}
+	return time_now;
+}
+
+bool platform_get_fullscreen(void) {
+	return is_fullscreen;
+}
+
+void platform_set_fullscreen(bool fullscreen) {
+	is_fullscreen = fullscreen;
+}
+
+uint32_t platform_samplerate(void) {
+	return platform_output_samplerate;
+}
+
+void platform_set_audio_mix_cb(void (*cb)(float *buffer, uint32_t len)) {
+	audio_callback = cb;
+}
+
+uint8_t *platform_load_asset(const char *name, uint32_t *bytes_read) {
+	// Try to load from the QOP archive first
+	if (qop.index_len) {
+		qop_file *f = qop_find(&qop, name);
+		if (f) {
+			uint8_t *data = temp_alloc(f->size);
+			*bytes_read = qop_read(&qop, f, data);
+			return data;
+		}
+	}
+
+	char *path = strcat(strcpy(temp_path, path_assets), name);
+	return file_load(path, bytes_read);
+}
+
+uint8_t *platform_load_userdata(const char *name, uint32_t *bytes_read) {
+	char *path = strcat(strcpy(temp_path, path_userdata), name);
+	if (!file_exists(path)) {
+		*bytes_read = 0;
+		return NULL;
+	}
+	return file_load(path, bytes_read);
+}
+
+uint32_t platform_store_userdata(const char *name, void *bytes, int32_t len) {
+	char *path = strcat(strcpy(temp_path, path_userdata), name);
+	return file_store(path, bytes, len);
+}
+
+rgba_t *platform_get_screenbuffer(int32_t *pitch) {
+	*pitch = screen_size.x * sizeof(rgba_t);
+	return screenbuffer;
+}
+
+vec2i_t platform_screen_size(void) {
+	return screen_size;
+}
+
+static void platform_load_timing(const char *path) {
+	uint32_t len;
+	uint8_t *data = file_load(path, &len);
+	error_if(!data, "Could not load timing file %s", path);
+
+	// Count the lines to get an upper bound for the number of frame times
+	uint32_t lines = 1;
+	for (uint32_t i = 0; i < len; i++) {
+		if (data[i] == '\n') {
+			lines++;
+		}
+	}
+
+	char *text = temp_alloc(len + 1);
+	memcpy(text, data, len);
+	text[len] = '\0';
+	temp_free(data);
+
+	timing = bump_alloc(sizeof(double) * lines);
+	timing_len = 0;
+	char *p = text;
+	while (*p) {
+		char *end;
+		double t = strtod(p, &end);
+		if (end == p) {
+			// Skip anything that is not a number, e.g. an empty line
+			p++;
+			continue;
+		}
+		timing[timing_len++] = max(t, 0);
+		p = end;
+	}
+	temp_free(text);
+
+	error_if(timing_len == 0, "No frame times in timing file %s", path);
+}
+
+static void platform_advance_time(uint32_t frame) {
+	double delta = timing_len
+		? timing[frame % timing_len]
+		: tick;
+
+	if (delta == 0) {
+		return;
+	}
+	time_now += delta;
+
+	// Pull the amount of audio that would have been played back in this time
+	// into the null sink.
+	audio_pending += delta * platform_output_samplerate;
+	while (audio_callback && audio_pending >= 1) {
+		uint32_t samples = min(audio_pending, PLATFORM_HEADLESS_AUDIO_CHUNK);
+		audio_callback(audio_buffer, samples * 2);
+		audio_pending -= samples;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	uint32_t frames = PLATFORM_HEADLESS_FRAMES;
+	char *timing_path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (str_equals(argv[i], "-frames") && i + 1 < argc) {
+			frames = atoi(argv[++i]);
+		}
+		else if (str_equals(argv[i], "-tick") && i + 1 < argc) {
+			tick = max(atof(argv[++i]), 0);
+		}
+		else if (str_equals(argv[i], "-timing") && i + 1 < argc) {
+			timing_path = argv[++i];
+		}
+	}
+
+	// Assets are loaded relative to the executable, unless specified at build
+	// time through -DPATH_ASSETS=.. Userdata is stored in the current directory
+	// unless specified through -DPATH_USERDATA=..
+
+	#ifdef PATH_ASSETS
+		path_assets = TOSTRING(PATH_ASSETS);
+	#else
+		char *exe_path = platform_executable_path();
+		if (exe_path) {
+			path_assets = platform_dirname(exe_path);
+		}
+	#endif
+
+	#ifdef PATH_USERDATA
+		path_userdata = TOSTRING(PATH_USERDATA);
+	#endif
+
+	// Reserve some space for concatenating the asset and userdata paths with
+	// local filenames.
+	temp_path = bump_alloc(max(strlen(path_assets), strlen(path_userdata)) + PLATFORM_MAX_PATH);
+
+	// Try to open a QOP package that may have been appended to the executable
+	// for a release build. All assets will be loaded from this archive then.
+	char *qop_path = platform_executable_path();
+	if (qop_path && qop_open(qop_path, &qop)) {
+		printf("Opened QOP archive from %s; %d bytes, %d files\n", qop_path, qop.files_offset, qop.index_len);
+		qop_read_index(&qop, bump_alloc(qop.hashmap_size));
+	}
+
+	if (timing_path) {
+		platform_load_timing(timing_path);
+	}
+
+	screenbuffer = bump_alloc(screen_size.x * screen_size.y * sizeof(rgba_t));
+	time_start = platform_real_now();
+
+	engine_init();
+
+	double time_real_start = platform_real_now();
+	uint32_t frame = 0;
+	while (!wants_to_exit && (frames == 0 || frame < frames)) {
+		platform_advance_time(frame);
+		engine_update();
+		frame++;
+	}
+	double time_real_total = platform_real_now() - time_real_start;
+
+	printf(
+		"Ran %d frames in %.3fms; %.3fms per frame\n",
+		frame, time_real_total * 1000.0, frame ? time_real_total * 1000.0 / frame : 0
+	);
+
+	engine_cleanup();
+
+	if (qop.index_len) {
+		qop_close(&qop);
+	}
+	return 0;
+}
@@ -8,6 +8,7 @@
 #include "engine.h"
 #include "utils.h"
 #include "alloc.h"
+#include "profiler.h"
 
 #define QOP_IMPLEMENTATION
 #include "../libs/qop.h"
@@ -202,6 +203,10 @@ double platform_now(void) {
 	return (double)perf_counter / (double)perf_freq;
 }
 
+double platform_real_now(void) {
+	return platform_now();
+}
+
 bool platform_get_fullscreen(void) {
 	return SDL_GetWindowFlags(window) & SDL_WINDOW_FULLSCREEN;
 }
@@ -378,6 +383,9 @@ uint32_t platform_store_userdata(const char *name, void *bytes, int32_t len) {
 	}
 
 	void platform_end_frame(void) {
+		// The software renderer draws directly into the screenbuffer; this
+		// is where it is uploaded and presented.
+		profiler_zone("render_flush");
 		screenbuffer_pixels = NULL;
 		SDL_UnlockTexture(screenbuffer);
 		SDL_RenderCopy(renderer, screenbuffer, NULL, NULL);
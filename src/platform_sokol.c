@@ -171,6 +171,10 @@ double platform_now(void) {
 	return stm_sec(stm_now());
 }
 
+double platform_real_now(void) {
+	return platform_now();
+}
+
 bool platform_get_fullscreen(void) {
 	return sapp_is_fullscreen();
 }
@@ -0,0 +1,176 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(_WIN32)
+	#include <windows.h>
+#endif
+
+#include "profiler.h"
+#include "platform.h"
+#include "alloc.h"
+#include "utils.h"
+
+#if PROFILER
+
+typedef struct {
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+} profiler_event_t;
+
+typedef struct {
+	profiler_event_t events[PROFILER_EVENTS_MAX];
+
+	// The total number of events written; only the last PROFILER_EVENTS_MAX
+	// are kept.
+	_Atomic uint64_t events_len;
+
+	const char *stack_names[PROFILER_DEPTH_MAX];
+	uint64_t stack_start[PROFILER_DEPTH_MAX];
+	uint32_t depth;
+} profiler_thread_t;
+
+static profiler_thread_t threads[PROFILER_THREADS_MAX];
+static _Atomic uint32_t threads_len = 0;
+
+// The profiler thread for the calling thread; NULL if it hasn't recorded any
+// zones yet or if PROFILER_THREADS_MAX was reached.
+static _Thread_local profiler_thread_t *thread = NULL;
+static _Thread_local bool thread_is_registered = false;
+
+
+static uint64_t profiler_now_ns(void) {
+	#if defined(_WIN32)
+		static LARGE_INTEGER freq = {0};
+		if (freq.QuadPart == 0) {
+			QueryPerformanceFrequency(&freq);
+		}
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+	#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	#endif
+}
+
+static profiler_thread_t *profiler_thread(void) {
+	if (!thread_is_registered) {
+		thread_is_registered = true;
+		uint32_t index = atomic_fetch_add(&threads_len, 1);
+		if (index < PROFILER_THREADS_MAX) {
+			thread = &threads[index];
+		}
+	}
+	return thread;
+}
+
+void profiler_begin(const char *name) {
+	profiler_thread_t *t = profiler_thread();
+	if (!t) {
+		return;
+	}
+	if (t->depth < PROFILER_DEPTH_MAX) {
+		t->stack_names[t->depth] = name;
+		t->stack_start[t->depth] = profiler_now_ns();
+	}
+	t->depth++;
+}
+
+void profiler_end(void) {
+	profiler_thread_t *t = thread;
+	if (!t || t->depth == 0) {
+		return;
+	}
+
+	t->depth--;
+	if (t->depth >= PROFILER_DEPTH_MAX) {
+		return;
+	}
+
+	// The ring buffer is only written by this thread. profiler_dump() may
+	// read it concurrently; it discards all events that may have been
+	// overwritten while reading, by checking events_len afterwards.
+	uint64_t len = atomic_load_explicit(&t->events_len, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	t->events[len & (PROFILER_EVENTS_MAX - 1)] = (profiler_event_t){
+		.name = t->stack_names[t->depth],
+		.start = t->stack_start[t->depth],
+		.end = profiler_now_ns()
+	};
+	atomic_store_explicit(&t->events_len, len + 1, memory_order_release);
+}
+
+void profiler_zone_end(uint8_t *unused) {
+	profiler_end();
+}
+
+profiler_mark_t profiler_mark(void) {
+	return (profiler_mark_t){.time = profiler_now_ns()};
+}
+
+bool profiler_dump(const char *name) {
+	return profiler_dump_since(name, (profiler_mark_t){.time = 0});
+}
+
+bool profiler_dump_since(const char *name, profiler_mark_t mark) {
+	uint32_t threads_count = min(atomic_load(&threads_len), PROFILER_THREADS_MAX);
+
+	// Find the range of events for each thread, the number of events after
+	// the mark and the earliest timestamp. This is only an estimate, since
+	// other threads may overwrite events in the meantime.
+	uint64_t first[PROFILER_THREADS_MAX];
+	uint64_t last[PROFILER_THREADS_MAX];
+	uint32_t events_count = 0;
+	uint64_t time_start = UINT64_MAX;
+	for (uint32_t i = 0; i < threads_count; i++) {
+		last[i] = atomic_load_explicit(&threads[i].events_len, memory_order_acquire);
+		first[i] = last[i] > PROFILER_EVENTS_MAX ? last[i] - PROFILER_EVENTS_MAX : 0;
+		for (uint64_t e = first[i]; e < last[i]; e++) {
+			uint64_t start = threads[i].events[e & (PROFILER_EVENTS_MAX - 1)].start;
+			if (start >= mark.time) {
+				time_start = min(time_start, start);
+				events_count++;
+			}
+		}
+	}
+
+	// Each event takes at most ~100 bytes plus the length of its name. With
+	// full rings on many threads this can be more than the hunk has to spare,
+	// so the size is capped and the remaining events are dropped.
+	uint32_t json_size = min(64 + (events_count + 16) * 256, PROFILER_DUMP_SIZE_MAX);
+	char *json = temp_alloc(json_size);
+	uint32_t len = snprintf(json, json_size, "{\"traceEvents\":[");
+	bool is_first = true;
+
+	for (uint32_t i = 0; i < threads_count; i++) {
+		profiler_thread_t *t = &threads[i];
+		for (uint64_t e = first[i]; e < last[i] && json_size - len > 512; e++) {
+			profiler_event_t ev = t->events[e & (PROFILER_EVENTS_MAX - 1)];
+
+			// Skip this event if the thread may have overwritten it while we
+			// were reading.
+			atomic_thread_fence(memory_order_acquire);
+			uint64_t events_len = atomic_load_explicit(&t->events_len, memory_order_relaxed);
+			if (e + PROFILER_EVENTS_MAX <= events_len || ev.start < mark.time) {
+				continue;
+			}
+
+			len += snprintf(
+				json + len, json_size - len,
+				"%s\n{\"name\":\"%.128s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				(is_first ? "" : ","), ev.name, i,
+				(ev.start - min(time_start, ev.start)) / 1000.0, (ev.end - ev.start) / 1000.0
+			);
+			is_first = false;
+		}
+	}
+	len += snprintf(json + len, json_size - len, "\n]}\n");
+
+	bool success = platform_store_userdata(name, json, len);
+	temp_free(json);
+	return success;
+}
+
+#endif
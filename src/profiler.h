@@ -0,0 +1,96 @@
+#ifndef HI_PROFILER_H
+#define HI_PROFILER_H
+
+// A CPU profiler with named, nested zones. Each thread records the zones that
+// it completed into its own ring buffer, so recording is lock-free. The last
+// PROFILER_EVENTS_MAX zones of each thread can be written to a file in the
+// Chrome trace event format at any time with profiler_dump(). Open this file
+// in chrome://tracing or https://ui.perfetto.dev
+
+// The profiler is compiled out, unless PROFILER is defined as 1. E.g.:
+//   void my_expensive_function(void) {
+//       profiler_zone("my_expensive_function");
+//       ...
+//   }
+// The zone ends when the enclosing scope is left. Zones that don't match a
+// scope can be recorded with profiler_begin() and profiler_end().
+
+#include "types.h"
+
+#if !defined(PROFILER)
+	#define PROFILER 0
+#endif
+
+// The number of zones that are kept for each thread. Older zones are
+// overwritten. Must be a power of 2.
+#if !defined(PROFILER_EVENTS_MAX)
+	#define PROFILER_EVENTS_MAX (32 * 1024)
+#endif
+
+// The maximum number of threads that can record zones. Zones from additional
+// threads are ignored.
+#if !defined(PROFILER_THREADS_MAX)
+	#define PROFILER_THREADS_MAX 32
+#endif
+
+// The maximum nesting depth of zones. Deeper zones are ignored.
+#if !defined(PROFILER_DEPTH_MAX)
+	#define PROFILER_DEPTH_MAX 32
+#endif
+
+// The maximum size in bytes of the JSON that profiler_dump() writes. It is 
+// built in temp memory, so this must fit into the hunk next to everything 
+// else. Zones that don't fit are left out.
+#if !defined(PROFILER_DUMP_SIZE_MAX)
+	#define PROFILER_DUMP_SIZE_MAX (4 * 1024 * 1024)
+#endif
+
+
+#if PROFILER
+	// Record a zone from here to the end of the enclosing scope. The NAME must
+	// be a string literal or otherwise outlive the profiler.
+	#define profiler_zone(NAME) \
+		__attribute__((cleanup(profiler_zone_end), unused)) \
+		uint8_t _PROFILER_ZONE_VAR(__COUNTER__) = (profiler_begin(NAME), 0)
+
+	#define _PROFILER_ZONE_VAR(N) _PROFILER_ZONE_VAR2(N)
+	#define _PROFILER_ZONE_VAR2(N) _profiler_zone_##N
+
+	// Begin a zone. Must be followed by profiler_end() on the same thread.
+	void profiler_begin(const char *name);
+
+	// End the last zone that was begun on this thread
+	void profiler_end(void);
+
+	void profiler_zone_end(uint8_t *unused);
+#else
+	#define profiler_zone(NAME)
+	#define profiler_begin(NAME)
+	#define profiler_end()
+#endif
+
+typedef struct { uint64_t time; } profiler_mark_t;
+
+#if PROFILER
+	// Return the current point in time, for use with profiler_dump_since()
+	profiler_mark_t profiler_mark(void);
+
+	// Write the recorded zones of all threads to a file in the userdata
+	// directory in the Chrome trace event format. Returns false if the file
+	// could not be written. This must be called from the main thread. Zones
+	// that are recorded on other threads in the meantime may or may not be
+	// included.
+	bool profiler_dump(const char *name);
+
+	// Same as profiler_dump(), but only write the zones that began after the
+	// mark
+	bool profiler_dump_since(const char *name, profiler_mark_t mark);
+#else
+	// With the profiler compiled out, nothing is recorded and no file is
+	// written. profiler.c does not need to be compiled in this case.
+	static inline profiler_mark_t profiler_mark(void) { return (profiler_mark_t){0}; }
+	static inline bool profiler_dump(const char *name) { return false; }
+	static inline bool profiler_dump_since(const char *name, profiler_mark_t mark) { return false; }
+#endif
+
+#endif
@@ -2,6 +2,7 @@
 #include "render.h"
 #include "alloc.h"
 #include "utils.h"
+#include "profiler.h"
 
 #if !defined(RENDER_ATLAS_SIZE)
 	#define RENDER_ATLAS_SIZE 64
@@ -524,6 +525,7 @@ void render_frame_end(void) {
 }
 
 void render_flush(void) {
+	profiler_zone("render_flush");
 	if (mipmap_is_dirty) {
 		glGenerateMipmap(GL_TEXTURE_2D);
 		mipmap_is_dirty = false;
@@ -3,6 +3,7 @@
 #include "alloc.h"
 #include "utils.h"
 #include "platform.h"
+#include "profiler.h"
 
 #if !defined(RENDER_BUFFER_CAPACITY)
 	#define RENDER_BUFFER_CAPACITY 2048
@@ -406,6 +407,7 @@ void render_backend_cleanup(void) {
 
 static void render_flush(id<MTLRenderPipelineState> renderPipeline, id<MTLTexture> destinationTexture)
 {
+	profiler_zone("render_flush");
 	if (reencodeArgumentBuffer) {
 		shader_arguments_t *args = (shader_arguments_t *)[mtl.argumentBuffer contents];
 		for (int i = 0; i < textureCount; ++i) {
@@ -18,7 +18,12 @@ static int32_t screen_pitch;
 static int32_t screen_ppr;
 static vec2i_t screen_size;
 
-void render_backend_init(void) {}
+void render_backend_init(void) {
+	// Create white texture
+	rgba_t white_pixels[4] = {rgba_white(), rgba_white(), rgba_white(), rgba_white()};
+	RENDER_NO_TEXTURE = texture_create(vec2i(2, 2), white_pixels);
+}
+
 void render_backend_cleanup(void) {}
 
 void render_set_screen(vec2i_t size) {
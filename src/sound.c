@@ -3,6 +3,7 @@
 #include "engine.h"
 #include "alloc.h"
 #include "platform.h"
+#include "profiler.h"
 
 #define QOA_IMPLEMENTATION
 #define QOA_NO_STDIO
@@ -69,6 +70,7 @@ void sound_init(int samplerate) {
 }
 
 void sound_init_synth(void) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_SOUND);
 	if (sound_synth_initialized) {
 		return;
 	}
@@ -128,6 +130,7 @@ void sound_set_global_volume(float volume) {
 }
 
 void sound_mix_stereo(float *dest_samples, uint32_t dest_len) {
+	profiler_zone("sound_mix_stereo");
 	memset(dest_samples, 0, dest_len * sizeof(float));
 
 	// Samples are stored as int16_t; we have to multiply each sample with 
@@ -208,6 +211,7 @@ void sound_mix_stereo(float *dest_samples, uint32_t dest_len) {
 // sound_source ------------------------------------------------------------------
 
 sound_source_t *sound_source(char *path) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_SOUND);
 	for (uint32_t i = 0; i < sources_len; i++) {
 		if (str_equals(path, source_paths[i])) {
 			return &sources[i];
@@ -289,6 +293,7 @@ sound_source_t *sound_source(char *path) {
 static char *sound_internal_path = "__internal";
 
 sound_source_t *sound_source_with_samples(int16_t *samples, uint32_t len, uint32_t channels, uint32_t samplerate) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_SOUND);
 	error_if(sources_len >= SOUND_MAX_SOURCES, "Max sound sources (%d) reached", SOUND_MAX_SOURCES);
 	error_if(engine_is_running(), "Cant load sound source during gameplay");
 
@@ -306,6 +311,7 @@ sound_source_t *sound_source_with_samples(int16_t *samples, uint32_t len, uint32
 }
 
 sound_source_t *sound_source_synth_sound(pl_synth_sound_t *sound) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_SOUND);
 	sound_init_synth();
 	int len = pl_synth_sound_len(sound);
 	int16_t *samples = bump_alloc(sizeof(int16_t) * len * 2);
@@ -314,6 +320,7 @@ sound_source_t *sound_source_synth_sound(pl_synth_sound_t *sound) {
 }
 
 sound_source_t *sound_source_synth_song(pl_synth_song_t *song) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_SOUND);
 	sound_init_synth();
 	int len = pl_synth_song_len(song);
 	int16_t *samples = bump_alloc(sizeof(int16_t) * len * 2);
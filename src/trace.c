@@ -1,6 +1,7 @@
 #include "trace.h"
 #include "alloc.h"
 #include "utils.h"
+#include "profiler.h"
 
 typedef struct {
 	vec2_t start;
@@ -70,12 +71,70 @@ static const slope_def_t slope_definitions[] = {
 	/* One way W */ [45] = SLOPE(0,1, 0,0, ONE_WAY)
 };
 
+float trace_tile_solid_area(uint16_t tile) {
+	if (tile == 1) {
+		return 1;
+	}
+	if (tile >= len(slope_definitions) || !slope_definitions[tile].solid) {
+		return 0;
+	}
+
+	// Clip the unit square to the solid side of the slope (behind its normal)
+	// and compute the area of the remaining polygon with the shoelace formula
+	const slope_def_t *def = &slope_definitions[tile];
+	vec2_t square[4] = {vec2(0, 0), vec2(1, 0), vec2(1, 1), vec2(0, 1)};
+	vec2_t poly[8];
+	int poly_len = 0;
+	for (int i = 0; i < 4; i++) {
+		vec2_t a = square[i];
+		vec2_t b = square[(i + 1) % 4];
+		float da = vec2_dot(vec2_sub(a, def->start), def->normal);
+		float db = vec2_dot(vec2_sub(b, def->start), def->normal);
+		if (da <= 0) {
+			poly[poly_len++] = a;
+		}
+		if ((da <= 0) != (db <= 0)) {
+			poly[poly_len++] = vec2_add(a, vec2_mulf(vec2_sub(b, a), da / (da - db)));
+		}
+	}
+
+	float area = 0;
+	for (int i = 0; i < poly_len; i++) {
+		vec2_t a = poly[i];
+		vec2_t b = poly[(i + 1) % poly_len];
+		area += a.x * b.y - b.x * a.y;
+	}
+	return fabsf(area) * 0.5f;
+}
+
+
+// Queries of trace_batch() are sorted by the region of 16x16 tiles (1 << 4)
+// that they start in, so that consecutive traces walk the same part of the map.
+// This only pays off for maps that don't fit into the cache anyway.
+#define TRACE_BATCH_REGION_SHIFT 4
+#define TRACE_BATCH_SORT_MIN_TILES (512 * 512)
+
+// Everything a trace needs to walk the map; computed up front by trace() and
+// for all queries at once by trace_batch().
+typedef struct {
+	vec2_t from;
+	vec2_t vel;
+	vec2_t size;
+	vec2_t offset;
+	vec2_t corner;
+	vec2_t dir;
+	vec2_t step_size;
+	int steps;
+	uint32_t index;
+} trace_setup_t;
 
+static void trace_walk(map_t *map, trace_setup_t *s, trace_t *res);
 static inline void check_tile(map_t *map, vec2_t pos, vec2_t vel, vec2_t size, vec2i_t tile_pos, trace_t *res);
 static void resolve_full_tile(map_t *map, vec2_t pos, vec2_t vel, vec2_t size, vec2i_t tile_pos, trace_t *res);
 static void resolve_sloped_tile(map_t *map, vec2_t pos, vec2_t vel, vec2_t size, vec2i_t tile_pos, uint32_t tile, trace_t *res);
 
 trace_t trace(map_t *map, vec2_t from, vec2_t vel, vec2_t size) {
+	profiler_zone("trace");
 	vec2_t to = vec2_add(from, vel);
 
 	trace_t res = {
@@ -109,7 +168,114 @@ trace_t trace(map_t *map, vec2_t from, vec2_t vel, vec2_t size) {
 	if (steps == 0) {
 		return res;
 	}
-	vec2_t step_size = vec2_divf(vel, steps);
+
+	trace_setup_t s = {
+		.from = from,
+		.vel = vel,
+		.size = size,
+		.offset = offset,
+		.corner = corner,
+		.dir = dir,
+		.step_size = vec2_divf(vel, steps),
+		.steps = steps
+	};
+	trace_walk(map, &s, &res);
+	return res;
+}
+
+void trace_batch(map_t *map, vec2_t *from, vec2_t *vel, vec2_t *size, trace_t *out, uint32_t n) {
+	profiler_zone("trace_batch");
+	if (n == 0) {
+		return;
+	}
+
+	trace_setup_t *setup = temp_alloc(sizeof(trace_setup_t) * n);
+	uint32_t setup_len = 0;
+
+	// Compute the setup for all queries in one branch-free pass and keep the
+	// ones that have to walk the map. This does the exact same float 
+	// operations as trace(), so that the results are identical.
+	vec2i_t map_size_px = vec2i_muli(map->size, map->tile_size);
+	float tile_size = map->tile_size;
+	for (uint32_t i = 0; i < n; i++) {
+		vec2_t f = from[i];
+		vec2_t v = vel[i];
+		vec2_t sz = size[i];
+		vec2_t to = vec2_add(f, v);
+		out[i] = (trace_t){.tile = 0, .pos = to, .normal = vec2(0, 0), .length = 1};
+
+		vec2_t offset = vec2(v.x > 0 ? 1 : 0, v.y > 0 ? 1 : 0);
+		vec2_t dir = vec2_add(vec2_mulf(offset, -2), vec2(1, 1));
+		float max_vel = max(v.x * -dir.x, v.y * -dir.y);
+		int steps = ceilf(max_vel / tile_size);
+
+		bool skip = 
+			(f.x + sz.x < 0 && to.x + sz.x < 0) |
+			(f.y + sz.y < 0 && to.y + sz.y < 0) |
+			(f.x > map_size_px.x && to.x > map_size_px.x) |
+			(f.y > map_size_px.y && to.y > map_size_px.y) |
+			(v.x == 0 && v.y == 0) |
+			(steps == 0);
+
+		trace_setup_t *s = &setup[setup_len];
+		s->from = f;
+		s->vel = v;
+		s->size = sz;
+		s->offset = offset;
+		s->corner = vec2_add(f, vec2_mul(sz, offset));
+		s->dir = dir;
+		s->step_size = vec2_divf(v, steps);
+		s->steps = steps;
+		s->index = i;
+		setup_len += !skip;
+	}
+
+	// Sort the remaining queries by the map region of their starting corner
+	if (setup_len > 1 && map->size.x * map->size.y >= TRACE_BATCH_SORT_MIN_TILES) {
+		sort_key_t *keys = temp_alloc(sizeof(sort_key_t) * setup_len * 2);
+		int regions_max = 0xffff;
+		for (uint32_t k = 0; k < setup_len; k++) {
+			vec2_t corner = setup[k].corner;
+			int rx = clamp((int)(corner.x / tile_size) >> TRACE_BATCH_REGION_SHIFT, 0, regions_max);
+			int ry = clamp((int)(corner.y / tile_size) >> TRACE_BATCH_REGION_SHIFT, 0, regions_max);
+			keys[k] = (sort_key_t){.key = ((uint32_t)ry << 16) | rx, .index = k};
+		}
+		sort_radix(setup, setup_len, sizeof(trace_setup_t), keys);
+		temp_free(keys);
+	}
+
+	for (uint32_t k = 0; k < setup_len; k++) {
+		trace_walk(map, &setup[k], &out[setup[k].index]);
+	}
+
+	temp_free(setup);
+}
+
+static void trace_walk(map_t *map, trace_setup_t *s, trace_t *res) {
+	vec2_t from = s->from;
+	vec2_t vel = s->vel;
+	vec2_t size = s->size;
+	vec2_t offset = s->offset;
+	vec2_t corner = s->corner;
+	vec2_t dir = s->dir;
+	vec2_t step_size = s->step_size;
+	int steps = s->steps;
+
+	// If all tiles that the AABB sweeps over are empty, there's nothing to 
+	// hit. The tile range has a margin of one tile, so that it covers all 
+	// tiles that the walk below may check.
+	bool has_solid = map->solid_rows != NULL;
+	if (has_solid) {
+		vec2_t to = vec2_add(from, vel);
+		float ts = map->tile_size;
+		int x0 = floorf(min(from.x, to.x) / ts) - 1;
+		int y0 = floorf(min(from.y, to.y) / ts) - 1;
+		int x1 = floorf((max(from.x, to.x) + size.x) / ts) + 1;
+		int y1 = floorf((max(from.y, to.y) + size.y) / ts) + 1;
+		if (!map_solid_in_rect(map, x0, y0, x1, y1)) {
+			return;
+		}
+	}
 
 	vec2i_t last_tile_pos = vec2i(-16, -16);
 	bool extra_step_for_slope = false;
@@ -127,8 +293,14 @@ trace_t trace(map_t *map, vec2_t from, vec2_t vel, vec2_t size) {
 			}
 
 			int num_tiles = ceilf(fabsf(max_y / map->tile_size - tile_pos.y - offset.y));
-			for (int t = 0; t < num_tiles; t++) {
-				check_tile(map, from, vel, size, vec2i(tile_pos.x, tile_pos.y + dir.y * t), &res);
+			int y_end = tile_pos.y + dir.y * (num_tiles - 1);
+			if (
+				num_tiles > 0 && 
+				(!has_solid || map_solid_in_column(map, tile_pos.x, min(tile_pos.y, y_end), max(tile_pos.y, y_end)))
+			) {
+				for (int t = 0; t < num_tiles; t++) {
+					check_tile(map, from, vel, size, vec2i(tile_pos.x, tile_pos.y + dir.y * t), res);
+				}
 			}
 
 			last_tile_pos.x = tile_pos.x;
@@ -145,8 +317,15 @@ trace_t trace(map_t *map, vec2_t from, vec2_t vel, vec2_t size) {
 			}
 			
 			int num_tiles = ceilf(fabsf(max_x / map->tile_size - tile_pos.x - offset.x));
-			for (int t = corner_tile_checked; t < num_tiles; t++) {
-				check_tile(map, from, vel, size, vec2i(tile_pos.x + dir.x * t, tile_pos.y), &res);
+			int x_start = tile_pos.x + dir.x * corner_tile_checked;
+			int x_end = tile_pos.x + dir.x * (num_tiles - 1);
+			if (
+				num_tiles > corner_tile_checked && 
+				(!has_solid || map_solid_in_row(map, tile_pos.y, min(x_start, x_end), max(x_start, x_end)))
+			) {
+				for (int t = corner_tile_checked; t < num_tiles; t++) {
+					check_tile(map, from, vel, size, vec2i(tile_pos.x + dir.x * t, tile_pos.y), res);
+				}
 			}
 
 			last_tile_pos.y = tile_pos.y;
@@ -156,13 +335,11 @@ trace_t trace(map_t *map, vec2_t from, vec2_t vel, vec2_t size) {
 		// forward because we may still collide with another tile at an
 		// earlier .length point. For fully solid tiles (id: 1), we can
 		// return here.
-		if (res.tile > 0 && (res.tile == 1 || extra_step_for_slope)) {
-			return res;
+		if (res->tile > 0 && (res->tile == 1 || extra_step_for_slope)) {
+			return;
 		}
 		extra_step_for_slope = true;
 	}
-
-	return res;	
 }
 
 static inline void check_tile(map_t *map, vec2_t pos, vec2_t vel, vec2_t size, vec2i_t tile_pos, trace_t *res) {
@@ -377,3 +554,312 @@ static void resolve_sloped_tile(map_t *map, vec2_t pos, vec2_t vel, vec2_t size,
 	res->length = length;
 	res->pos = vec2_add(rp, tile_pos_px);
 }
+
+
+// Rays are walked from tile to tile with the DDA of Amanatides & Woo. For each
+// tile, the ray's parameter t (0..1 along vel) is known when it enters and 
+// leaves the tile, so full tiles are hit when entered and sloped tiles only
+// need a line intersection within that interval.
+
+typedef struct {
+	vec2_t from;
+	vec2_t vel;
+
+	// The origin's tile; rays that start in this tile are not blocked by it,
+	// unless they hit its slope from the open side.
+	vec2i_t origin_tile;
+	bool origin_in_map;
+} trace_ray_origin_t;
+
+static inline float trace_ray_exit_x(trace_ray_origin_t *o, map_t *map, int x, int step_x, float inv_vel_x) {
+	if (step_x == 0) {
+		return INFINITY;
+	}
+	return ((x + (step_x > 0)) * (float)map->tile_size - o->from.x) * inv_vel_x;
+}
+
+static inline float trace_ray_exit_y(trace_ray_origin_t *o, map_t *map, int y, int step_y, float inv_vel_y) {
+	if (step_y == 0) {
+		return INFINITY;
+	}
+	return ((y + (step_y > 0)) * (float)map->tile_size - o->from.y) * inv_vel_y;
+}
+
+static bool trace_ray_resolve_tile(
+	trace_ray_origin_t *o, map_t *map, vec2i_t tile_pos, uint32_t tile, 
+	float t_enter, float t_exit, bool entered, vec2_t enter_normal, trace_t *res
+) {
+	vec2_t from = o->from;
+	vec2_t vel = o->vel;
+
+	if (tile == 1) {
+		if (!entered) {
+			return false;
+		}
+		res->length = t_enter;
+		res->normal = enter_normal;
+	}
+	else {
+		if (tile >= len(slope_definitions)) {
+			return false;
+		}
+		const slope_def_t *slope = &slope_definitions[tile];
+		if (slope->dir.x == 0 && slope->dir.y == 0) {
+			return false;
+		}
+
+		const float epsilon = 0.001;
+		float ts = map->tile_size;
+		vec2_t tile_pos_px = vec2_mulf(vec2_from_vec2i(tile_pos), ts);
+		vec2_t ss = vec2_add(tile_pos_px, vec2_mulf(slope->start, ts));
+		vec2_t sd = vec2_mulf(slope->dir, ts);
+		vec2_t normal = slope->normal;
+
+		// Did we enter the tile through one of its edges on the solid side of
+		// the slope?
+		if (entered && slope->solid) {
+			vec2_t enter_pos = vec2_add(from, vec2_mulf(vel, t_enter));
+			if (vec2_dot(vec2_sub(enter_pos, ss), normal) < -epsilon) {
+				res->length = t_enter;
+				res->normal = enter_normal;
+				goto hit;
+			}
+		}
+
+		// Are we moving into the slope from its open side, and do we cross it
+		// while we're in this tile?
+		float determinant = vec2_cross(vel, sd);
+		if (vec2_dot(vel, normal) >= 0 || determinant == 0) {
+			return false;
+		}
+		float t = vec2_cross(vec2_sub(ss, from), sd) / determinant;
+		float epsilon_t = epsilon / (fabsf(vel.x) + fabsf(vel.y));
+		if (t < t_enter - epsilon_t || t > t_exit + epsilon_t || t < 0 || t > 1) {
+			return false;
+		}
+		res->length = max(t, 0);
+		res->normal = normal;
+	}
+
+hit:
+	res->tile = tile;
+	res->tile_pos = tile_pos;
+	res->pos = vec2_add(from, vec2_mulf(vel, res->length));
+	return true;
+}
+
+static trace_t trace_ray_walk(trace_ray_origin_t *o, map_t *map) {
+	vec2_t from = o->from;
+	vec2_t vel = o->vel;
+	trace_t res = {
+		.tile = 0,
+		.pos = vec2_add(from, vel),
+		.normal = vec2(0, 0),
+		.length = 1
+	};
+	if (vel.x == 0 && vel.y == 0) {
+		return res;
+	}
+
+	// Clip the ray to the map's bounds; everything outside is empty
+	float ts = map->tile_size;
+	vec2_t map_size_px = vec2(map->size.x * ts, map->size.y * ts);
+	vec2_t inv_vel = vec2(1.0f / vel.x, 1.0f / vel.y);
+	float t_start = 0;
+	float t_end = 1;
+	vec2_t start_normal = vec2(0, 0);
+	if (vel.x != 0) {
+		float t0 = (0 - from.x) * inv_vel.x;
+		float t1 = (map_size_px.x - from.x) * inv_vel.x;
+		if (t0 > t1) {
+			swap(t0, t1);
+		}
+		if (t0 > t_start) {
+			t_start = t0;
+			start_normal = vec2(vel.x > 0 ? -1 : 1, 0);
+		}
+		t_end = min(t_end, t1);
+	}
+	else if (from.x < 0 || from.x >= map_size_px.x) {
+		return res;
+	}
+	if (vel.y != 0) {
+		float t0 = (0 - from.y) * inv_vel.y;
+		float t1 = (map_size_px.y - from.y) * inv_vel.y;
+		if (t0 > t1) {
+			swap(t0, t1);
+		}
+		if (t0 > t_start) {
+			t_start = t0;
+			start_normal = vec2(0, vel.y > 0 ? -1 : 1);
+		}
+		t_end = min(t_end, t1);
+	}
+	else if (from.y < 0 || from.y >= map_size_px.y) {
+		return res;
+	}
+	if (t_start > t_end) {
+		return res;
+	}
+
+	// Nothing to hit if the whole ray only crosses empty tiles
+	vec2_t to = vec2_add(from, vel);
+	float inv_ts = 1.0f / ts;
+	bool has_solid = map->solid_rows != NULL;
+	if (has_solid && !map_solid_in_rect(map, 
+		floorf(min(from.x, to.x) * inv_ts) - 1, floorf(min(from.y, to.y) * inv_ts) - 1,
+		floorf(max(from.x, to.x) * inv_ts) + 1, floorf(max(from.y, to.y) * inv_ts) + 1
+	)) {
+		return res;
+	}
+
+	vec2i_t step = vec2i(vel.x > 0 ? 1 : (vel.x < 0 ? -1 : 0), vel.y > 0 ? 1 : (vel.y < 0 ? -1 : 0));
+	vec2i_t tile_pos;
+	bool entered;
+	if (t_start == 0 && o->origin_in_map) {
+		tile_pos = o->origin_tile;
+		entered = false;
+	}
+	else {
+		vec2_t start = vec2_add(from, vec2_mulf(vel, t_start));
+		tile_pos = vec2i(
+			clamp((int)floorf(start.x * inv_ts), 0, map->size.x - 1),
+			clamp((int)floorf(start.y * inv_ts), 0, map->size.y - 1)
+		);
+		entered = t_start > 0;
+	}
+
+	// The t at which the ray leaves the current column (tx) and row (ty) 
+	// and the t it takes to cross a whole tile. These are advanced 
+	// incrementally; the exact values are recomputed for a hit.
+	float tx = trace_ray_exit_x(o, map, tile_pos.x, step.x, inv_vel.x);
+	float ty = trace_ray_exit_y(o, map, tile_pos.y, step.y, inv_vel.y);
+	float tdx = step.x ? ts * fabsf(inv_vel.x) : INFINITY;
+	float tdy = step.y ? ts * fabsf(inv_vel.y) : INFINITY;
+
+	// For mostly horizontal rays, each row is crossed by a long run of tiles.
+	// These are skipped when they are all empty. Likewise for the columns of
+	// mostly vertical rays.
+	bool skip_rows = has_solid && fabsf(vel.x) >= fabsf(vel.y);
+	bool skip_cols = has_solid && !skip_rows;
+	bool try_skip = has_solid;
+
+	int entered_axis = 0; // 0: start, 1: x, 2: y
+	uint16_t *data = map->data;
+	while (true) {
+		uint32_t tile = data[tile_pos.y * map->size.x + tile_pos.x];
+		if (tile) {
+			float t_enter = t_start;
+			vec2_t enter_normal = start_normal;
+			if (entered_axis == 1) {
+				t_enter = trace_ray_exit_x(o, map, tile_pos.x - step.x, step.x, inv_vel.x);
+				enter_normal = vec2(-step.x, 0);
+			}
+			else if (entered_axis == 2) {
+				t_enter = trace_ray_exit_y(o, map, tile_pos.y - step.y, step.y, inv_vel.y);
+				enter_normal = vec2(0, -step.y);
+			}
+			float t_exit = min(min(tx, ty), t_end);
+			if (trace_ray_resolve_tile(o, map, tile_pos, tile, t_enter, t_exit, entered, enter_normal, &res)) {
+				return res;
+			}
+		}
+		else if (try_skip) {
+			// Find the last tile of this row (or column) that the ray crosses.
+			// If all tiles up to it are empty, continue from there.
+			try_skip = false;
+			if (skip_rows) {
+				float t_leave = min(ty, t_end);
+				int x_last = floorf((from.x + vel.x * t_leave) * inv_ts);
+				while ((x_last - tile_pos.x) * step.x > 0 && trace_ray_exit_x(o, map, x_last - step.x, step.x, inv_vel.x) > t_leave) {
+					x_last -= step.x;
+				}
+				if (
+					(x_last - tile_pos.x) * step.x > 1 && 
+					!map_solid_in_row(map, tile_pos.y, min(tile_pos.x, x_last), max(tile_pos.x, x_last))
+				) {
+					tile_pos.x = x_last;
+					tx = trace_ray_exit_x(o, map, x_last, step.x, inv_vel.x);
+					entered_axis = 1;
+					entered = true;
+				}
+			}
+			else if (skip_cols) {
+				float t_leave = min(tx, t_end);
+				int y_last = floorf((from.y + vel.y * t_leave) * inv_ts);
+				while ((y_last - tile_pos.y) * step.y > 0 && trace_ray_exit_y(o, map, y_last - step.y, step.y, inv_vel.y) > t_leave) {
+					y_last -= step.y;
+				}
+				if (
+					(y_last - tile_pos.y) * step.y > 1 && 
+					!map_solid_in_column(map, tile_pos.x, min(tile_pos.y, y_last), max(tile_pos.y, y_last))
+				) {
+					tile_pos.y = y_last;
+					ty = trace_ray_exit_y(o, map, y_last, step.y, inv_vel.y);
+					entered_axis = 2;
+					entered = true;
+				}
+			}
+		}
+
+		entered = true;
+		if (tx <= ty) {
+			if (tx > t_end) {
+				return res;
+			}
+			tile_pos.x += step.x;
+			if (tile_pos.x < 0 || tile_pos.x >= map->size.x) {
+				return res;
+			}
+			tx += tdx;
+			entered_axis = 1;
+			try_skip |= skip_cols;
+		}
+		else {
+			if (ty > t_end) {
+				return res;
+			}
+			tile_pos.y += step.y;
+			if (tile_pos.y < 0 || tile_pos.y >= map->size.y) {
+				return res;
+			}
+			ty += tdy;
+			entered_axis = 2;
+			try_skip |= skip_rows;
+		}
+	}
+}
+
+static trace_ray_origin_t trace_ray_origin(map_t *map, vec2_t from) {
+	vec2i_t tile = vec2i(floorf(from.x / map->tile_size), floorf(from.y / map->tile_size));
+	return (trace_ray_origin_t){
+		.from = from,
+		.origin_tile = tile,
+		.origin_in_map = 
+			tile.x >= 0 && tile.x < map->size.x && 
+			tile.y >= 0 && tile.y < map->size.y
+	};
+}
+
+trace_t trace_ray(map_t *map, vec2_t from, vec2_t vel) {
+	profiler_zone("trace_ray");
+	trace_ray_origin_t o = trace_ray_origin(map, from);
+	o.vel = vel;
+	return trace_ray_walk(&o, map);
+}
+
+void trace_rays(map_t *map, vec2_t from, vec2_t *vel, trace_t *out, uint32_t n) {
+	profiler_zone("trace_rays");
+	trace_ray_origin_t o = trace_ray_origin(map, from);
+	for (uint32_t i = 0; i < n; i++) {
+		o.vel = vel[i];
+		out[i] = trace_ray_walk(&o, map);
+	}
+}
+
+bool trace_line_of_sight(map_t *map, vec2_t from, vec2_t to) {
+	profiler_zone("trace_line_of_sight");
+	trace_ray_origin_t o = trace_ray_origin(map, from);
+	o.vel = vec2_sub(to, from);
+	return trace_ray_walk(&o, map).tile == 0;
+}
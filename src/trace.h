@@ -2,7 +2,8 @@
 #define HI_TRACE_H
 
 // Trace "sweeps" an axis aligned box over a map (usually a collision_map) and
-// returns the first position and further information of a hit.
+// returns the first position and further information of a hit. Empty parts of
+// the map are skipped with the map's solid bitmaps; see map_update_solid().
 
 #include "types.h"
 #include "map.h"
@@ -28,4 +29,30 @@ typedef struct {
 // Trace map with the AABB's top left corner, the movement vector and size
 trace_t trace(map_t *map, vec2_t from, vec2_t vel, vec2_t size);
 
+// Trace n AABBs at once and write the results to out. Each result is exactly 
+// the same as trace(map, from[i], vel[i], size[i]). For large maps, the 
+// queries are sorted by the map region they start in, so this is faster than
+// calling trace() for a large number of AABBs. This uses temp memory.
+void trace_batch(map_t *map, vec2_t *from, vec2_t *vel, vec2_t *size, trace_t *out, uint32_t n);
+
+// Trace a single point (a ray) from the position along the movement vector. 
+// This is a lot cheaper than trace() with a tiny size. Full tiles are hit when
+// the ray enters them and sloped tiles when it crosses the slope from the open
+// side or enters the tile on its solid side. One-way tiles only block rays that
+// move against their normal. A ray that starts inside a tile is not blocked by
+// that tile, unless it hits its slope. The resulting trace_t is the same as
+// for trace(); pos is the point where the ray was stopped.
+trace_t trace_ray(map_t *map, vec2_t from, vec2_t vel);
+
+// Trace n rays from the same position, e.g. for vision cones or light 
+// occlusion, and write the results to out.
+void trace_rays(map_t *map, vec2_t from, vec2_t *vel, trace_t *out, uint32_t n);
+
+// Whether nothing blocks the ray between from and to
+bool trace_line_of_sight(map_t *map, vec2_t from, vec2_t to);
+
+// Return the fraction of the tile's area that is solid; 1 for full tiles, 0 for
+// empty and one-way tiles and the area behind the slope for sloped tiles.
+float trace_tile_solid_area(uint16_t tile);
+
 #endif
@@ -91,6 +91,61 @@ char *str_format(const char *format, ...) {
 	return buf;
 }
 
+void sort_radix(void *list, uint32_t len, uint32_t size, sort_key_t *keys) {
+	// Count the occurrences of each byte value for all 4 bytes of the key in
+	// one go.
+	uint32_t counts[4][256] = {};
+	for (uint32_t i = 0; i < len; i++) {
+		uint32_t k = keys[i].key;
+		counts[0][(k >>  0) & 0xff]++;
+		counts[1][(k >>  8) & 0xff]++;
+		counts[2][(k >> 16) & 0xff]++;
+		counts[3][(k >> 24) & 0xff]++;
+	}
+
+	// One stable counting sort pass per byte, ping-ponging between the two 
+	// halves of the keys array. Passes where all keys have the same byte 
+	// value (e.g. the high bytes of small ints) are skipped.
+	sort_key_t *src = keys;
+	sort_key_t *dst = keys + len;
+	for (uint32_t pass = 0; pass < 4; pass++) {
+		uint32_t *c = counts[pass];
+		uint32_t shift = pass * 8;
+		if (c[(src[0].key >> shift) & 0xff] == len) {
+			continue;
+		}
+
+		uint32_t sum = 0;
+		for (uint32_t b = 0; b < 256; b++) {
+			uint32_t count = c[b];
+			c[b] = sum;
+			sum += count;
+		}
+
+		for (uint32_t i = 0; i < len; i++) {
+			dst[c[(src[i].key >> shift) & 0xff]++] = src[i];
+		}
+		swap(src, dst);
+	}
+
+	// Rearrange the list according to the sorted keys
+	uint8_t *copy = temp_alloc(len * size);
+	memcpy(copy, list, len * size);
+	if (size == sizeof(void *)) {
+		void **dst_list = list, **src_list = (void **)copy;
+		for (uint32_t i = 0; i < len; i++) {
+			dst_list[i] = src_list[src[i].index];
+		}
+	}
+	else {
+		uint8_t *dst_list = list;
+		for (uint32_t i = 0; i < len; i++) {
+			memcpy(dst_list + i * size, copy + src[i].index * size, size);
+		}
+	}
+	temp_free(copy);
+}
+
 static uint64_t rand_uint64_state[2] = {0xdf900294d8f554a5, 0x170865df4b3201fc};
 
 void rand_seed(uint64_t s) {
@@ -99,6 +154,15 @@ void rand_seed(uint64_t s) {
 	rand_uint64_state[1] = (z ^ (z >> 27)) * 0x94d049bb133111eb;
 }
 
+rand_state_t rand_state(void) {
+	return (rand_state_t){.s = {rand_uint64_state[0], rand_uint64_state[1]}};
+}
+
+void rand_set_state(rand_state_t state) {
+	rand_uint64_state[0] = state.s[0];
+	rand_uint64_state[1] = state.s[1];
+}
+
 uint64_t rand_uint64(void) {
 	// https://prng.di.unimi.it/
     uint64_t s0 = rand_uint64_state[0];
@@ -119,6 +183,7 @@ int32_t rand_int(int32_t min, int32_t max) {
 }
 
 json_t *json_parse(uint8_t *data, uint32_t len) {
+	alloc_subsystem(ALLOC_SUBSYSTEM_JSON);
 	uint32_t size_req = 0;
 	uint32_t tokens_capacity = 1 + len / 2;
 
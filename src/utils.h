@@ -6,6 +6,7 @@
 
 #include <string.h>
 #include "types.h"
+#include "alloc.h"
 #include "../libs/pl_json.h"
 
 #ifdef WIN32
@@ -67,19 +68,121 @@
 // Clear a statically allocated array or structure to 0
 #define clear(A) memset(A, 0, sizeof(A))
 
-// Careful, this is an insertion sort. It's fine for mostly sorted data (i.e. 
-// if you sort the same array for every frame) but will blow up to O(n^2) for
-// unsorted data. FIXME!?
-#define sort(LIST, LEN, COMPARE_FUNC) \
-	for (uint32_t sort_i = 1, sort_j; sort_i < (LEN); sort_i++) { \
-		sort_j = sort_i; \
-		__typeof__((LIST)[0]) sort_temp = (LIST)[sort_j]; \
-		while (sort_j > 0 && COMPARE_FUNC((LIST)[sort_j-1], sort_temp)) { \
-			(LIST)[sort_j] = (LIST)[sort_j-1]; \
-			sort_j--; \
+// The number of element moves per element, that the insertion sort in sort() 
+// and sort_by_key() may do, before giving up and switching to a merge sort or 
+// radix sort respectively. The insertion sort is very fast for mostly sorted 
+// data (i.e. if you sort the same array for every frame) but will blow up to
+// O(n^2) for unsorted data.
+#if !defined(SORT_INSERTION_BUDGET)
+	#define SORT_INSERTION_BUDGET 8
+#endif
+
+// Stable sort with a COMPARE_FUNC(a, b) that returns true if a should go after
+// b. This starts out as an insertion sort and switches to a merge sort when the
+// data turns out to be mostly unsorted. The merge sort uses temp memory.
+#define sort(LIST, LEN, COMPARE_FUNC) do { \
+		uint32_t sort_len = (LEN), sort_budget = sort_len * SORT_INSERTION_BUDGET, sort_i; \
+		for (sort_i = 1; sort_i < sort_len; sort_i++) { \
+			uint32_t sort_j = sort_i; \
+			__typeof__((LIST)[0]) sort_temp = (LIST)[sort_j]; \
+			while (sort_j > 0 && COMPARE_FUNC((LIST)[sort_j-1], sort_temp)) { \
+				(LIST)[sort_j] = (LIST)[sort_j-1]; \
+				sort_j--; \
+			} \
+			(LIST)[sort_j] = sort_temp; \
+			if (sort_i - sort_j > sort_budget) { \
+				break; \
+			} \
+			sort_budget -= sort_i - sort_j; \
 		} \
-		(LIST)[sort_j] = sort_temp; \
-	}
+		if (sort_i < sort_len) { \
+			__typeof__((LIST)[0]) *sort_a = (LIST); \
+			__typeof__((LIST)[0]) *sort_b = temp_alloc(sizeof((LIST)[0]) * sort_len); \
+			__typeof__((LIST)[0]) *sort_buffer = sort_b; \
+			for (uint32_t sort_w = 1; sort_w < sort_len; sort_w *= 2) { \
+				for (uint32_t sort_lo = 0; sort_lo < sort_len; sort_lo += sort_w * 2) { \
+					uint32_t sort_mid = min(sort_lo + sort_w, sort_len); \
+					uint32_t sort_hi = min(sort_lo + sort_w * 2, sort_len); \
+					uint32_t sort_l = sort_lo, sort_r = sort_mid, sort_k = sort_lo; \
+					while (sort_l < sort_mid && sort_r < sort_hi) { \
+						sort_b[sort_k++] = COMPARE_FUNC(sort_a[sort_l], sort_a[sort_r]) \
+							? sort_a[sort_r++] \
+							: sort_a[sort_l++]; \
+					} \
+					while (sort_l < sort_mid) { sort_b[sort_k++] = sort_a[sort_l++]; } \
+					while (sort_r < sort_hi) { sort_b[sort_k++] = sort_a[sort_r++]; } \
+				} \
+				swap(sort_a, sort_b); \
+			} \
+			if (sort_a != (LIST)) { \
+				memcpy((LIST), sort_a, sizeof((LIST)[0]) * sort_len); \
+			} \
+			temp_free(sort_buffer); \
+		} \
+	} while (0)
+
+// Stable sort in ascending order by a key. KEY_FUNC(a) must return a float or
+// an integer (int32_t) key for the element a. E.g.:
+//   #define DRAW_ORDER(e) (e->draw_order)
+//   sort_by_key(draw_entities, len, DRAW_ORDER);
+// This starts out as an insertion sort and switches to an O(n) radix sort when
+// the data turns out to be mostly unsorted. The radix sort uses temp memory.
+#define sort_by_key(LIST, LEN, KEY_FUNC) do { \
+		uint32_t sort_len = (LEN), sort_budget = sort_len * SORT_INSERTION_BUDGET, sort_i; \
+		for (sort_i = 1; sort_i < sort_len; sort_i++) { \
+			uint32_t sort_j = sort_i; \
+			__typeof__((LIST)[0]) sort_temp = (LIST)[sort_j]; \
+			uint32_t sort_temp_key = sort_key(KEY_FUNC(sort_temp)); \
+			while (sort_j > 0 && sort_key(KEY_FUNC((LIST)[sort_j-1])) > sort_temp_key) { \
+				(LIST)[sort_j] = (LIST)[sort_j-1]; \
+				sort_j--; \
+			} \
+			(LIST)[sort_j] = sort_temp; \
+			if (sort_i - sort_j > sort_budget) { \
+				break; \
+			} \
+			sort_budget -= sort_i - sort_j; \
+		} \
+		if (sort_i < sort_len) { \
+			sort_key_t *sort_keys = temp_alloc(sizeof(sort_key_t) * sort_len * 2); \
+			for (uint32_t sort_k = 0; sort_k < sort_len; sort_k++) { \
+				sort_keys[sort_k] = (sort_key_t){.key = sort_key(KEY_FUNC((LIST)[sort_k])), .index = sort_k}; \
+			} \
+			sort_radix((LIST), sort_len, sizeof((LIST)[0]), sort_keys); \
+			temp_free(sort_keys); \
+		} \
+	} while (0)
+
+// Convert a float or int to an unsigned key that sorts in the same order
+#define sort_key(V) _Generic((V), \
+		float: sort_key_from_float, \
+		double: sort_key_from_double, \
+		default: sort_key_from_int \
+	)(V)
+
+static inline uint32_t sort_key_from_float(float f) {
+	// Flip the sign bit for positive values and all bits for negative ones
+	union { float f; uint32_t u; } v = {.f = f};
+	return v.u ^ (-(int32_t)(v.u >> 31) | 0x80000000);
+}
+
+static inline uint32_t sort_key_from_double(double d) {
+	return sort_key_from_float(d);
+}
+
+static inline uint32_t sort_key_from_int(int32_t i) {
+	return (uint32_t)i ^ 0x80000000;
+}
+
+typedef struct {
+	uint32_t key;
+	uint32_t index;
+} sort_key_t;
+
+// Radix sort the keys and rearrange the list with len elements of size bytes 
+// accordingly. keys must have space for 2 * len entries. This is used by 
+// sort_by_key(); you probably don't want to call it directly.
+void sort_radix(void *list, uint32_t len, uint32_t size, sort_key_t *keys);
 
 // A fair Fisher-Yates shuffle
 #define shuffle(LIST, LEN) \
@@ -123,6 +226,15 @@ void rand_seed(uint64_t s);
 // A random uint64_t
 uint64_t rand_uint64(void);
 
+// The complete state of the random number generator
+typedef struct { uint64_t s[2]; } rand_state_t;
+
+// Return the current state of the random number generator
+rand_state_t rand_state(void);
+
+// Set the random number generator to a state returned by rand_state()
+void rand_set_state(rand_state_t state);
+
 // A random float between min and max
 float rand_float(float min, float max);
 